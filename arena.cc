@@ -0,0 +1,168 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdlib>
+#include <new>
+#include <toolbox/expvar.h>
+
+#include "server.h"
+#include "server_internal.h"
+
+namespace http
+{
+namespace server
+{
+using toolbox::ExpVar;
+
+static ExpVar<int64_t> numArenaAllocations(
+		"http-server-arena-allocations");
+static ExpVar<int64_t> numArenaHeapFallbacks(
+		"http-server-arena-heap-fallbacks");
+static ExpVar<int64_t> numHeapObjects("http-server-heap-object-allocations");
+
+Arena::Arena()
+: pos_(initial_), limit_(initial_ + kInitialSize), used_(0), spare_(0)
+{
+}
+
+Arena::~Arena()
+{
+	Reset();
+	::operator delete(spare_);
+}
+
+void*
+Arena::Allocate(size_t size)
+{
+	size = (size + kAlignment - 1) & ~(kAlignment - 1);
+	used_ += size;
+
+	if (size > kMaxArenaAllocation)
+	{
+		void* ptr = ::operator new(size);
+		large_.push_back(ptr);
+		numArenaHeapFallbacks.Add(1);
+		return ptr;
+	}
+
+	if (size > size_t(limit_ - pos_))
+	{
+		// Start a new block. The rest of the current one is wasted,
+		// which is at most kMaxArenaAllocation bytes.
+		char* block = spare_;
+		if (block)
+			spare_ = 0;
+		else
+		{
+			block = static_cast<char*>(::operator new(kBlockSize));
+			numArenaHeapFallbacks.Add(1);
+		}
+		blocks_.push_back(block);
+		pos_ = block;
+		limit_ = block + kBlockSize;
+	}
+
+	void* ptr = pos_;
+	pos_ += size;
+	numArenaAllocations.Add(1);
+	return ptr;
+}
+
+void
+Arena::Reset()
+{
+	for (char* block : blocks_)
+	{
+		if (!spare_)
+			spare_ = block;
+		else
+			::operator delete(block);
+	}
+	for (void* ptr : large_)
+		::operator delete(ptr);
+
+	blocks_.clear();
+	large_.clear();
+	pos_ = initial_;
+	limit_ = initial_ + kInitialSize;
+	used_ = 0;
+}
+
+size_t
+Arena::BytesUsed() const
+{
+	return used_;
+}
+
+// Every ArenaObject is preceded by the arena it was allocated from, or
+// null if it lives on the heap. The header is padded so the object keeps
+// the arena alignment.
+static const size_t kObjectHeader = Arena::kAlignment;
+
+void*
+ArenaObject::operator new(size_t size)
+{
+	return operator new(size, static_cast<Arena*>(0));
+}
+
+void*
+ArenaObject::operator new(size_t size, Arena* arena)
+{
+	char* ptr;
+
+	if (arena)
+		ptr = static_cast<char*>(arena->Allocate(size + kObjectHeader));
+	else
+	{
+		ptr = static_cast<char*>(::operator new(size + kObjectHeader));
+		numHeapObjects.Add(1);
+	}
+
+	*reinterpret_cast<Arena**>(ptr) = arena;
+	return ptr + kObjectHeader;
+}
+
+void
+ArenaObject::operator delete(void* ptr)
+{
+	if (!ptr)
+		return;
+
+	char* base = static_cast<char*>(ptr) - kObjectHeader;
+	if (!*reinterpret_cast<Arena**>(base))
+		::operator delete(base);
+}
+
+void
+ArenaObject::operator delete(void* ptr, Arena* arena)
+{
+	operator delete(ptr);
+}
+}  // namespace server
+}  // namespace http
@@ -0,0 +1,125 @@
+/*
+ * Unit Test for the Request Arena.
+ */
+
+#include "server.h"
+#include "server_internal.h"
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <memory>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+class ArenaTest : public ::testing::Test
+{
+};
+
+// Records its destruction so the tests can see the destructor ran.
+class Tracked : public ArenaObject
+{
+public:
+	Tracked(int* destroyed)
+	: destroyed_(destroyed)
+	{
+	}
+
+	virtual ~Tracked()
+	{
+		(*destroyed_)++;
+	}
+
+private:
+	int* destroyed_;
+};
+
+TEST_F(ArenaTest, AllocateAndReset)
+{
+	Arena arena;
+
+	EXPECT_EQ(0, arena.BytesUsed());
+
+	char* a = static_cast<char*>(arena.Allocate(3));
+	char* b = static_cast<char*>(arena.Allocate(20));
+	EXPECT_EQ(0, reinterpret_cast<uintptr_t>(a) % Arena::kAlignment);
+	EXPECT_EQ(0, reinterpret_cast<uintptr_t>(b) % Arena::kAlignment);
+	EXPECT_EQ(a + Arena::kAlignment, b);
+	EXPECT_EQ(48, arena.BytesUsed());
+
+	arena.Reset();
+	EXPECT_EQ(0, arena.BytesUsed());
+	EXPECT_EQ(a, arena.Allocate(1));
+}
+
+TEST_F(ArenaTest, Overflow)
+{
+	Arena arena;
+	char* first = static_cast<char*>(arena.Allocate(16));
+
+	// Fill up more than the inline block and allocate some things too
+	// large for the arena; all of it must be usable.
+	for (int i = 0; i < 100; i++)
+		memset(arena.Allocate(1000), i, 1000);
+	memset(arena.Allocate(100000), 0, 100000);
+
+	arena.Reset();
+	EXPECT_EQ(first, arena.Allocate(16));
+}
+
+TEST_F(ArenaTest, SpareBlock)
+{
+	Arena arena;
+
+	// Once the inline block is full, the next allocation comes from a
+	// heap block, which is used again after a reset.
+	while (arena.BytesUsed() < 4096)
+		arena.Allocate(1000);
+	char* block = static_cast<char*>(arena.Allocate(1000));
+	arena.Reset();
+	// Would likely take the place of the block had it been freed.
+	std::unique_ptr<char[]> other(new char[8192]);
+	while (arena.BytesUsed() < 4096)
+		arena.Allocate(1000);
+	EXPECT_EQ(block, arena.Allocate(1000));
+}
+
+TEST_F(ArenaTest, Objects)
+{
+	Arena arena;
+	int destroyed = 0;
+
+	Tracked* in_arena = new (&arena) Tracked(&destroyed);
+	Tracked* on_heap = new Tracked(&destroyed);
+	EXPECT_EQ(0, reinterpret_cast<uintptr_t>(in_arena) %
+			Arena::kAlignment);
+
+	delete in_arena;
+	delete on_heap;
+	EXPECT_EQ(2, destroyed);
+
+	Request req;
+	Headers* hdr = new (&arena) Headers;
+	hdr->Set(kHost, "www.example.com");
+	Cookie* ck = new (&arena) Cookie;
+	ck->name = "SID";
+	req.SetHeaders(hdr);
+	req.AddCookie(ck);
+	EXPECT_EQ("www.example.com", req.Host());
+
+	// Cookies sent by the client come from the arena of the request.
+	Request sent;
+	hdr = new (&arena) Headers;
+	hdr->Set(kCookie, "a=1; b=2");
+	sent.SetHeaders(hdr);
+	sent.SetArena(&arena);
+	size_t used = arena.BytesUsed();
+	EXPECT_EQ(2, sent.GetCookies().size());
+	EXPECT_LE(used + 2 * sizeof(Cookie), arena.BytesUsed());
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
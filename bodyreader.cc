@@ -0,0 +1,236 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <strings.h>
+#include <zlib.h>
+
+#include "server.h"
+#include "server_internal.h"
+
+namespace http
+{
+namespace server
+{
+using std::string;
+
+// Size of the blocks data is decoded in.
+static const size_t kDecodeBlockSize = 16384;
+
+// An inflate stream kept around for reuse by one thread, since setting up
+// a stream is a lot more expensive than resetting one.
+class Inflater
+{
+public:
+	Inflater()
+	: initialized_(false), in_use_(false)
+	{
+	}
+
+	~Inflater()
+	{
+		if (initialized_)
+			inflateEnd(&zs_);
+	}
+
+	// Gets the stream, reset for a new gzip or zlib stream. Returns null
+	// if it's already being used or can't be set up.
+	z_stream* Acquire()
+	{
+		if (in_use_)
+			return 0;
+
+		if (initialized_)
+			inflateReset(&zs_);
+		else
+		{
+			memset(&zs_, 0, sizeof(zs_));
+			if (inflateInit2(&zs_, 15 + 32) != Z_OK)
+				return 0;
+			initialized_ = true;
+		}
+
+		in_use_ = true;
+		return &zs_;
+	}
+
+	// Gives the stream back after use.
+	void Release()
+	{
+		in_use_ = false;
+	}
+
+private:
+	z_stream zs_;
+	bool initialized_;
+	bool in_use_;
+};
+
+static thread_local Inflater inflater;
+
+BodyReader::BodyReader(const Request* req, size_t max_size)
+: body_(req->GetRequestBody()), remaining_(0), max_size_(max_size),
+	decoded_(0), zs_(0), own_zs_(false), status_(kData)
+{
+	const Headers* h = req->GetHeaders();
+
+	if (!body_ || !h)
+	{
+		status_ = kEnd;
+		return;
+	}
+
+	remaining_ = strtoul(h->GetFirst(kContentLength).c_str(), NULL, 10);
+
+	const string& coding = h->GetFirst(kContentEncoding);
+	if (coding.empty() || strcasecmp(coding.c_str(), "identity") == 0)
+		return;
+
+	// Both gzip and zlib streams are recognized by their header.
+	if (strcasecmp(coding.c_str(), "gzip") != 0 &&
+			strcasecmp(coding.c_str(), "x-gzip") != 0 &&
+			strcasecmp(coding.c_str(), "deflate") != 0)
+	{
+		status_ = kInvalid;
+		return;
+	}
+
+	zs_ = inflater.Acquire();
+	if (!zs_)
+	{
+		zs_ = new z_stream;
+		memset(zs_, 0, sizeof(*zs_));
+		own_zs_ = true;
+		if (inflateInit2(zs_, 15 + 32) != Z_OK)
+			status_ = kInvalid;
+	}
+}
+
+BodyReader::~BodyReader()
+{
+	if (own_zs_)
+	{
+		inflateEnd(zs_);
+		delete zs_;
+	}
+	else if (zs_)
+		inflater.Release();
+}
+
+BodyReader::Status
+BodyReader::Read(string* data)
+{
+	if (status_ != kData)
+		return status_;
+
+	if (remaining_ == 0)
+	{
+		// A compressed body has to end with its stream.
+		status_ = zs_ ? kInvalid : kEnd;
+		return status_;
+	}
+
+	body_->SetBlocking(true);
+	string in = body_->Receive();
+	if (in.empty())
+	{
+		status_ = kInvalid;
+		return status_;
+	}
+	if (in.length() > remaining_)
+		in.resize(remaining_);
+	remaining_ -= in.length();
+
+	if (!zs_)
+	{
+		if (decoded_ + in.length() > max_size_)
+			return status_ = kTooLarge;
+		decoded_ += in.length();
+		data->append(in);
+		return kData;
+	}
+
+	zs_->next_in = reinterpret_cast<Bytef*>(&in[0]);
+	zs_->avail_in = in.length();
+
+	do
+	{
+		size_t start = data->length();
+		data->resize(start + kDecodeBlockSize);
+		zs_->next_out = reinterpret_cast<Bytef*>(&(*data)[start]);
+		zs_->avail_out = kDecodeBlockSize;
+
+		int ret = inflate(zs_, Z_NO_FLUSH);
+		size_t produced = kDecodeBlockSize - zs_->avail_out;
+		data->resize(start + produced);
+		decoded_ += produced;
+
+		if (decoded_ > max_size_)
+			return status_ = kTooLarge;
+
+		if (ret == Z_STREAM_END)
+		{
+			// Anything after the compressed stream is ignored.
+			status_ = kEnd;
+			return kData;
+		}
+
+		// No progress is possible without more input.
+		if (ret == Z_BUF_ERROR)
+			break;
+
+		if (ret != Z_OK)
+			return status_ = kInvalid;
+	}
+	// A full output block means there may be more output pending.
+	while (zs_->avail_in > 0 || zs_->avail_out == 0);
+
+	return kData;
+}
+
+BodyReader::Status
+BodyReader::ReadAll(string* data)
+{
+	Status status;
+
+	while ((status = Read(data)) == kData);
+
+	return status;
+}
+
+size_t
+BodyReader::BytesRead() const
+{
+	return decoded_;
+}
+}  // namespace server
+}  // namespace http
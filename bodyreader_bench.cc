@@ -0,0 +1,193 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Benchmark for the request body reader, measuring the decoding throughput
+// for identity and gzip bodies of various sizes, compared to setting up a
+// new inflate stream for every body.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <string>
+
+#include <siot/connection.h>
+#include <zlib.h>
+
+#include "server.h"
+
+using http::server::BodyReader;
+using http::server::Headers;
+using http::server::Request;
+using std::string;
+using toolbox::siot::Connection;
+
+// Connection handing out the same body over and over, in 16KB pieces.
+class ReplayConnection : public Connection
+{
+public:
+	void Rewind()
+	{
+		pos = 0;
+	}
+
+	virtual string Receive()
+	{
+		string ret = body.substr(pos, 16384);
+		pos += ret.length();
+		return ret;
+	}
+
+	string body;
+	size_t pos;
+};
+
+// Builds size bytes of JSON-like data.
+static string
+MakeData(size_t size)
+{
+	string ret;
+	for (int i = 0; ret.length() < size; i++)
+		ret += "{\"event\":\"click\",\"seq\":" + std::to_string(i) +
+			",\"target\":\"#button\"},";
+	ret.resize(size);
+	return ret;
+}
+
+static string
+Gzip(const string& data)
+{
+	z_stream zs;
+	string ret;
+
+	memset(&zs, 0, sizeof(zs));
+	deflateInit2(&zs, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+	ret.resize(deflateBound(&zs, data.length()));
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	zs.avail_in = data.length();
+	zs.next_out = reinterpret_cast<Bytef*>(&ret[0]);
+	zs.avail_out = ret.length();
+	deflate(&zs, Z_FINISH);
+	ret.resize(zs.total_out);
+	deflateEnd(&zs);
+	return ret;
+}
+
+// Reads the body with the per-thread stream of BodyReader.
+static size_t
+ReadBody(Request* req, ReplayConnection* conn)
+{
+	BodyReader reader(req, 1 << 24);
+	string body;
+
+	conn->Rewind();
+	reader.ReadAll(&body);
+	return body.length();
+}
+
+// What decoding costs with a new inflate stream for every body.
+static size_t
+InflateFresh(Request* req, ReplayConnection* conn)
+{
+	z_stream zs;
+	string body;
+	char buf[16384];
+	int ret = Z_OK;
+
+	conn->Rewind();
+	memset(&zs, 0, sizeof(zs));
+	inflateInit2(&zs, 15 + 32);
+	while (ret == Z_OK)
+	{
+		string in = conn->Receive();
+		if (in.empty())
+			break;
+
+		zs.next_in = reinterpret_cast<Bytef*>(&in[0]);
+		zs.avail_in = in.length();
+		do
+		{
+			zs.next_out = reinterpret_cast<Bytef*>(buf);
+			zs.avail_out = sizeof(buf);
+			ret = inflate(&zs, Z_NO_FLUSH);
+			body.append(buf, sizeof(buf) - zs.avail_out);
+		}
+		while (ret == Z_OK && zs.avail_out == 0);
+	}
+	inflateEnd(&zs);
+	return body.length();
+}
+
+template<typename Func>
+static void
+Run(const char* name, const char* coding, size_t size, Func func)
+{
+	const size_t total = 256 << 20;
+	const int iterations = total / size;
+	string data = MakeData(size);
+	ReplayConnection conn;
+	Request req;
+	Headers* h = new Headers;
+	size_t decoded = 0;
+
+	conn.body = coding ? Gzip(data) : data;
+	h->Set(http::server::kContentLength,
+			std::to_string(conn.body.length()));
+	if (coding)
+		h->Set(http::server::kContentEncoding, coding);
+	req.SetHeaders(h);
+	req.SetRequestBody(&conn);
+
+	std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++)
+		decoded += func(&req, &conn);
+	std::chrono::steady_clock::time_point end =
+		std::chrono::steady_clock::now();
+
+	double secs = std::chrono::duration<double>(end - start).count();
+	printf("%-10s %-9s %8zu %12.1f %12.1f\n", name,
+			coding ? coding : "identity", size,
+			decoded / secs / 1e6, secs * 1e9 / iterations);
+}
+
+int main(void)
+{
+	printf("%-10s %-9s %8s %12s %12s\n", "variant", "coding", "size",
+			"MB/s", "ns/body");
+
+	for (size_t size : { 512, 4096, 65536, 1048576 })
+	{
+		Run("reader", 0, size, ReadBody);
+		Run("reader", "gzip", size, ReadBody);
+		Run("fresh", "gzip", size, InflateFresh);
+	}
+
+	return 0;
+}
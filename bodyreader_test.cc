@@ -0,0 +1,154 @@
+/*
+ * Unit Test for the Request Body Reader.
+ */
+
+#include "server.h"
+#include <gtest/gtest.h>
+
+#include <siot/connection.h>
+
+#include <list>
+#include <string>
+#include <zlib.h>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+// Connection returning the given pieces of data, one per Receive().
+class ReplayConnection : public Connection
+{
+public:
+	virtual string Receive()
+	{
+		if (pieces.empty())
+			return "";
+
+		string ret = pieces.front();
+		pieces.pop_front();
+		return ret;
+	}
+
+	std::list<string> pieces;
+};
+
+// Compresses data in the gzip or zlib format.
+static string
+Compress(const string& data, bool gzip)
+{
+	z_stream zs = {};
+	string ret;
+
+	EXPECT_EQ(Z_OK, deflateInit2(&zs, 9, Z_DEFLATED, gzip ? 31 : 15, 8,
+				Z_DEFAULT_STRATEGY));
+	ret.resize(deflateBound(&zs, data.length()));
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	zs.avail_in = data.length();
+	zs.next_out = reinterpret_cast<Bytef*>(&ret[0]);
+	zs.avail_out = ret.length();
+	EXPECT_EQ(Z_STREAM_END, deflate(&zs, Z_FINISH));
+	ret.resize(zs.total_out);
+	deflateEnd(&zs);
+	return ret;
+}
+
+class BodyReaderTest : public ::testing::Test
+{
+protected:
+	// Set up req to have the given body, received in pieces of at most
+	// piece_size bytes.
+	void SetBody(Request* req, const string& body, const string& coding,
+			size_t piece_size = 1000)
+	{
+		Headers* h = new Headers;
+		h->Set(kContentLength, std::to_string(body.length()));
+		if (!coding.empty())
+			h->Set(kContentEncoding, coding);
+		req->SetHeaders(h);
+
+		for (size_t pos = 0; pos < body.length(); pos += piece_size)
+			conn_.pieces.push_back(body.substr(pos, piece_size));
+		req->SetRequestBody(&conn_);
+	}
+
+	ReplayConnection conn_;
+};
+
+TEST_F(BodyReaderTest, Identity)
+{
+	Request req;
+	string body(5000, 'x'), data;
+	SetBody(&req, body, "");
+
+	BodyReader reader(&req, 10000);
+	EXPECT_EQ(BodyReader::kData, reader.Read(&data));
+	EXPECT_EQ(1000, data.length());
+	EXPECT_EQ(BodyReader::kEnd, reader.ReadAll(&data));
+	EXPECT_EQ(body, data);
+	EXPECT_EQ(5000, reader.BytesRead());
+}
+
+TEST_F(BodyReaderTest, Gzip)
+{
+	string json;
+	for (int i = 0; i < 5000; i++)
+		json += "{\"event\":\"click\",\"seq\":" + std::to_string(i) +
+			"},";
+
+	for (const char* coding : { "gzip", "deflate" })
+	{
+		Request req;
+		string data;
+		SetBody(&req, Compress(json, coding[0] == 'g'), coding, 100);
+
+		BodyReader reader(&req, 1 << 20);
+		EXPECT_EQ(BodyReader::kEnd, reader.ReadAll(&data)) << coding;
+		EXPECT_EQ(json, data) << coding;
+	}
+}
+
+TEST_F(BodyReaderTest, TooLarge)
+{
+	Request req, plain;
+	string data;
+
+	// A megabyte of zeroes compresses to about a kilobyte.
+	SetBody(&req, Compress(string(1 << 20, '\0'), true), "gzip");
+	BodyReader reader(&req, 65536);
+	EXPECT_EQ(BodyReader::kTooLarge, reader.ReadAll(&data));
+	EXPECT_GE(65536 + 16384, data.length());
+
+	ReplayConnection conn;
+	conn.pieces.push_back(string(100, 'x'));
+	Headers* h = new Headers;
+	h->Set(kContentLength, "100");
+	plain.SetHeaders(h);
+	plain.SetRequestBody(&conn);
+	BodyReader limited(&plain, 99);
+	EXPECT_EQ(BodyReader::kTooLarge, limited.Read(&data));
+}
+
+TEST_F(BodyReaderTest, Invalid)
+{
+	Request truncated, corrupt, unknown;
+	string compressed = Compress(string(10000, 'a'), true);
+	string data;
+
+	SetBody(&truncated, compressed.substr(0, compressed.length() / 2),
+			"gzip");
+	EXPECT_EQ(BodyReader::kInvalid,
+			BodyReader(&truncated, 1 << 20).ReadAll(&data));
+
+	SetBody(&corrupt, "this is not gzip", "gzip");
+	EXPECT_EQ(BodyReader::kInvalid,
+			BodyReader(&corrupt, 1 << 20).ReadAll(&data));
+
+	SetBody(&unknown, "whatever", "br");
+	EXPECT_EQ(BodyReader::kInvalid,
+			BodyReader(&unknown, 1 << 20).ReadAll(&data));
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
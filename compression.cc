@@ -0,0 +1,488 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <strings.h>
+#include <zlib.h>
+
+#include "server.h"
+#include "server_internal.h"
+
+namespace http
+{
+namespace server
+{
+using std::string;
+
+// Size of the blocks compressed data is passed on in.
+static const size_t kOutputBlockSize = 16384;
+
+// A deflate stream kept around for reuse by one thread, since setting up
+// a stream is a lot more expensive than resetting one.
+class Deflater
+{
+public:
+	Deflater()
+	: initialized_(false), in_use_(false), level_(0), window_bits_(0)
+	{
+	}
+
+	~Deflater()
+	{
+		if (initialized_)
+			deflateEnd(&zs_);
+	}
+
+	// Gets the stream, reset and set up for the given parameters. Returns
+	// null if it's already being used or can't be set up.
+	z_stream* Acquire(int level, int window_bits)
+	{
+		if (in_use_)
+			return 0;
+
+		if (initialized_ && (level != level_ ||
+					window_bits != window_bits_))
+		{
+			deflateEnd(&zs_);
+			initialized_ = false;
+		}
+
+		if (initialized_)
+			deflateReset(&zs_);
+		else
+		{
+			memset(&zs_, 0, sizeof(zs_));
+			if (deflateInit2(&zs_, level, Z_DEFLATED, window_bits,
+						8, Z_DEFAULT_STRATEGY) != Z_OK)
+				return 0;
+			initialized_ = true;
+			level_ = level;
+			window_bits_ = window_bits;
+		}
+
+		in_use_ = true;
+		return &zs_;
+	}
+
+	// Gives the stream back after use.
+	void Release()
+	{
+		in_use_ = false;
+	}
+
+private:
+	z_stream zs_;
+	bool initialized_;
+	bool in_use_;
+	int level_;
+	int window_bits_;
+};
+
+static thread_local Deflater deflater;
+
+CompressionOptions::CompressionOptions()
+: level(Z_DEFAULT_COMPRESSION), min_size(1024)
+{
+	types.push_back("text/");
+	types.push_back("application/json");
+	types.push_back("application/javascript");
+	types.push_back("application/xml");
+	types.push_back("image/svg+xml");
+}
+
+bool
+AcceptsEncoding(const string& accept, const char* coding)
+{
+	size_t len = strlen(coding);
+	size_t pos = 0;
+
+	while (pos < accept.length())
+	{
+		size_t end = accept.find(',', pos);
+		if (end == string::npos)
+			end = accept.length();
+
+		while (pos < end && accept[pos] == ' ')
+			pos++;
+		if (strncasecmp(accept.c_str() + pos, coding, len) == 0 &&
+				(pos + len == end || accept[pos + len] == ';' ||
+				 accept[pos + len] == ' '))
+		{
+			// Anything but an explicit "q=0" is fine.
+			size_t q = accept.find("q=", pos);
+			return q >= end || strtod(accept.c_str() + q + 2, 0) > 0;
+		}
+
+		pos = end + 1;
+	}
+
+	return false;
+}
+
+// Response writer compressing the body it is given on the fly, if the
+// response is large enough and of a suitable type. Compressed data is
+// passed on to the underlying writer in blocks, and every write made once
+// compression has started is flushed through, so streamed responses reach
+// the client as they are written.
+class CompressingResponseWriter : public ResponseWriter
+{
+public:
+	// Compress responses to req written to w, using the given coding
+	// ("gzip" or "deflate"), or none if coding is null; responses which
+	// could have been compressed are still marked as varying then. For
+	// HEAD requests, the headers are chosen as for GET, but the body is
+	// dropped rather than compressed.
+	CompressingResponseWriter(ResponseWriter* w,
+			const CompressionOptions& options, const char* coding,
+			bool head);
+	virtual ~CompressingResponseWriter();
+
+	// Implements ResponseWriter.
+	using ResponseWriter::Write;
+	virtual void AddHeaders(const Headers& to_add);
+	virtual void WriteHeader(int status_code, string message = "OK");
+	virtual int Write(const char* data, size_t length);
+	virtual int SendFile(int fd, off_t offset, size_t length);
+
+	// Passes on everything still held back. Must be called once the
+	// handler is done.
+	void Close();
+
+private:
+	enum State
+	{
+		kUndecided,
+		kPassthrough,
+		kCompressing,
+	};
+
+	// Decides whether to compress the response and writes the head.
+	// large tells whether enough of the body has been written to be worth
+	// compressing.
+	void Start(bool large);
+
+	// Whether the response is suitable for compression.
+	bool Compressible() const;
+
+	// Feeds data to the compressor, passing on its output.
+	int Deflate(const char* data, size_t length, int flush);
+
+	ResponseWriter* w_;
+	const CompressionOptions& options_;
+	const char* coding_;
+	const bool head_;
+	Headers headers_;
+	string message_;
+	int status_code_;
+	State state_;
+	z_stream* zs_;
+	z_stream own_zs_;
+
+	// Data held back until it's clear whether it's worth compressing.
+	string held_;
+};
+
+CompressingResponseWriter::CompressingResponseWriter(ResponseWriter* w,
+		const CompressionOptions& options, const char* coding, bool head)
+: w_(w), options_(options), coding_(coding), head_(head), status_code_(0),
+	state_(kUndecided), zs_(0)
+{
+}
+
+CompressingResponseWriter::~CompressingResponseWriter()
+{
+	if (zs_ == &own_zs_)
+		deflateEnd(&own_zs_);
+	else if (zs_)
+		deflater.Release();
+}
+
+void
+CompressingResponseWriter::AddHeaders(const Headers& to_add)
+{
+	if (state_ == kUndecided)
+		headers_.Merge(to_add);
+	else
+		w_->AddHeaders(to_add);
+}
+
+void
+CompressingResponseWriter::WriteHeader(int status_code, string message)
+{
+	if (status_code_)
+		return;
+
+	status_code_ = status_code;
+	message_.swap(message);
+}
+
+bool
+CompressingResponseWriter::Compressible() const
+{
+	// Partial and empty responses can't be compressed, and neither can
+	// already encoded ones.
+	if (status_code_ < 200 || status_code_ == 204 ||
+			status_code_ == 206 || status_code_ == 304 ||
+			headers_.Get(kContentEncoding))
+		return false;
+
+	const string& type = headers_.GetFirst(kContentType);
+	for (const string& prefix : options_.types)
+		if (strncasecmp(type.c_str(), prefix.c_str(),
+					prefix.length()) == 0)
+			return true;
+
+	return false;
+}
+
+void
+CompressingResponseWriter::Start(bool large)
+{
+	int window_bits = coding_ && strcmp(coding_, "gzip") == 0 ?
+		15 + 16 : 15;
+
+	if (!status_code_)
+		status_code_ = 200;
+
+	// Handlers may leave out the body of responses to HEAD requests, so
+	// the announced length counts as well.
+	const string& length = headers_.GetFirst(kContentLength);
+	if (!length.empty() &&
+			strtoull(length.c_str(), 0, 10) >= options_.min_size)
+		large = true;
+	if (!coding_)
+		large = false;
+
+	state_ = kPassthrough;
+	if (Compressible())
+	{
+		// Caches have to know the response depends on the request.
+		headers_.Add("Vary", "Accept-Encoding");
+
+		if (large && !head_)
+		{
+			zs_ = deflater.Acquire(options_.level, window_bits);
+			if (!zs_)
+			{
+				zs_ = &own_zs_;
+				memset(&own_zs_, 0, sizeof(own_zs_));
+				if (deflateInit2(&own_zs_, options_.level,
+							Z_DEFLATED,
+							window_bits, 8,
+							Z_DEFAULT_STRATEGY) !=
+						Z_OK)
+					zs_ = 0;
+			}
+		}
+
+		if (zs_ || (large && head_))
+		{
+			// The compressed body isn't the same as the original
+			// one, so it can't have the same strong validator.
+			string etag = headers_.GetFirst("ETag");
+			if (!etag.empty() && etag.compare(0, 2, "W/") != 0)
+				headers_.Set("ETag", "W/" + etag);
+
+			headers_.Delete(kContentLength);
+			headers_.Set(kContentEncoding, coding_);
+			if (zs_)
+				state_ = kCompressing;
+		}
+	}
+
+	w_->AddHeaders(headers_);
+	w_->WriteHeader(status_code_, message_);
+}
+
+int
+CompressingResponseWriter::Write(const char* data, size_t length)
+{
+	// The body of responses to HEAD requests only counts for the
+	// decision, it isn't sent.
+	if (head_ && state_ != kUndecided)
+		return length;
+
+	// Nothing is going to be compressed, so there's nothing to wait
+	// for.
+	if (state_ == kUndecided && !coding_)
+		Start(false);
+
+	if (state_ == kUndecided)
+	{
+		held_.append(data, length);
+		if (held_.length() < options_.min_size)
+			return length;
+
+		Start(true);
+		string held;
+		held.swap(held_);
+		if (head_)
+			return length;
+		if (state_ == kPassthrough)
+			return w_->Write(std::move(held)) < 0 ? -1 : length;
+		return Deflate(held.data(), held.length(), Z_SYNC_FLUSH) < 0 ?
+			-1 : length;
+	}
+
+	if (state_ == kPassthrough)
+		return w_->Write(data, length);
+
+	// Flushing costs a few bytes per write, but otherwise the data
+	// might sit in the compressor until the response is done.
+	return Deflate(data, length, Z_SYNC_FLUSH) < 0 ? -1 : length;
+}
+
+int
+CompressingResponseWriter::SendFile(int fd, off_t offset, size_t length)
+{
+	if (state_ == kUndecided && !coding_)
+		Start(false);
+
+	// Files which aren't compressed are passed on as they are.
+	if (state_ == kPassthrough)
+		return head_ ? length : w_->SendFile(fd, offset, length);
+
+	return ResponseWriter::SendFile(fd, offset, length);
+}
+
+int
+CompressingResponseWriter::Deflate(const char* data, size_t length,
+		int flush)
+{
+	char out[kOutputBlockSize];
+	int ret;
+
+	zs_->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	zs_->avail_in = length;
+
+	do
+	{
+		zs_->next_out = reinterpret_cast<Bytef*>(out);
+		zs_->avail_out = sizeof(out);
+
+		ret = deflate(zs_, flush);
+		if (ret == Z_STREAM_ERROR)
+			return -1;
+
+		size_t produced = sizeof(out) - zs_->avail_out;
+		if (produced > 0 && w_->Write(out, produced) < 0)
+			return -1;
+	}
+	// Keep going while the output buffer is filled up, since there may
+	// be more to come.
+	while (zs_->avail_out == 0 || zs_->avail_in > 0 ||
+			(flush == Z_FINISH && ret != Z_STREAM_END));
+
+	return length;
+}
+
+void
+CompressingResponseWriter::Close()
+{
+	if (state_ == kUndecided)
+	{
+		// Too small to be worth compressing, unless the handler said
+		// otherwise.
+		Start(false);
+		string held;
+		held.swap(held_);
+		if (state_ == kCompressing && !held.empty())
+			Deflate(held.data(), held.length(), Z_NO_FLUSH);
+		else if (!head_ && !held.empty())
+			w_->Write(std::move(held));
+	}
+
+	if (state_ == kCompressing)
+		Deflate(0, 0, Z_FINISH);
+}
+
+// Compresses the responses of another handler.
+class CompressingHandlerImpl : public Handler
+{
+public:
+	CompressingHandlerImpl(Handler* handler,
+			const CompressionOptions& options);
+	virtual ~CompressingHandlerImpl();
+
+	// Serve the request through the other handler, compressing the
+	// response if the client allows it.
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req);
+
+private:
+	Handler* handler_;
+	CompressionOptions options_;
+};
+
+CompressingHandlerImpl::CompressingHandlerImpl(Handler* handler,
+		const CompressionOptions& options)
+: handler_(handler), options_(options)
+{
+}
+
+CompressingHandlerImpl::~CompressingHandlerImpl()
+{
+}
+
+void
+CompressingHandlerImpl::ServeHTTP(ResponseWriter* w, const Request* req)
+{
+	const Headers* rh = req->GetHeaders();
+	const char* coding = 0;
+
+	if (rh)
+	{
+		const string& accept = rh->GetFirst(kAcceptEncoding);
+		if (AcceptsEncoding(accept, "gzip"))
+			coding = "gzip";
+		else if (AcceptsEncoding(accept, "deflate"))
+			coding = "deflate";
+	}
+
+	// HEAD requests go through the same decision, so they get the same
+	// headers as GET. Responses which aren't compressed for this client
+	// still get the Vary header, or caches would hand them out to
+	// everyone.
+	CompressingResponseWriter cw(w, options_, coding,
+			coding && req->Method() == kMethodHead);
+	handler_->ServeHTTP(&cw, req);
+	cw.Close();
+}
+
+Handler*
+Handler::CompressingHandler(Handler* handler,
+		const CompressionOptions& options)
+{
+	return new CompressingHandlerImpl(handler, options);
+}
+}  // namespace server
+}  // namespace http
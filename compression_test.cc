@@ -0,0 +1,289 @@
+/*
+ * Unit Test for the Response Compression.
+ */
+
+#include "server.h"
+#include "server_internal.h"
+#include <gtest/gtest.h>
+
+#include <string>
+#include <zlib.h>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+// Response writer recording the response.
+class RecordingWriter : public ResponseWriter
+{
+public:
+	RecordingWriter()
+	: status(0), writes(0)
+	{
+	}
+
+	virtual void AddHeaders(const Headers& to_add)
+	{
+		headers.Merge(to_add);
+	}
+
+	virtual void WriteHeader(int status_code, string message)
+	{
+		if (!status)
+			status = status_code;
+	}
+
+	using ResponseWriter::Write;
+	virtual int Write(const char* data, size_t length)
+	{
+		if (!status)
+			status = 200;
+		body.append(data, length);
+		writes++;
+		return length;
+	}
+
+	int status;
+	int writes;
+	Headers headers;
+	string body;
+};
+
+// Handler writing the given body in pieces of 100 bytes, except for HEAD
+// requests.
+class BodyHandler : public Handler
+{
+public:
+	BodyHandler(const string& type, const string& body)
+	: type_(type), body_(body)
+	{
+	}
+
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+		Headers h;
+		h.Set(kContentType, type_);
+		h.Set(kContentLength, std::to_string(body_.length()));
+		w->AddHeaders(headers);
+		w->AddHeaders(h);
+		if (req->Method() == kMethodHead)
+			return;
+		for (size_t pos = 0; pos < body_.length(); pos += 100)
+			w->Write(StringPiece(body_).substr(pos, 100));
+	}
+
+	// Additional headers to send.
+	Headers headers;
+
+private:
+	string type_;
+	string body_;
+};
+
+// Handler writing a large body followed by a small one, noting what has
+// reached the underlying writer by then.
+class StreamingHandler : public Handler
+{
+public:
+	explicit StreamingHandler(RecordingWriter* w)
+	: w_(w)
+	{
+	}
+
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+		Headers h;
+		h.Set(kContentType, "text/plain");
+		w->AddHeaders(h);
+		w->Write(string(4096, 'x'));
+		w->Write("tail");
+		sent = w_->body;
+	}
+
+	string sent;
+
+private:
+	RecordingWriter* w_;
+};
+
+// Decompresses gzip or zlib data, which may be incomplete if partial is
+// set.
+static string
+Inflate(const string& data, bool partial = false)
+{
+	z_stream zs = {};
+	string ret;
+	char buf[4096];
+
+	EXPECT_EQ(Z_OK, inflateInit2(&zs, 15 + 32));
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	zs.avail_in = data.length();
+	int err;
+	do
+	{
+		zs.next_out = reinterpret_cast<Bytef*>(buf);
+		zs.avail_out = sizeof(buf);
+		err = inflate(&zs, Z_NO_FLUSH);
+		ret.append(buf, sizeof(buf) - zs.avail_out);
+	}
+	while (err == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0));
+	if (partial)
+		EXPECT_TRUE(err == Z_OK || err == Z_BUF_ERROR);
+	else
+		EXPECT_EQ(Z_STREAM_END, err);
+	inflateEnd(&zs);
+	return ret;
+}
+
+class CompressionTest : public ::testing::Test
+{
+protected:
+	// Serve a request accepting the given encodings through handler.
+	void Serve(Handler* handler, const string& accept,
+			RecordingWriter* w, RequestMethod method = kMethodGet)
+	{
+		ScopedPtr<Handler> compressing(
+				Handler::CompressingHandler(handler));
+		Request req;
+		Headers* h = new Headers;
+		h->Set(kAcceptEncoding, accept);
+		req.SetHeaders(h);
+		req.SetMethod(method);
+		compressing->ServeHTTP(w, &req);
+	}
+};
+
+TEST_F(CompressionTest, AcceptsEncoding)
+{
+	EXPECT_TRUE(AcceptsEncoding("gzip", "gzip"));
+	EXPECT_TRUE(AcceptsEncoding("deflate, GZIP;q=0.5", "gzip"));
+	EXPECT_FALSE(AcceptsEncoding("gzip;q=0", "gzip"));
+	EXPECT_FALSE(AcceptsEncoding("x-gzip, br", "gzip"));
+	EXPECT_FALSE(AcceptsEncoding("", "gzip"));
+}
+
+TEST_F(CompressionTest, Gzip)
+{
+	string json;
+	for (int i = 0; i < 1000; i++)
+		json += "{\"id\":" + std::to_string(i) + ",\"name\":\"x\"},";
+	BodyHandler handler("application/json", json);
+	RecordingWriter w;
+
+	Serve(&handler, "gzip, deflate", &w);
+
+	EXPECT_EQ(200, w.status);
+	EXPECT_EQ("gzip", w.headers.GetFirst(kContentEncoding));
+	EXPECT_EQ("Accept-Encoding", w.headers.GetFirst("Vary"));
+	EXPECT_EQ(0, w.headers.Get(kContentLength));
+	EXPECT_EQ("\x1f\x8b", w.body.substr(0, 2));
+	EXPECT_GT(json.length() / 4, w.body.length());
+	EXPECT_EQ(json, Inflate(w.body));
+
+	// The per-thread stream is reused for the next response.
+	RecordingWriter again;
+	Serve(&handler, "deflate", &again);
+	EXPECT_EQ("deflate", again.headers.GetFirst(kContentEncoding));
+	EXPECT_EQ(json, Inflate(again.body));
+}
+
+TEST_F(CompressionTest, Uncompressed)
+{
+	BodyHandler small("text/plain", "Hello, World!");
+	BodyHandler image("image/png", string(4096, 'x'));
+	RecordingWriter too_small, wrong_type, not_accepted;
+
+	Serve(&small, "gzip", &too_small);
+	Serve(&image, "gzip", &wrong_type);
+	Serve(&image, "br", &not_accepted);
+
+	EXPECT_EQ("Hello, World!", too_small.body);
+	EXPECT_EQ(0, too_small.headers.Get(kContentEncoding));
+	EXPECT_EQ("13", too_small.headers.GetFirst(kContentLength));
+	EXPECT_EQ(1, too_small.writes);
+	EXPECT_EQ(string(4096, 'x'), wrong_type.body);
+	EXPECT_EQ(0, wrong_type.headers.Get(kContentEncoding));
+	EXPECT_EQ(string(4096, 'x'), not_accepted.body);
+}
+
+TEST_F(CompressionTest, Vary)
+{
+	BodyHandler text("text/plain", string(4096, 'x'));
+	BodyHandler image("image/png", string(4096, 'x'));
+	RecordingWriter plain, other, none, png;
+
+	// Caches mustn't hand out the uncompressed response to clients
+	// which would have gotten it compressed.
+	Serve(&text, "br", &plain);
+	Serve(&text, "gzip;q=0", &other);
+	Serve(&text, "", &none);
+	Serve(&image, "", &png);
+
+	EXPECT_EQ(string(4096, 'x'), plain.body);
+	EXPECT_EQ(0, plain.headers.Get(kContentEncoding));
+	EXPECT_EQ("Accept-Encoding", plain.headers.GetFirst("Vary"));
+	EXPECT_EQ("4096", plain.headers.GetFirst(kContentLength));
+	EXPECT_EQ("Accept-Encoding", other.headers.GetFirst("Vary"));
+	EXPECT_EQ("Accept-Encoding", none.headers.GetFirst("Vary"));
+	EXPECT_EQ(0, png.headers.Get("Vary"));
+}
+
+TEST_F(CompressionTest, Streamed)
+{
+	RecordingWriter w;
+	StreamingHandler handler(&w);
+
+	Serve(&handler, "gzip", &w);
+
+	// Everything written has been passed on by the time the handler
+	// returns.
+	EXPECT_EQ(string(4096, 'x') + "tail", Inflate(handler.sent, true));
+	EXPECT_EQ(string(4096, 'x') + "tail", Inflate(w.body));
+}
+
+TEST_F(CompressionTest, ETag)
+{
+	BodyHandler handler("text/html", string(4096, 'x'));
+	RecordingWriter compressed, plain;
+
+	handler.headers.Set("ETag", "\"v1\"");
+	Serve(&handler, "gzip", &compressed);
+	Serve(&handler, "", &plain);
+
+	EXPECT_EQ("W/\"v1\"", compressed.headers.GetFirst("ETag"));
+	EXPECT_EQ("\"v1\"", plain.headers.GetFirst("ETag"));
+
+	// Weak ones stay as they are.
+	RecordingWriter weak;
+	handler.headers.Set("ETag", "W/\"v1\"");
+	Serve(&handler, "gzip", &weak);
+	EXPECT_EQ("W/\"v1\"", weak.headers.GetFirst("ETag"));
+}
+
+TEST_F(CompressionTest, Head)
+{
+	BodyHandler large("text/html", string(4096, 'x'));
+	BodyHandler small("text/html", "Hello, World!");
+	RecordingWriter get, head, small_get, small_head;
+
+	Serve(&large, "gzip", &get);
+	Serve(&large, "gzip", &head, kMethodHead);
+	Serve(&small, "gzip", &small_get);
+	Serve(&small, "gzip", &small_head, kMethodHead);
+
+	// The headers are the same as for GET, but nothing is compressed.
+	EXPECT_EQ("gzip", head.headers.GetFirst(kContentEncoding));
+	EXPECT_EQ(get.headers.GetFirst("Vary"), head.headers.GetFirst("Vary"));
+	EXPECT_EQ(0, head.headers.Get(kContentLength));
+	EXPECT_EQ("", head.body);
+
+	EXPECT_EQ(0, small_head.headers.Get(kContentEncoding));
+	EXPECT_EQ(small_get.headers.GetFirst("Vary"),
+			small_head.headers.GetFirst("Vary"));
+	EXPECT_EQ("13", small_head.headers.GetFirst(kContentLength));
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
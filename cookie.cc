@@ -67,6 +67,67 @@ URLEncode(string input, bool skip_spaces)
 	return ret;
 }
 
+// Value of the hex digit c, or -1 if it isn't one.
+static inline int
+HexValue(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+string
+URLDecode(const StringPiece& input, bool plus_as_space)
+{
+	string ret;
+	size_t i = 0;
+
+	ret.reserve(input.length());
+
+	while (i < input.length())
+	{
+		// Copy everything up to the next escape in one go.
+		size_t start = i;
+		while (i < input.length() && input[i] != '%' &&
+				(input[i] != '+' || !plus_as_space))
+			i++;
+		ret.append(input.data() + start, i - start);
+
+		if (i == input.length())
+			break;
+
+		if (input[i] == '+')
+		{
+			ret.push_back(' ');
+			i++;
+			continue;
+		}
+
+		int hi = -1, lo = -1;
+		if (i + 2 < input.length())
+		{
+			hi = HexValue(input[i + 1]);
+			lo = HexValue(input[i + 2]);
+		}
+
+		if (hi < 0 || lo < 0)
+		{
+			ret.push_back('%');
+			i++;
+		}
+		else
+		{
+			ret.push_back(char((hi << 4) | lo));
+			i += 3;
+		}
+	}
+
+	return ret;
+}
+
 Cookie::Cookie()
 : expires(0), max_age(0), rfc(0), version(1), port(0), discard(false),
        	http_only(false), secure(false)
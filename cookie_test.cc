@@ -25,6 +25,17 @@ TEST_F(URLEncodeTest, EncodeWithoutSpaces)
 	EXPECT_EQ("Hello World%21", URLEncode("Hello World!", true));
 }
 
+TEST_F(URLEncodeTest, Decode)
+{
+	EXPECT_EQ("Hello World!", URLDecode("Hello%20World%21"));
+	EXPECT_EQ("Hello World!", URLDecode("Hello+World%21"));
+	EXPECT_EQ("a/b\xff", URLDecode("a%2Fb%fF"));
+	EXPECT_EQ("100%", URLDecode("100%"));
+	EXPECT_EQ("%zz%4", URLDecode("%zz%4"));
+	EXPECT_EQ("", URLDecode(""));
+	EXPECT_EQ("/a+b c", URLDecode("/a+b%20c", false));
+}
+
 class CookieTest : public ::testing::Test
 {
 };
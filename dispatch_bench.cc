@@ -0,0 +1,239 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Benchmark for running handlers on the executor. One I/O thread delivers
+// requests for a number of connections at a steady rate, every tenth of
+// them to a slow handler, and the latency of the fast requests is reported
+// with the handlers run on the I/O thread and on the executor.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <siot/connection.h>
+#include <thread++/threadpool.h>
+
+#include "server.h"
+#include "server_internal.h"
+
+using http::server::Handler;
+using http::server::Protocol;
+using http::server::ProtocolServer;
+using http::server::Request;
+using http::server::ResponseWriter;
+using http::server::ServeMux;
+using http::server::WebServer;
+using std::chrono::steady_clock;
+using std::string;
+using toolbox::siot::Connection;
+
+static const int kConnections = 16;
+static const int kRequests = 2000;
+static const int kSlowEvery = 10;
+static const std::chrono::microseconds kInterval(1000);
+static const std::chrono::microseconds kSlowDelay(5000);
+
+// Handler taking the given time to come up with its response.
+class SleepingHandler : public Handler
+{
+public:
+	explicit SleepingHandler(std::chrono::microseconds delay)
+	: delay_(delay)
+	{
+	}
+
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+		if (delay_.count() > 0)
+			std::this_thread::sleep_for(delay_);
+		w->Write("ok");
+	}
+
+private:
+	const std::chrono::microseconds delay_;
+};
+
+// In-memory connection. Requests are queued up by the I/O thread, and the
+// latency of every fast request is recorded once its response is sent.
+class PipeConnection : public Connection
+{
+public:
+	PipeConnection()
+	: answered_(0)
+	{
+	}
+
+	// Queues up a request which arrived at the given time.
+	void Deliver(const string& request, steady_clock::time_point arrival,
+			bool slow)
+	{
+		std::lock_guard<std::mutex> lk(mu_);
+		rx_ += request;
+		pending_.push_back(std::make_pair(arrival, slow));
+	}
+
+	virtual string Receive()
+	{
+		std::lock_guard<std::mutex> lk(mu_);
+		string ret;
+		ret.swap(rx_);
+		return ret;
+	}
+
+	virtual int Send(string data)
+	{
+		steady_clock::time_point now = steady_clock::now();
+		std::lock_guard<std::mutex> lk(mu_);
+		size_t pos = 0;
+
+		// Pipelined responses may come in a single send.
+		while ((pos = data.find("HTTP/1.1 ", pos)) != string::npos)
+		{
+			if (!pending_.front().second)
+				latencies_.push_back(
+					std::chrono::duration<double,
+					std::micro>(now -
+						pending_.front().first).count());
+			pending_.pop_front();
+			answered_++;
+			pos++;
+		}
+
+		return data.length();
+	}
+
+	int Answered()
+	{
+		std::lock_guard<std::mutex> lk(mu_);
+		return answered_;
+	}
+
+	const std::vector<double>& Latencies() const
+	{
+		return latencies_;
+	}
+
+private:
+	std::mutex mu_;
+	string rx_;
+	std::deque<std::pair<steady_clock::time_point, bool> > pending_;
+	std::vector<double> latencies_;
+	int answered_;
+};
+
+static double
+Percentile(const std::vector<double>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1,
+			size_t(p * sorted.size()))];
+}
+
+// Runs the workload, with the handlers on the executor if one is given.
+// Takes ownership of the executor.
+static void
+Run(const char* name, threadpp::ThreadPool* executor)
+{
+	WebServer server;
+	ServeMux mux;
+	SleepingHandler fast(std::chrono::microseconds(0));
+	SleepingHandler slow(kSlowDelay);
+	toolbox::ScopedPtr<Protocol> proto(Protocol::HTTP());
+	std::vector<PipeConnection> pipes(kConnections);
+	std::vector<Connection*> conns;
+
+	server.SetExecutor(executor);
+	mux.Handle("/fast", &fast);
+	mux.Handle("/slow", &slow);
+
+	{
+		ProtocolServer ps(&server, proto.Get(), &mux);
+
+		for (PipeConnection& pipe : pipes)
+			conns.push_back(ps.AddDecorators(&pipe));
+
+		steady_clock::time_point next = steady_clock::now();
+		for (int i = 0; i < kRequests; i++)
+		{
+			bool is_slow = i % kSlowEvery == 0;
+			int c = i % kConnections;
+
+			// Requests keep arriving at the same rate, even if
+			// the I/O thread falls behind, so they're timed from
+			// when they were due.
+			next += kInterval;
+			std::this_thread::sleep_until(next);
+			pipes[c].Deliver(is_slow ?
+					"GET /slow HTTP/1.1\r\nHost: b\r\n\r\n" :
+					"GET /fast HTTP/1.1\r\nHost: b\r\n\r\n",
+					next, is_slow);
+			ps.DataReady(conns[c]);
+		}
+
+		for (PipeConnection& pipe : pipes)
+			while (pipe.Answered() < kRequests / kConnections)
+				std::this_thread::sleep_for(
+						std::chrono::milliseconds(1));
+
+		// Wait for the handlers to let go of the connections.
+		server.SetExecutor(0);
+	}
+
+	std::vector<double> latencies;
+	for (const PipeConnection& pipe : pipes)
+		latencies.insert(latencies.end(), pipe.Latencies().begin(),
+				pipe.Latencies().end());
+	std::sort(latencies.begin(), latencies.end());
+
+	printf("%-12s %10.1f %10.1f %10.1f %10.1f\n", name,
+			Percentile(latencies, 0.5),
+			Percentile(latencies, 0.9),
+			Percentile(latencies, 0.99),
+			Percentile(latencies, 1.0));
+}
+
+int main(void)
+{
+	printf("Latency of fast requests in us, 1 in %d requests takes %ld us\n",
+			kSlowEvery, long(kSlowDelay.count()));
+	printf("%-12s %10s %10s %10s %10s\n", "variant", "p50", "p90", "p99",
+			"max");
+
+	Run("io-thread", 0);
+	Run("executor", new threadpp::ThreadPool(8));
+
+	return 0;
+}
@@ -27,7 +27,11 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <map>
 #include <string>
+#include <utility>
+
+#include <thread++/mutex.h>
 
 #include "server.h"
 #include "server_internal.h"
@@ -37,8 +41,12 @@ namespace http
 namespace server
 {
 using std::string;
+using threadpp::Mutex;
+using threadpp::MutexLock;
 
-// Error message with the given error code and string.
+// Error message with the given error code and string. The complete
+// response is serialized when the handler is created, so serving it takes
+// a single write and no allocations.
 class ErrorHandlerImpl : public Handler
 {
 public:
@@ -48,40 +56,143 @@ public:
 	// Serve an error message with the given error code and string.
 	virtual void ServeHTTP(ResponseWriter* w, const Request* req);
 
+	// Changes the error served by the handler.
+	void Set(int errcode, const string& message);
+
+	int Code() const;
+	const string& Message() const;
+
 private:
 	int code_;
 	string message_;
+
+	// Status line and headers, followed by the body.
+	string response_;
+	size_t head_length_;
 };
 
+// The errors produced by the server itself, or commonly by handlers.
+static const struct
+{
+	int code;
+	const char* message;
+} kCommonErrors[] = {
+	{ 400, "Bad Request" },
+	{ 404, "Not Found" },
+	{ 405, "Method Not Allowed" },
+	{ 413, "Payload Too Large" },
+	{ 414, "URI Too Long" },
+	{ 431, "Request Header Fields Too Large" },
+	{ 500, "Internal Server Error" },
+	{ 503, "Service Unavailable" },
+};
+
+static const size_t kNumCommonErrors =
+	sizeof(kCommonErrors) / sizeof(kCommonErrors[0]);
+
+// Number of other errors for which handlers are kept around.
+static const size_t kMaxOtherErrors = 256;
+
 Handler::~Handler()
 {
 }
 
 ErrorHandlerImpl::ErrorHandlerImpl(int errcode, const string& message)
-: code_(errcode), message_(message)
 {
+	Set(errcode, message);
+}
+
+void
+ErrorHandlerImpl::Set(int errcode, const string& message)
+{
+	string body = message + "\r\n\r\n";
+
+	code_ = errcode;
+	message_ = message;
+
+	response_ = "HTTP/1.1 " + std::to_string(errcode) + " " + message +
+		"\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: " + std::to_string(body.length()) + "\r\n"
+		"\r\n";
+	head_length_ = response_.length();
+	response_ += body;
 }
 
 ErrorHandlerImpl::~ErrorHandlerImpl()
 {
 }
 
+int
+ErrorHandlerImpl::Code() const
+{
+	return code_;
+}
+
+const string&
+ErrorHandlerImpl::Message() const
+{
+	return message_;
+}
+
 void
 ErrorHandlerImpl::ServeHTTP(ResponseWriter* w, const Request* req)
 {
-	Headers h;
-	h.Add("Content-type", "text/plain");
-	h.Add("Content-Length", std::to_string(message_.length() + 4));
+	w->WriteResponse(StringPiece(response_.data(), head_length_),
+			StringPiece(response_.data() + head_length_,
+				response_.length() - head_length_));
+}
+
+// Creates the handlers for all common errors.
+static ErrorHandlerImpl**
+CreateCommonErrors()
+{
+	ErrorHandlerImpl** handlers = new ErrorHandlerImpl*[kNumCommonErrors];
 
-	w->AddHeaders(h);
-	w->WriteHeader(code_, message_);
-	w->Write(message_ + "\r\n\r\n");
+	for (size_t i = 0; i < kNumCommonErrors; i++)
+		handlers[i] = new ErrorHandlerImpl(kCommonErrors[i].code,
+				kCommonErrors[i].message);
+
+	return handlers;
 }
 
 Handler*
 Handler::ErrorHandler(int errcode, const string& message)
 {
-	return new ErrorHandlerImpl(errcode, message);
+	// The handlers kept here are never released, since the callers
+	// may keep using them for as long as they like.
+	static ErrorHandlerImpl** common = CreateCommonErrors();
+	static Mutex* lock = Mutex::Create();
+	static std::map<std::pair<int, string>, ErrorHandlerImpl*>* others =
+		new std::map<std::pair<int, string>, ErrorHandlerImpl*>;
+
+	for (size_t i = 0; i < kNumCommonErrors; i++)
+		if (common[i]->Code() == errcode &&
+				common[i]->Message() == message)
+			return common[i];
+
+	std::pair<int, string> key(errcode, message);
+	{
+		MutexLock lk(lock);
+		std::map<std::pair<int, string>, ErrorHandlerImpl*>::iterator
+			it = others->find(key);
+		if (it != others->end())
+			return it->second;
+
+		if (others->size() < kMaxOtherErrors)
+		{
+			ErrorHandlerImpl* handler =
+				new ErrorHandlerImpl(errcode, message);
+			others->insert(std::make_pair(key, handler));
+			return handler;
+		}
+	}
+
+	// Messages containing e.g. paths or IDs would otherwise pile up
+	// forever, so the rest make do with one handler per thread.
+	thread_local ErrorHandlerImpl scratch(errcode, message);
+	scratch.Set(errcode, message);
+	return &scratch;
 }
 }  // namespace server
 }  // namespace http
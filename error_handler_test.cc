@@ -0,0 +1,143 @@
+/*
+ * Unit Test for the Error Handler.
+ */
+
+#include "server.h"
+#include "server_internal.h"
+#include "test_connection.h"
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+class ErrorHandlerTest : public ::testing::Test
+{
+};
+
+TEST_F(ErrorHandlerTest, Shared)
+{
+	Handler* not_found = Handler::ErrorHandler(404, "Not Found");
+
+	EXPECT_EQ(not_found, Handler::ErrorHandler(404, "Not Found"));
+	EXPECT_NE(not_found, Handler::ErrorHandler(400, "Bad Request"));
+	EXPECT_NE(not_found, Handler::ErrorHandler(404, "Nothing Here"));
+	EXPECT_EQ(Handler::ErrorHandler(418, "I'm a teapot"),
+			Handler::ErrorHandler(418, "I'm a teapot"));
+}
+
+TEST_F(ErrorHandlerTest, Bounded)
+{
+	// Errors with ever changing messages don't pile up.
+	Handler* first = Handler::ErrorHandler(404, "No /0 here");
+	for (int i = 1; i < 1000; i++)
+		Handler::ErrorHandler(404, "No /" + std::to_string(i) +
+				" here");
+
+	EXPECT_EQ(first, Handler::ErrorHandler(404, "No /0 here"));
+	EXPECT_EQ(Handler::ErrorHandler(404, "No /999 here"),
+			Handler::ErrorHandler(404, "No /1000 here"));
+
+	RecordingConnection conn;
+	Request req;
+	{
+		HTTPResponseWriter rw(&conn);
+		Handler::ErrorHandler(404, "No /1001 here")->ServeHTTP(&rw,
+				&req);
+	}
+	EXPECT_EQ("No /1001 here\r\n\r\n", conn.All().substr(
+				conn.All().find("\r\n\r\n") + 4));
+}
+
+TEST_F(ErrorHandlerTest, Close)
+{
+	RecordingConnection conn;
+	Request req;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		Headers h;
+		h.Set(kConnection, "close");
+		rw.AddHeaders(h);
+		Handler::ErrorHandler(400, "Bad Request")->ServeHTTP(&rw, &req);
+	}
+
+	ASSERT_EQ(1, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 400 Bad Request\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: 15\r\n"
+			"Connection: close\r\n"
+			"\r\n"
+			"Bad Request\r\n\r\n", conn.sent[0]);
+}
+
+TEST_F(ErrorHandlerTest, SingleSend)
+{
+	RecordingConnection conn;
+	Request req;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		Handler::ErrorHandler(404, "Not Found")->ServeHTTP(&rw, &req);
+	}
+
+	ASSERT_EQ(1, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 404 Not Found\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: 13\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"Not Found\r\n\r\n", conn.sent[0]);
+}
+
+TEST_F(ErrorHandlerTest, OmitBody)
+{
+	RecordingConnection conn;
+	Request req;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.OmitBody();
+		Handler::ErrorHandler(503, "Service Unavailable")->ServeHTTP(
+				&rw, &req);
+	}
+
+	ASSERT_EQ(1, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 503 Service Unavailable\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: 23\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n", conn.sent[0]);
+}
+
+TEST_F(ErrorHandlerTest, AddedHeaders)
+{
+	RecordingConnection conn;
+	Request req;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		Headers h;
+		h.Set("Allow", "GET, HEAD");
+		rw.AddHeaders(h);
+		Handler::ErrorHandler(405, "Method Not Allowed")->ServeHTTP(
+				&rw, &req);
+	}
+
+	ASSERT_EQ(1, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 405 Method Not Allowed\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: 22\r\n"
+			"Allow: GET, HEAD\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"Method Not Allowed\r\n\r\n", conn.sent[0]);
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
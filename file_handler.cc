@@ -0,0 +1,712 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <thread++/mutex.h>
+#include <toolbox/scopedptr.h>
+#include <zlib.h>
+
+#include "server.h"
+#include "server_internal.h"
+
+namespace http
+{
+namespace server
+{
+using std::map;
+using std::string;
+using threadpp::MutexLock;
+using toolbox::ScopedPtr;
+
+// Serves the files below a directory.
+class FileHandlerImpl : public Handler
+{
+public:
+	FileHandlerImpl(const string& root);
+	virtual ~FileHandlerImpl();
+
+	// Serve the file named by the path of the request.
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req);
+
+private:
+	// Serve the open file fd, which was found at path.
+	void ServeFile(ResponseWriter* w, const Request* req, int fd,
+			const string& path);
+
+	string root_;
+};
+
+static const struct
+{
+	const char* extension;
+	const char* type;
+} kMimeTypes[] = {
+	{ "css", "text/css; charset=utf-8" },
+	{ "csv", "text/csv; charset=utf-8" },
+	{ "gif", "image/gif" },
+	{ "gz", "application/gzip" },
+	{ "htm", "text/html; charset=utf-8" },
+	{ "html", "text/html; charset=utf-8" },
+	{ "ico", "image/vnd.microsoft.icon" },
+	{ "jpeg", "image/jpeg" },
+	{ "jpg", "image/jpeg" },
+	{ "js", "text/javascript; charset=utf-8" },
+	{ "json", "application/json" },
+	{ "map", "application/json" },
+	{ "mjs", "text/javascript; charset=utf-8" },
+	{ "mp4", "video/mp4" },
+	{ "otf", "font/otf" },
+	{ "pdf", "application/pdf" },
+	{ "png", "image/png" },
+	{ "svg", "image/svg+xml" },
+	{ "ttf", "font/ttf" },
+	{ "txt", "text/plain; charset=utf-8" },
+	{ "wasm", "application/wasm" },
+	{ "webm", "video/webm" },
+	{ "webp", "image/webp" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "xml", "text/xml; charset=utf-8" },
+	{ "zip", "application/zip" },
+};
+
+static const char kDefaultMimeType[] = "application/octet-stream";
+
+// Determines the MIME type of a file from the extension of its name.
+static const char*
+MimeType(const string& path)
+{
+	size_t dot = path.rfind('.');
+	if (dot == string::npos || path.find('/', dot) != string::npos)
+		return kDefaultMimeType;
+
+	const char* extension = path.c_str() + dot + 1;
+	for (size_t i = 0; i < sizeof(kMimeTypes) / sizeof(kMimeTypes[0]);
+			i++)
+		if (strcasecmp(extension, kMimeTypes[i].extension) == 0)
+			return kMimeTypes[i].type;
+
+	return kDefaultMimeType;
+}
+
+enum RangeResult
+{
+	kNoRange,
+	kSatisfiableRange,
+	kUnsatisfiableRange,
+};
+
+static inline bool
+IsDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// Parses the Range header of a request for a file of the given size.
+// Only a single range of bytes is supported; requests for several ranges
+// get the whole file, which is allowed.
+static RangeResult
+ParseRange(const string& header, off_t size, off_t* start, off_t* length)
+{
+	static const char kBytes[] = "bytes=";
+	const char* spec = header.c_str() + sizeof(kBytes) - 1;
+	char* end;
+
+	if (header.compare(0, sizeof(kBytes) - 1, kBytes) != 0 ||
+			header.find(',') != string::npos)
+		return kNoRange;
+
+	if (*spec == '-')
+	{
+		// The last n bytes. strtoll() would also accept a sign or
+		// leading blanks, so make sure a digit comes first.
+		if (!IsDigit(spec[1]))
+			return kNoRange;
+		off_t n = strtoll(spec + 1, &end, 10);
+		if (*end || n < 0)
+			return kNoRange;
+		if (n == 0 || size == 0)
+			return kUnsatisfiableRange;
+		if (n > size)
+			n = size;
+		*start = size - n;
+		*length = n;
+		return kSatisfiableRange;
+	}
+
+	if (!IsDigit(*spec))
+		return kNoRange;
+	off_t first = strtoll(spec, &end, 10);
+	if (*end != '-' || first < 0)
+		return kNoRange;
+
+	off_t last = size - 1;
+	if (end[1])
+	{
+		const char* lastspec = end + 1;
+		if (!IsDigit(*lastspec))
+			return kNoRange;
+		last = strtoll(lastspec, &end, 10);
+		if (*end || last < first)
+			return kNoRange;
+		if (last >= size)
+			last = size - 1;
+	}
+
+	if (first >= size)
+		return kUnsatisfiableRange;
+
+	*start = first;
+	*length = last - first + 1;
+	return kSatisfiableRange;
+}
+
+// Extracts the decoded path of the file requested by req. Returns false
+// if it tries to escape from the root directory.
+static bool
+FilePath(const Request* req, string* path)
+{
+	const string& target = req->Path();
+	*path = URLDecode(StringPiece(target).substr(0, target.find('?')),
+			false);
+
+	return !path->empty() && (*path)[0] == '/' &&
+		path->find('\0') == string::npos &&
+		path->find("/../") == string::npos &&
+		(path->length() < 3 ||
+		 path->compare(path->length() - 3, 3, "/..") != 0);
+}
+
+// Serves the error status with the given message.
+static void
+ServeError(ResponseWriter* w, const Request* req, int status,
+		const string& message)
+{
+	Handler::ErrorHandler(status, message)->ServeHTTP(w, req);
+}
+
+FileHandlerImpl::FileHandlerImpl(const string& root)
+: root_(root)
+{
+	// Paths always start with a slash.
+	while (!root_.empty() && root_[root_.length() - 1] == '/')
+		root_.resize(root_.length() - 1);
+}
+
+FileHandlerImpl::~FileHandlerImpl()
+{
+}
+
+void
+FileHandlerImpl::ServeHTTP(ResponseWriter* w, const Request* req)
+{
+	if (req->Method() != kMethodGet && req->Method() != kMethodHead)
+	{
+		Headers h;
+		h.Set("Allow", "GET, HEAD");
+		w->AddHeaders(h);
+		ServeError(w, req, 405, "Method Not Allowed");
+		return;
+	}
+
+	string path;
+	if (!FilePath(req, &path))
+	{
+		ServeError(w, req, 404, "Not Found");
+		return;
+	}
+
+	string filename = root_ + path;
+	struct stat st;
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		close(fd);
+		fd = -1;
+
+		// Relative links in the index only work with a trailing
+		// slash. The path has been decoded, so it needs to be
+		// encoded again to be safe in a header.
+		if (path[path.length() - 1] != '/')
+		{
+			Headers h;
+			h.Set("Location", URLEncode(path + "/"));
+			w->AddHeaders(h);
+			ServeError(w, req, 301, "Moved Permanently");
+			return;
+		}
+
+		path += "index.html";
+		filename += "index.html";
+		fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	}
+
+	if (fd < 0)
+	{
+		if (errno == EACCES)
+			ServeError(w, req, 403, "Forbidden");
+		else if (errno == ENOENT || errno == ENOTDIR)
+			ServeError(w, req, 404, "Not Found");
+		else
+			ServeError(w, req, 500, "Internal Server Error");
+		return;
+	}
+
+	ServeFile(w, req, fd, path);
+	close(fd);
+}
+
+void
+FileHandlerImpl::ServeFile(ResponseWriter* w, const Request* req, int fd,
+		const string& path)
+{
+	const Headers* rh = req->GetHeaders();
+	struct stat st;
+	Headers h;
+	time_t since;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		ServeError(w, req, 404, "Not Found");
+		return;
+	}
+
+	h.Set("Last-Modified", FormatHTTPDate(st.st_mtime));
+
+	if (rh && ParseHTTPDate(rh->GetFirst(kIfModifiedSince), &since) &&
+			st.st_mtime <= since)
+	{
+		w->AddHeaders(h);
+		w->WriteHeader(304, "Not Modified");
+		return;
+	}
+
+	off_t start = 0, length = st.st_size;
+	int status = 200;
+	string message = "OK";
+
+	switch (rh ? ParseRange(rh->GetFirst(kRange), st.st_size, &start,
+				&length) : kNoRange)
+	{
+	case kNoRange:
+		break;
+	case kSatisfiableRange:
+		status = 206;
+		message = "Partial Content";
+		h.Set("Content-Range", "bytes " + std::to_string(start) +
+				"-" + std::to_string(start + length - 1) +
+				"/" + std::to_string(st.st_size));
+		break;
+	case kUnsatisfiableRange:
+		h.Set("Content-Range", "bytes */" +
+				std::to_string(st.st_size));
+		w->AddHeaders(h);
+		ServeError(w, req, 416, "Range Not Satisfiable");
+		return;
+	}
+
+	h.Set(kContentType, MimeType(path));
+	h.Set(kContentLength, std::to_string(length));
+	h.Set("Accept-Ranges", "bytes");
+
+	w->AddHeaders(h);
+	w->WriteHeader(status, message);
+
+	// The length has been announced already, so should the file have
+	// shrunk in the meantime, SendFile() fails and the writer has the
+	// connection closed after what was sent.
+	w->SendFile(fd, start, length);
+}
+
+// A file held in memory, along with everything needed to serve it.
+struct CachedFile
+{
+	// Identity of the file the contents were read from.
+	time_t mtime;
+	long mtime_nsec;
+	off_t size;
+	ino_t inode;
+
+	// When the file was last checked for changes, in steady clock ticks.
+	mutable std::atomic<std::chrono::steady_clock::rep> checked;
+
+	// The gzipped contents are a different representation, with a tag
+	// of their own.
+	string etag;
+	string gzip_etag;
+	string last_modified;
+	string body;
+	string gzip_body;
+
+	// Complete response heads for the plain and gzipped contents and
+	// for 304 responses to either.
+	string head;
+	string gzip_head;
+	string not_modified_head;
+	string gzip_not_modified_head;
+};
+
+// Serves small files below a directory from memory, and everything else
+// through a FileHandlerImpl. The files are kept in a queue in the order
+// they were loaded, so the oldest ones can be dropped when the cache is
+// full.
+class CachedFileHandlerImpl : public Handler
+{
+public:
+	CachedFileHandlerImpl(const string& root, size_t max_file_size,
+			size_t max_memory);
+	virtual ~CachedFileHandlerImpl();
+
+	// Serve the file named by the path of the request.
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req);
+
+private:
+	// Gets the cached copy of the file at path, loading it if it has
+	// not been cached yet or changed since. Returns null if the file
+	// can't be cached.
+	std::shared_ptr<const CachedFile> Lookup(const string& path);
+
+	// Reads the file fd into a new cache entry.
+	std::shared_ptr<const CachedFile> Load(int fd, const string& path,
+			const struct stat& st) const;
+
+	// Stores file under path, making room for it if necessary. lock_
+	// must be held.
+	void Store(const string& path,
+			const std::shared_ptr<const CachedFile>& file);
+
+	FileHandlerImpl files_;
+	string root_;
+	size_t max_file_size_;
+	size_t max_memory_;
+	ScopedPtr<threadpp::Mutex> lock_;
+	map<string, std::shared_ptr<const CachedFile> > cache_;
+	std::deque<std::pair<string, std::shared_ptr<const CachedFile> > >
+		queue_;
+	size_t memory_;
+};
+
+// How often cached files are checked for changes.
+static const std::chrono::seconds kRecheckInterval(1);
+
+// Bookkeeping overhead assumed for every cached file.
+static const size_t kEntryOverhead = 128;
+
+// Memory taken up by file cached under path.
+static size_t
+EntrySize(const string& path, const CachedFile& file)
+{
+	return path.length() + file.body.length() + file.gzip_body.length() +
+		file.head.length() + file.gzip_head.length() +
+		file.not_modified_head.length() +
+		file.gzip_not_modified_head.length() + kEntryOverhead;
+}
+
+// Whether files of the given MIME type are worth compressing.
+static bool
+Compressible(const char* type)
+{
+	return strncmp(type, "text/", 5) == 0 ||
+		strcmp(type, "application/json") == 0 ||
+		strcmp(type, "application/wasm") == 0 ||
+		strcmp(type, "image/svg+xml") == 0 ||
+		strcmp(type, "image/vnd.microsoft.icon") == 0;
+}
+
+// Compresses data in gzip format into out. Returns false on failure.
+static bool
+Gzip(const string& data, string* out)
+{
+	z_stream zs = {};
+
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	out->resize(deflateBound(&zs, data.length()));
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	zs.avail_in = data.length();
+	zs.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+	zs.avail_out = out->length();
+
+	int ret = deflate(&zs, Z_FINISH);
+	out->resize(zs.total_out);
+	deflateEnd(&zs);
+	return ret == Z_STREAM_END;
+}
+
+CachedFileHandlerImpl::CachedFileHandlerImpl(const string& root,
+		size_t max_file_size, size_t max_memory)
+: files_(root), root_(root), max_file_size_(max_file_size),
+	max_memory_(max_memory), lock_(threadpp::Mutex::Create()), memory_(0)
+{
+	while (!root_.empty() && root_[root_.length() - 1] == '/')
+		root_.resize(root_.length() - 1);
+}
+
+CachedFileHandlerImpl::~CachedFileHandlerImpl()
+{
+}
+
+std::shared_ptr<const CachedFile>
+CachedFileHandlerImpl::Load(int fd, const string& path,
+		const struct stat& st) const
+{
+	std::shared_ptr<CachedFile> file(new CachedFile);
+	const char* type = MimeType(path);
+	char etag[40];
+
+	file->mtime = st.st_mtime;
+	file->mtime_nsec = st.st_mtim.tv_nsec;
+	file->size = st.st_size;
+	file->inode = st.st_ino;
+	file->checked = std::chrono::steady_clock::now().time_since_epoch()
+		.count();
+
+	file->body.resize(st.st_size);
+	if (st.st_size > 0 &&
+			pread(fd, &file->body[0], st.st_size, 0) != st.st_size)
+		return std::shared_ptr<const CachedFile>();
+
+	// A strong tag, derived from the contents.
+	snprintf(etag, sizeof(etag), "%08lx-%llx",
+			crc32(crc32(0, Z_NULL, 0),
+				reinterpret_cast<const Bytef*>(
+					file->body.data()),
+				file->body.length()),
+			(unsigned long long) st.st_size);
+	file->etag = "\"" + string(etag) + "\"";
+	file->last_modified = FormatHTTPDate(st.st_mtime);
+
+	string common = "HTTP/1.1 200 OK\r\n"
+		"Content-Type: " + string(type) + "\r\n"
+		"Last-Modified: " + file->last_modified + "\r\n";
+	string not_modified = "HTTP/1.1 304 Not Modified\r\n"
+		"Last-Modified: " + file->last_modified + "\r\n";
+
+	if (Compressible(type) && Gzip(file->body, &file->gzip_body) &&
+			file->gzip_body.length() < file->body.length())
+	{
+		file->gzip_etag = "\"" + string(etag) + "-gz\"";
+		common += "Vary: Accept-Encoding\r\n";
+		not_modified += "Vary: Accept-Encoding\r\n";
+		file->gzip_head = common +
+			"ETag: " + file->gzip_etag + "\r\n"
+			"Content-Encoding: gzip\r\n"
+			"Content-Length: " +
+			std::to_string(file->gzip_body.length()) + "\r\n\r\n";
+		file->gzip_not_modified_head = not_modified +
+			"ETag: " + file->gzip_etag + "\r\n\r\n";
+	}
+	else
+		file->gzip_body.clear();
+
+	// The writer adds the Connection header as appropriate for the
+	// request.
+	file->head = common +
+		"ETag: " + file->etag + "\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Content-Length: " + std::to_string(file->body.length()) +
+		"\r\n\r\n";
+	file->not_modified_head = not_modified +
+		"ETag: " + file->etag + "\r\n\r\n";
+
+	return file;
+}
+
+std::shared_ptr<const CachedFile>
+CachedFileHandlerImpl::Lookup(const string& path)
+{
+	std::chrono::steady_clock::time_point now =
+		std::chrono::steady_clock::now();
+	std::shared_ptr<const CachedFile> file;
+
+	{
+		MutexLock lk(lock_.Get());
+		map<string, std::shared_ptr<const CachedFile> >::iterator it =
+			cache_.find(path);
+		if (it != cache_.end())
+			file = it->second;
+	}
+
+	if (file && now.time_since_epoch().count() - file->checked <
+			std::chrono::steady_clock::duration(
+				kRecheckInterval).count())
+		return file;
+
+	string filename = root_ + path;
+	struct stat st;
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+			size_t(st.st_size) > max_file_size_)
+		file.reset();
+	else if (file && file->mtime == st.st_mtime &&
+			file->mtime_nsec == st.st_mtim.tv_nsec &&
+			file->size == st.st_size && file->inode == st.st_ino)
+	{
+		// Still the same; only remember that it was checked.
+		file->checked = now.time_since_epoch().count();
+	}
+	else
+		file = Load(fd, path, st);
+
+	if (fd >= 0)
+		close(fd);
+
+	MutexLock lk(lock_.Get());
+	auto it = cache_.find(path);
+	if (!file)
+	{
+		if (it != cache_.end())
+			cache_.erase(it);
+	}
+	else if (it == cache_.end() || it->second != file)
+		Store(path, file);
+
+	return file;
+}
+
+void
+CachedFileHandlerImpl::Store(const string& path,
+		const std::shared_ptr<const CachedFile>& file)
+{
+	size_t size = EntrySize(path, *file);
+
+	if (size > max_memory_)
+	{
+		cache_.erase(path);
+		return;
+	}
+
+	// The queue keeps replaced and removed files alive, so they count
+	// until they leave it.
+	while (!queue_.empty() && memory_ + size > max_memory_)
+	{
+		const string& old_path = queue_.front().first;
+		const std::shared_ptr<const CachedFile>& old =
+			queue_.front().second;
+		auto it = cache_.find(old_path);
+
+		if (it != cache_.end() && it->second == old)
+			cache_.erase(it);
+		memory_ -= EntrySize(old_path, *old);
+		queue_.pop_front();
+	}
+
+	cache_[path] = file;
+	queue_.push_back(std::make_pair(path, file));
+	memory_ += size;
+}
+
+void
+CachedFileHandlerImpl::ServeHTTP(ResponseWriter* w, const Request* req)
+{
+	const Headers* rh = req->GetHeaders();
+	string path;
+
+	// Anything unusual is left to the regular file handler.
+	if ((req->Method() != kMethodGet && req->Method() != kMethodHead) ||
+			!FilePath(req, &path) ||
+			(rh && rh->Get(kRange)))
+	{
+		files_.ServeHTTP(w, req);
+		return;
+	}
+
+	if (path[path.length() - 1] == '/')
+		path += "index.html";
+
+	std::shared_ptr<const CachedFile> file = Lookup(path);
+	if (!file)
+	{
+		files_.ServeHTTP(w, req);
+		return;
+	}
+
+	// Conditions are checked against the representation which would be
+	// served.
+	bool gzip = rh && !file->gzip_body.empty() &&
+		AcceptsEncoding(rh->GetFirst(kAcceptEncoding), "gzip");
+
+	if (rh)
+	{
+		const Header* inm = rh->Get(kIfNoneMatch);
+		const string& ims = rh->GetFirst(kIfModifiedSince);
+		time_t since;
+
+		if (inm ? MatchesETag(inm->GetFirstValue(),
+					gzip ? file->gzip_etag : file->etag) :
+				ims == file->last_modified ||
+				(ParseHTTPDate(ims, &since) &&
+				 file->mtime <= since))
+		{
+			w->WriteResponse(gzip ? file->gzip_not_modified_head :
+					file->not_modified_head, "");
+			return;
+		}
+	}
+
+	if (gzip)
+		w->WriteResponse(file->gzip_head, file->gzip_body);
+	else
+		w->WriteResponse(file->head, file->body);
+}
+
+Handler*
+Handler::FileServer(const string& root)
+{
+	return new FileHandlerImpl(root);
+}
+
+Handler*
+Handler::CachedFileServer(const string& root, size_t max_file_size,
+		size_t max_memory)
+{
+	return new CachedFileHandlerImpl(root, max_file_size, max_memory);
+}
+}  // namespace server
+}  // namespace http
@@ -0,0 +1,444 @@
+/*
+ * Unit Test for the Static File Handler.
+ */
+
+#include "server.h"
+#include "server_internal.h"
+#include "test_connection.h"
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+// Response writer recording the response.
+class RecordingWriter : public ResponseWriter
+{
+public:
+	RecordingWriter()
+	: status(0)
+	{
+	}
+
+	virtual void AddHeaders(const Headers& to_add)
+	{
+		headers.Merge(to_add);
+	}
+
+	virtual void WriteHeader(int status_code, string message)
+	{
+		if (!status)
+			status = status_code;
+	}
+
+	using ResponseWriter::Write;
+	virtual int Write(const char* data, size_t length)
+	{
+		if (!status)
+			status = 200;
+		body.append(data, length);
+		return length;
+	}
+
+	int status;
+	Headers headers;
+	string body;
+};
+
+// Response writer truncating a file once the head has been written, as
+// though the file shrank while it was being served.
+class TruncatingWriter : public ResponseWriter
+{
+public:
+	TruncatingWriter(ResponseWriter* w, const string& filename,
+			off_t length)
+	: w_(w), filename_(filename), length_(length)
+	{
+	}
+
+	virtual void AddHeaders(const Headers& to_add)
+	{
+		w_->AddHeaders(to_add);
+	}
+
+	virtual void WriteHeader(int status_code, string message)
+	{
+		w_->WriteHeader(status_code, message);
+		EXPECT_EQ(0, truncate(filename_.c_str(), length_));
+	}
+
+	using ResponseWriter::Write;
+	virtual int Write(const char* data, size_t length)
+	{
+		return w_->Write(data, length);
+	}
+
+	virtual int SendFile(int fd, off_t offset, size_t length)
+	{
+		return w_->SendFile(fd, offset, length);
+	}
+
+private:
+	ResponseWriter* w_;
+	string filename_;
+	off_t length_;
+};
+
+// Handler serving files with handler, the first of which shrinks while
+// it's being served.
+class ShrinkingHandler : public Handler
+{
+public:
+	ShrinkingHandler(Handler* handler, const string& filename)
+	: handler_(handler), filename_(filename), calls(0)
+	{
+	}
+
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+		if (calls++ > 0)
+		{
+			handler_->ServeHTTP(w, req);
+			return;
+		}
+
+		TruncatingWriter truncating(w, filename_, 5);
+		handler_->ServeHTTP(&truncating, req);
+	}
+
+private:
+	Handler* handler_;
+	string filename_;
+
+public:
+	int calls;
+};
+
+class FileHandlerTest : public ::testing::Test
+{
+protected:
+	virtual void SetUp()
+	{
+		char dir[] = "/tmp/file_handler_test.XXXXXX";
+		ASSERT_NE((char*) 0, mkdtemp(dir));
+		root_ = dir;
+		ASSERT_EQ(0, mkdir((root_ + "/sub").c_str(), 0755));
+		WriteFile("/hello.txt", "Hello, World!");
+		WriteFile("/sub/index.html", "<html></html>");
+		handler_.Reset(Handler::FileServer(root_ + "/"));
+	}
+
+	virtual void TearDown()
+	{
+		unlink((root_ + "/hello.txt").c_str());
+		unlink((root_ + "/sub/index.html").c_str());
+		rmdir((root_ + "/sub").c_str());
+		rmdir(root_.c_str());
+	}
+
+	void WriteFile(const string& name, const string& contents)
+	{
+		FILE* f = fopen((root_ + name).c_str(), "w");
+		ASSERT_NE((FILE*) 0, f);
+		fwrite(contents.data(), 1, contents.length(), f);
+		fclose(f);
+	}
+
+	// Serve a GET request for path with the given header.
+	void Get(const string& path, RecordingWriter* w,
+			KnownHeader key = kUnknownHeader,
+			const string& value = "")
+	{
+		Request req;
+		Headers* h = new Headers;
+		if (key != kUnknownHeader)
+			h->Set(key, value);
+		req.SetHeaders(h);
+		req.SetMethod(kMethodGet);
+		req.SetPath(path);
+		handler_->ServeHTTP(w, &req);
+	}
+
+	string root_;
+	ScopedPtr<Handler> handler_;
+};
+
+TEST_F(FileHandlerTest, ServeFile)
+{
+	RecordingWriter w;
+	Get("/hello.txt?v=1", &w);
+
+	EXPECT_EQ(200, w.status);
+	EXPECT_EQ("Hello, World!", w.body);
+	EXPECT_EQ("text/plain; charset=utf-8", w.headers.GetFirst(kContentType));
+	EXPECT_EQ("13", w.headers.GetFirst(kContentLength));
+	EXPECT_EQ("bytes", w.headers.GetFirst("Accept-Ranges"));
+	EXPECT_NE("", w.headers.GetFirst("Last-Modified"));
+}
+
+TEST_F(FileHandlerTest, Index)
+{
+	RecordingWriter w, redirect;
+	Get("/sub/", &w);
+	Get("/sub", &redirect);
+
+	EXPECT_EQ(200, w.status);
+	EXPECT_EQ("<html></html>", w.body);
+	EXPECT_EQ("text/html; charset=utf-8", w.headers.GetFirst(kContentType));
+	EXPECT_EQ(301, redirect.status);
+	EXPECT_EQ("/sub/", redirect.headers.GetFirst("Location"));
+
+	// Names which aren't safe in a header are encoded.
+	RecordingWriter encoded;
+	ASSERT_EQ(0, mkdir((root_ + "/a b?\r\n").c_str(), 0755));
+	Get("/a%20b%3F%0D%0A", &encoded);
+	rmdir((root_ + "/a b?\r\n").c_str());
+	EXPECT_EQ(301, encoded.status);
+	EXPECT_EQ("/a%20b%3F%0D%0A/", encoded.headers.GetFirst("Location"));
+}
+
+TEST_F(FileHandlerTest, NotFound)
+{
+	RecordingWriter missing, escape, encoded;
+	Get("/missing.txt", &missing);
+	Get("/sub/../../etc/passwd", &escape);
+	Get("/sub/%2E%2E/%2e%2e/etc/passwd", &encoded);
+
+	EXPECT_EQ(404, missing.status);
+	EXPECT_EQ(404, escape.status);
+	EXPECT_EQ(404, encoded.status);
+}
+
+TEST_F(FileHandlerTest, NotModified)
+{
+	RecordingWriter first, second, old;
+	Get("/hello.txt", &first);
+	Get("/hello.txt", &second, kIfModifiedSince,
+			first.headers.GetFirst("Last-Modified"));
+	Get("/hello.txt", &old, kIfModifiedSince,
+			"Sun, 06 Nov 1994 08:49:37 GMT");
+
+	EXPECT_EQ(304, second.status);
+	EXPECT_EQ("", second.body);
+	EXPECT_EQ(200, old.status);
+}
+
+TEST_F(FileHandlerTest, Range)
+{
+	RecordingWriter middle, suffix, open, multi, bad;
+	Get("/hello.txt", &middle, kRange, "bytes=7-11");
+	Get("/hello.txt", &suffix, kRange, "bytes=-6");
+	Get("/hello.txt", &open, kRange, "bytes=7-");
+	Get("/hello.txt", &multi, kRange, "bytes=0-1,3-4");
+	Get("/hello.txt", &bad, kRange, "bytes=13-");
+
+	EXPECT_EQ(206, middle.status);
+	EXPECT_EQ("World", middle.body);
+	EXPECT_EQ("bytes 7-11/13", middle.headers.GetFirst("Content-Range"));
+	EXPECT_EQ("5", middle.headers.GetFirst(kContentLength));
+	EXPECT_EQ("World!", suffix.body);
+	EXPECT_EQ("World!", open.body);
+	EXPECT_EQ(200, multi.status);
+	EXPECT_EQ("Hello, World!", multi.body);
+	EXPECT_EQ(416, bad.status);
+	EXPECT_EQ("bytes */13", bad.headers.GetFirst("Content-Range"));
+}
+
+TEST_F(FileHandlerTest, SignedRange)
+{
+	// Signs and blanks aren't allowed in either bound, so these all get
+	// the whole file.
+	for (const char* range : { "bytes=--5", "bytes=-+5", "bytes=- 5",
+			"bytes=+1-5", "bytes=-1-5", "bytes=1--5", "bytes=1-+5" })
+	{
+		RecordingWriter w;
+		Get("/hello.txt", &w, kRange, range);
+		EXPECT_EQ(200, w.status) << range;
+		EXPECT_EQ("Hello, World!", w.body) << range;
+		EXPECT_EQ("13", w.headers.GetFirst(kContentLength)) << range;
+	}
+}
+
+TEST_F(FileHandlerTest, Cached)
+{
+	ScopedPtr<Handler> cached(Handler::CachedFileServer(root_));
+	string text(1000, 'a');
+	WriteFile("/style.css", text);
+
+	Request req;
+	Headers* h = new Headers;
+	req.SetHeaders(h);
+	req.SetMethod(kMethodGet);
+	req.SetPath("/style.css");
+
+	RecordingWriter plain;
+	cached->ServeHTTP(&plain, &req);
+	EXPECT_EQ(200, plain.status);
+	EXPECT_EQ(text, plain.body);
+	EXPECT_EQ("text/css; charset=utf-8",
+			plain.headers.GetFirst(kContentType));
+	EXPECT_EQ("1000", plain.headers.GetFirst(kContentLength));
+	EXPECT_EQ("Accept-Encoding", plain.headers.GetFirst("Vary"));
+	EXPECT_EQ(0, plain.headers.Get(kConnection));
+	string etag = plain.headers.GetFirst("ETag");
+	EXPECT_EQ('"', etag[0]);
+
+	h->Set(kAcceptEncoding, "deflate, gzip;q=0.5");
+	RecordingWriter gzipped;
+	cached->ServeHTTP(&gzipped, &req);
+	EXPECT_EQ(200, gzipped.status);
+	EXPECT_EQ("gzip", gzipped.headers.GetFirst(kContentEncoding));
+	EXPECT_EQ(std::to_string(gzipped.body.length()),
+			gzipped.headers.GetFirst(kContentLength));
+	EXPECT_GT(text.length(), gzipped.body.length());
+	EXPECT_EQ("\x1f\x8b", gzipped.body.substr(0, 2));
+
+	// The gzipped contents have a tag of their own, which is what
+	// conditions are matched against when they'd be served.
+	string gzip_etag = gzipped.headers.GetFirst("ETag");
+	EXPECT_EQ(etag.substr(0, etag.length() - 1) + "-gz\"", gzip_etag);
+	h->Set(kIfNoneMatch, etag);
+	RecordingWriter stale;
+	cached->ServeHTTP(&stale, &req);
+	EXPECT_EQ(200, stale.status);
+	EXPECT_EQ(gzipped.body, stale.body);
+
+	h->Set(kIfNoneMatch, gzip_etag);
+	RecordingWriter gzip_not_modified;
+	cached->ServeHTTP(&gzip_not_modified, &req);
+	EXPECT_EQ(304, gzip_not_modified.status);
+	EXPECT_EQ(gzip_etag, gzip_not_modified.headers.GetFirst("ETag"));
+	EXPECT_EQ("Accept-Encoding",
+			gzip_not_modified.headers.GetFirst("Vary"));
+
+	h->Set(kAcceptEncoding, "gzip;q=0");
+	h->Set(kIfNoneMatch, etag);
+	RecordingWriter not_modified;
+	cached->ServeHTTP(&not_modified, &req);
+	EXPECT_EQ(304, not_modified.status);
+	EXPECT_EQ("", not_modified.body);
+	EXPECT_EQ(etag, not_modified.headers.GetFirst("ETag"));
+	EXPECT_EQ("Accept-Encoding", not_modified.headers.GetFirst("Vary"));
+
+	// Changes are picked up once the file is checked again.
+	h->Delete(kIfNoneMatch);
+	WriteFile("/style.css", "b");
+	usleep(1100000);
+	RecordingWriter changed;
+	cached->ServeHTTP(&changed, &req);
+	EXPECT_EQ("b", changed.body);
+	EXPECT_EQ("", changed.headers.GetFirst(kContentEncoding));
+	EXPECT_NE(etag, changed.headers.GetFirst("ETag"));
+
+	// Files which are too large or missing are served regularly.
+	unlink((root_ + "/style.css").c_str());
+	usleep(1100000);
+	RecordingWriter missing;
+	cached->ServeHTTP(&missing, &req);
+	EXPECT_EQ(404, missing.status);
+
+	RecordingWriter range;
+	req.SetPath("/hello.txt");
+	h->Set(kRange, "bytes=0-4");
+	cached->ServeHTTP(&range, &req);
+	EXPECT_EQ(206, range.status);
+	EXPECT_EQ("Hello", range.body);
+}
+TEST_F(FileHandlerTest, CachedClose)
+{
+	ScopedPtr<Handler> cached(Handler::CachedFileServer(root_));
+	RecordingConnection conn;
+	Request req;
+	req.SetHeaders(new Headers);
+	req.SetMethod(kMethodGet);
+	req.SetPath("/hello.txt");
+
+	{
+		HTTPResponseWriter rw(&conn);
+		Headers h;
+		h.Set(kConnection, "close");
+		rw.AddHeaders(h);
+		cached->ServeHTTP(&rw, &req);
+	}
+	{
+		HTTPResponseWriter rw(&conn);
+		cached->ServeHTTP(&rw, &req);
+	}
+
+	// The writer decides on the Connection header, only once.
+	ASSERT_EQ(2, conn.sent.size());
+	EXPECT_EQ(string::npos, conn.sent[0].find("keep-alive"));
+	EXPECT_NE(string::npos, conn.sent[0].find("Connection: close\r\n"));
+	EXPECT_NE(string::npos, conn.sent[1].find(
+				"Connection: keep-alive\r\n"));
+	EXPECT_EQ(conn.sent[1].find("Connection:"),
+			conn.sent[1].rfind("Connection:"));
+}
+
+TEST_F(FileHandlerTest, CachedMemory)
+{
+	// Room for two of the files.
+	ScopedPtr<Handler> cached(Handler::CachedFileServer(root_, 65536,
+				4096));
+	Request req;
+	req.SetHeaders(new Headers);
+	req.SetMethod(kMethodGet);
+
+	for (int i = 0; i < 4; i++)
+	{
+		string name = "/" + std::to_string(i) + ".css";
+		WriteFile(name, string(1000, 'a' + i));
+		RecordingWriter w;
+		req.SetPath(name);
+		cached->ServeHTTP(&w, &req);
+		EXPECT_EQ(200, w.status);
+		unlink((root_ + name).c_str());
+	}
+
+	// Only the files loaded last are still there.
+	RecordingWriter evicted, kept;
+	req.SetPath("/0.css");
+	cached->ServeHTTP(&evicted, &req);
+	EXPECT_EQ(404, evicted.status);
+	req.SetPath("/3.css");
+	cached->ServeHTTP(&kept, &req);
+	EXPECT_EQ(200, kept.status);
+	EXPECT_EQ(string(1000, 'd'), kept.body);
+}
+
+TEST_F(FileHandlerTest, Shrunk)
+{
+	WebServer server;
+	ServeMux mux;
+	ScopedPtr<Protocol> proto(Protocol::HTTP());
+	ShrinkingHandler shrinking(handler_.Get(), root_ + "/hello.txt");
+	RecordingConnection conn;
+	mux.Handle("/", &shrinking);
+	ProtocolServer ps(&server, proto.Get(), &mux);
+	ScopedPtr<Connection> decorated(ps.AddDecorators(&conn));
+
+	conn.input = "GET /hello.txt HTTP/1.1\r\nHost: example.com\r\n\r\n"
+		"GET /hello.txt HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	ps.DataReady(decorated.Get());
+
+	// The length of the file was announced before it shrank, so the
+	// connection is closed rather than taking the next response for the
+	// rest of the body.
+	EXPECT_EQ(1, shrinking.calls);
+	EXPECT_NE(string::npos, conn.All().find("Content-Length: 13\r\n"));
+	EXPECT_EQ(conn.All().find("HTTP/1.1"), conn.All().rfind("HTTP/1.1"));
+	EXPECT_TRUE(conn.shut_down);
+	ps.ConnectionTerminated(decorated.Get());
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
@@ -29,6 +29,9 @@
 
 #include <list>
 #include <string>
+#include <strings.h>
+#include <utility>
+#include <vector>
 #include "server.h"
 
 namespace http
@@ -38,8 +41,38 @@ namespace server
 using std::list;
 using std::string;
 
+// Returned by reference for missing values.
+static const string kEmpty;
+
+// Number of headers to make room for right away. Requests from browsers
+// rarely have more.
+static const size_t kInitialHeaders = 16;
+
+// FNV-1a hash over the lower case version of name.
+static uint32_t
+fold_hash(StringPiece name)
+{
+	uint32_t hash = 2166136261U;
+
+	for (char c : name)
+	{
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		hash = (hash ^ static_cast<unsigned char>(c)) * 16777619U;
+	}
+
+	return hash;
+}
+
 Header::Header(string key, list<string> values)
-: key_(key), values_(values)
+: key_(std::move(key)), num_values_(0)
+{
+	for (string& value : values)
+		AddValue(std::move(value));
+}
+
+Header::Header(string key)
+: key_(std::move(key)), num_values_(0)
 {
 }
 
@@ -50,10 +83,10 @@ Header::~Header()
 void
 Header::SetName(string newkey)
 {
-	key_ = newkey;
+	key_ = std::move(newkey);
 }
 
-string
+const string&
 Header::GetName() const
 {
 	return key_;
@@ -62,33 +95,65 @@ Header::GetName() const
 void
 Header::AddValue(string value)
 {
-	values_.push_back(value);
+	if (num_values_ == 0)
+		first_value_ = std::move(value);
+	else
+		more_values_.push_back(std::move(value));
+	num_values_++;
 }
 
 void
 Header::DeleteValue(string value)
 {
-	values_.remove(value);
+	list<string> values = GetValues();
+
+	values.remove(value);
+	ClearValues();
+	for (string& v : values)
+		AddValue(std::move(v));
 }
 
 void
 Header::ClearValues()
 {
-	values_.clear();
+	first_value_.clear();
+	more_values_.clear();
+	num_values_ = 0;
 }
 
-string
+const string&
 Header::GetFirstValue() const
 {
-	if (values_.empty())
-		return string();
-	return values_.front();
+	if (num_values_ == 0)
+		return kEmpty;
+	return first_value_;
 }
 
 list<string>
 Header::GetValues() const
 {
-	return values_;
+	list<string> values;
+
+	for (size_t i = 0; i < num_values_; i++)
+		values.push_back(GetValue(i));
+
+	return values;
+}
+
+size_t
+Header::NumValues() const
+{
+	return num_values_;
+}
+
+const string&
+Header::GetValue(size_t i) const
+{
+	if (i >= num_values_)
+		return kEmpty;
+	if (i == 0)
+		return first_value_;
+	return more_values_[i - 1];
 }
 
 bool
@@ -100,8 +165,8 @@ Header::Merge(const Header& other)
 	if (other.key_ != key_ && other.key_.length() > 0)
 		return false;
 
-	values_.insert(values_.end(), other.values_.begin(),
-		       	other.values_.end());
+	for (size_t i = 0; i < other.num_values_; i++)
+		AddValue(other.GetValue(i));
 	return true;
 }
 
@@ -119,82 +184,181 @@ Header::operator==(const Header& other) const
 
 Headers::Headers()
 {
+	for (int i = 0; i < kNumKnownHeaders; i++)
+		known_[i] = -1;
 }
 
 Headers::~Headers()
 {
 }
 
-void
-Headers::Add(string key, string value)
+int
+Headers::Find(StringPiece key, uint32_t hash) const
 {
-	const auto& h = headers_.find(key);
-	if (h == headers_.end())
+	for (size_t i = 0; i < hashes_.size(); i++)
 	{
-		list<string> values;
-		values.push_back(value);
-		headers_.insert(std::make_pair(key, Header(key, values)));
+		const string& name = headers_[i].GetName();
+
+		if (hashes_[i] == hash && name.length() == key.length() &&
+				strncasecmp(name.data(), key.data(),
+					key.length()) == 0)
+			return i;
 	}
-	else
+
+	return -1;
+}
+
+int
+Headers::Append(string key, uint32_t hash)
+{
+	if (headers_.empty())
 	{
-		h->second.AddValue(value);
+		headers_.reserve(kInitialHeaders);
+		hashes_.reserve(kInitialHeaders);
 	}
+
+	headers_.push_back(Header(std::move(key)));
+	hashes_.push_back(hash);
+	return headers_.size() - 1;
 }
 
 void
-Headers::Set(string key, string value)
+Headers::IndexKnownHeaders()
 {
-	const auto& h = headers_.find(key);
-	if (h == headers_.end())
+	for (int i = 0; i < kNumKnownHeaders; i++)
+		known_[i] = -1;
+
+	for (size_t i = 0; i < headers_.size(); i++)
 	{
-		list<string> values;
-		values.push_back(value);
-		headers_.insert(std::make_pair(key, Header(key, values)));
+		KnownHeader h = LookupKnownHeader(headers_[i].GetName());
+		if (h != kUnknownHeader)
+			known_[h] = i;
 	}
-	else
+}
+
+Header*
+Headers::Slot(KnownHeader key)
+{
+	if (known_[key] < 0)
 	{
-		h->second.ClearValues();
-		h->second.AddValue(value);
+		StringPiece name = KnownHeaderName(key);
+		known_[key] = Append(name.ToString(), fold_hash(name));
 	}
+
+	return &headers_[known_[key]];
+}
+
+Header*
+Headers::Slot(string key)
+{
+	KnownHeader h = LookupKnownHeader(key);
+	if (h != kUnknownHeader)
+		return Slot(h);
+
+	uint32_t hash = fold_hash(key);
+	int pos = Find(key, hash);
+	if (pos < 0)
+		pos = Append(std::move(key), hash);
+
+	return &headers_[pos];
 }
 
 void
-Headers::Delete(string key)
+Headers::Add(string key, string value)
+{
+	Slot(std::move(key))->AddValue(std::move(value));
+}
+
+void
+Headers::Add(KnownHeader key, string value)
+{
+	Slot(key)->AddValue(std::move(value));
+}
+
+void
+Headers::Set(string key, string value)
+{
+	Header* h = Slot(std::move(key));
+	h->ClearValues();
+	h->AddValue(std::move(value));
+}
+
+void
+Headers::Set(KnownHeader key, string value)
 {
-	const auto& h = headers_.find(key);
-	if (h != headers_.end())
-		headers_.erase(h);
+	Header* h = Slot(key);
+	h->ClearValues();
+	h->AddValue(std::move(value));
+}
+
+void
+Headers::Delete(StringPiece key)
+{
+	int pos = Find(key, fold_hash(key));
+	if (pos < 0)
+		return;
+
+	headers_.erase(headers_.begin() + pos);
+	hashes_.erase(hashes_.begin() + pos);
+	IndexKnownHeaders();
+}
+
+void
+Headers::Delete(KnownHeader key)
+{
+	if (known_[key] >= 0)
+		Delete(KnownHeaderName(key));
 }
 
 const Header*
-Headers::Get(const string& key) const
+Headers::Get(StringPiece key) const
 {
-	const auto& h = headers_.find(key);
-	if (h == headers_.end())
+	KnownHeader k = LookupKnownHeader(key);
+	if (k != kUnknownHeader)
+		return Get(k);
+
+	int pos = Find(key, fold_hash(key));
+	if (pos < 0)
 		return 0;
 	else
-		return &h->second;
+		return &headers_[pos];
 }
 
-const string
-Headers::GetFirst(const string& key) const
+const Header*
+Headers::Get(KnownHeader key) const
 {
-	const auto& h = headers_.find(key);
-	if (h == headers_.end())
-		return "";
+	if (known_[key] < 0)
+		return 0;
 	else
-		return h->second.GetFirstValue();
+		return &headers_[known_[key]];
+}
+
+const string&
+Headers::GetFirst(StringPiece key) const
+{
+	const Header* h = Get(key);
+	if (!h)
+		return kEmpty;
+	else
+		return h->GetFirstValue();
+}
+
+const string&
+Headers::GetFirst(KnownHeader key) const
+{
+	if (known_[key] < 0)
+		return kEmpty;
+	else
+		return headers_[known_[key]].GetFirstValue();
 }
 
 void
 Headers::Merge(const Headers& headers)
 {
-	for (const std::pair<string, Header> h : headers.headers_)
+	for (const Header& h : headers.headers_)
 	{
-		for (const string& val : headers.Get(h.first)->GetValues())
-		{
-			Add(h.first, val);
-		}
+		for (size_t i = 0; i < h.NumValues(); i++)
+			Add(h.GetName(), h.GetValue(i));
 	}
 }
 
@@ -203,10 +367,28 @@ Headers::HeaderNames() const
 {
 	list<string> names;
 
-	for (const std::pair<string, Header> h : headers_)
-		names.push_back(h.first);
+	for (const Header& h : headers_)
+		names.push_back(h.GetName());
 
 	return names;
 }
+
+Headers::const_iterator
+Headers::begin() const
+{
+	return headers_.begin();
+}
+
+Headers::const_iterator
+Headers::end() const
+{
+	return headers_.end();
+}
+
+size_t
+Headers::size() const
+{
+	return headers_.size();
+}
 }  // namespace server
 }  // namespace http
@@ -120,6 +120,105 @@ TEST_F(HeadersTest, AddSetDelGet)
 	EXPECT_EQ(0, values.size());
 }
 
+TEST_F(HeadersTest, KnownHeaders)
+{
+	EXPECT_EQ(kContentLength, LookupKnownHeader("Content-Length"));
+	EXPECT_EQ(kContentLength, LookupKnownHeader("content-length"));
+	EXPECT_EQ(kXRequestedWith, LookupKnownHeader("X-REQUESTED-WITH"));
+	EXPECT_EQ(kUnknownHeader, LookupKnownHeader("Content-Lengths"));
+	EXPECT_EQ(kUnknownHeader, LookupKnownHeader("Content-Lengt"));
+	EXPECT_EQ(kUnknownHeader, LookupKnownHeader("X-Foo"));
+	EXPECT_EQ(kUnknownHeader, LookupKnownHeader(""));
+	// Hashes like Host, but must not match it.
+	EXPECT_EQ(kUnknownHeader, LookupKnownHeader(StringPiece("Host\0k", 6)));
+
+	for (int i = 0; i < kNumKnownHeaders; i++)
+	{
+		KnownHeader h = static_cast<KnownHeader>(i);
+		EXPECT_EQ(h, LookupKnownHeader(KnownHeaderName(h)));
+	}
+}
+
+TEST_F(HeadersTest, KnownHeaderSlots)
+{
+	Headers h;
+
+	h.Add("content-length", "42");
+	h.Add("X-Foo", "bar");
+	EXPECT_EQ("42", h.GetFirst(kContentLength));
+	EXPECT_EQ("42", h.GetFirst("Content-Length"));
+	EXPECT_EQ("42", h.GetFirst("CONTENT-LENGTH"));
+	EXPECT_EQ("", h.GetFirst(kHost));
+	EXPECT_EQ(0, h.Get(kHost));
+
+	list<string> names = h.HeaderNames();
+	ASSERT_EQ(2, names.size());
+	EXPECT_EQ("Content-Length", names.front());
+	EXPECT_EQ("X-Foo", names.back());
+
+	h.Set(kContentLength, "23");
+	ASSERT_NE((Header*) 0, h.Get(kContentLength));
+	EXPECT_EQ(1, h.Get(kContentLength)->GetValues().size());
+	EXPECT_EQ("23", h.GetFirst("content-length"));
+
+	Headers copy(h);
+	h.Delete("Content-Length");
+	EXPECT_EQ(0, h.Get(kContentLength));
+	EXPECT_EQ("23", copy.GetFirst(kContentLength));
+
+	h = copy;
+	copy.Delete(kContentLength);
+	EXPECT_EQ("23", h.GetFirst(kContentLength));
+	EXPECT_EQ(0, copy.Get("Content-Length"));
+}
+
+TEST_F(HeadersTest, CaseInsensitive)
+{
+	Headers h;
+
+	h.Add("X-Forwarded-Proto", "https");
+	h.Add("x-forwarded-proto", "http");
+	h.Add("X-Trace", "1");
+
+	ASSERT_EQ(2, h.size());
+	EXPECT_EQ("https", h.GetFirst("X-FORWARDED-PROTO"));
+	ASSERT_NE((Header*) 0, h.Get("x-forwarded-proto"));
+	EXPECT_EQ(2, h.Get("x-forwarded-proto")->NumValues());
+	EXPECT_EQ("http", h.Get("x-forwarded-proto")->GetValue(1));
+	EXPECT_EQ("", h.Get("x-forwarded-proto")->GetValue(2));
+
+	h.Delete("x-FORWARDED-proto");
+	EXPECT_EQ(0, h.Get("X-Forwarded-Proto"));
+	EXPECT_EQ("1", h.GetFirst("x-trace"));
+}
+
+TEST_F(HeadersTest, Iteration)
+{
+	Headers h;
+	const char* names[] = { "Host", "X-B", "Accept", "X-A" };
+
+	h.Add("Host", "www.example.com");
+	h.Add("X-B", "b");
+	h.Add("Accept", "*/*");
+	h.Add("X-A", "a");
+	h.Add("X-B", "bb");
+
+	// Headers are kept in the order they were first added.
+	size_t i = 0;
+	for (const Header& hdr : h)
+	{
+		ASSERT_LT(i, 4);
+		EXPECT_EQ(names[i], hdr.GetName());
+		i++;
+	}
+	EXPECT_EQ(4, i);
+
+	h.Delete(kHost);
+	EXPECT_EQ("X-B", h.begin()->GetName());
+	EXPECT_EQ(2, h.begin()->NumValues());
+	EXPECT_EQ("*/*", h.GetFirst(kAccept));
+}
+
 } /* namespace testing */
 } /* namespace server */
 } /* namespace http */
@@ -29,8 +29,8 @@
 
 #include <algorithm>
 #include <string>
-#include <siot/acknowledgementdecorator.h>
-#include <siot/rangereaderdecorator.h>
+#include <strings.h>
+#include <thread++/threadpool.h>
 #include <toolbox/expvar.h>
 
 #include "server.h"
@@ -40,11 +40,35 @@ namespace http
 {
 namespace server
 {
+using google::protobuf::NewCallback;
 using std::string;
 using toolbox::ExpMap;
 using toolbox::ExpVar;
-using toolbox::siot::AcknowledgementDecorator;
-using toolbox::siot::RangeReaderDecorator;
+using toolbox::siot::Connection;
+
+// Most data kept around for a request whose head isn't complete yet.
+static const size_t kMaxPendingData = 10485760;
+
+// Reader for the body of a request. The part of the body which was received
+// along with the head comes first, the rest is read from the connection as
+// it arrives.
+class BodyConnection : public Connection
+{
+public:
+	BodyConnection(PeerConnection* conn, string prefix, size_t length);
+	virtual ~BodyConnection();
+
+	// Implements Connection.
+	virtual string Receive();
+	virtual void SetBlocking(bool b = true);
+	virtual void DeferredShutdown();
+
+private:
+	PeerConnection* const conn_;
+	string prefix_;
+	// Bytes of the body still to be read from the connection.
+	size_t remaining_;
+};
 
 class HTTProtocol : public Protocol
 {
@@ -57,6 +81,69 @@ public:
 	virtual const ServerSSLContext* GetContext();
 	virtual void DecodeConnection(threadpp::ThreadPool* executor,
 			const ServeMux* mux, const Peer* peer);
+
+private:
+	// What to do with the connection after a request has been served.
+	enum Disposition
+	{
+		kNextRequest,
+		kWaitForData,
+		kCloseConnection,
+	};
+
+	// A request handed to the executor, along with everything needed to
+	// carry on with the connection once its handler is done. It lives in
+	// the arena of the peer, like the objects of its request.
+	struct Call : public ArenaObject
+	{
+		Call(threadpp::ThreadPool* executor, const ServeMux* mux,
+				const Peer* peer, string* pending);
+
+		threadpp::ThreadPool* const executor;
+		const ServeMux* const mux;
+		const Peer* const peer;
+		// Responses to earlier pipelined requests, which have to go
+		// out first, followed by the response to this one.
+		string responses;
+		ScopedPtr<HTTPResponseWriter> rw;
+		Request req;
+		Handler* handler;
+		Disposition next;
+		// Whether more data was received after this request.
+		bool more;
+	};
+
+	// Decodes the connection of a peer claimed with BeginDecoding()
+	// until there's nothing left to do, then lets go of it.
+	void DecodeClaimed(threadpp::ThreadPool* executor,
+			const ServeMux* mux, const Peer* peer);
+
+	// Decodes and serves the requests received so far. Returns false if
+	// a request has been handed to the executor, which carries on with
+	// the connection once the handler is done.
+	bool DecodeRequests(threadpp::ThreadPool* executor,
+			const ServeMux* mux, const Peer* peer);
+
+	// Sets up the request just parsed by the peers parser and looks up
+	// its handler. Requests which can't be served are answered right
+	// away, leaving handler at 0. offset points behind the head in the
+	// peers receive buffer; it is moved past the part of the body
+	// received so far.
+	Disposition PrepareRequest(const ServeMux* mux, const Peer* peer,
+			size_t* offset, HTTPResponseWriter* rw, Request* req,
+			Handler** handler);
+
+	// Serve the request just parsed by the peers parser, appending the
+	// response to responses. offset is as for PrepareRequest().
+	Disposition ServeRequest(const ServeMux* mux, const Peer* peer,
+			size_t* offset, string* responses);
+
+	// Runs the handler of call on the executor, sends the response and
+	// goes on with the connection.
+	void RunCall(Call* call);
+
+	// Gets the peer ready for the next request once one has been served.
+	void FinishRequest(const Peer* peer);
 };
 
 class HTTPSProtocol : public HTTProtocol
@@ -77,6 +164,68 @@ static ExpVar<int64_t> numHttpRequests("http-server-num-http-requests");
 static ExpMap<int64_t> numHttpHostRequests("http-server-http-requests-by-host");
 static ExpMap<int64_t> numHttpRequestErrors("http-server-http-request-errors");
 
+BodyConnection::BodyConnection(PeerConnection* conn, string prefix,
+		size_t length)
+: conn_(conn), remaining_(length - prefix.length())
+{
+	prefix_.swap(prefix);
+}
+
+BodyConnection::~BodyConnection()
+{
+}
+
+string
+BodyConnection::Receive()
+{
+	string data;
+
+	if (!prefix_.empty())
+	{
+		data.swap(prefix_);
+		return data;
+	}
+
+	if (remaining_ == 0)
+		return data;
+
+	// The body is read like the requests, holding the read lock.
+	if (!conn_->ReadLock())
+		return data;
+
+	try
+	{
+		data = conn_->Receive();
+	}
+	catch (...)
+	{
+		conn_->Unlock();
+		throw;
+	}
+
+	// Anything beyond the body belongs to the next request, so it is
+	// left on the connection.
+	if (data.length() > remaining_)
+		data.resize(remaining_);
+	conn_->Acknowledge(data.length());
+	conn_->Unlock();
+	remaining_ -= data.length();
+	return data;
+}
+
+void
+BodyConnection::SetBlocking(bool b)
+{
+	conn_->SetBlocking(b);
+}
+
+void
+BodyConnection::DeferredShutdown()
+{
+	// The request is done with its body; the connection stays open.
+	delete this;
+}
+
 HTTProtocol::HTTProtocol()
 {
 }
@@ -97,176 +246,324 @@ HTTProtocol::GetContext()
 	return 0;
 }
 
+HTTProtocol::Call::Call(threadpp::ThreadPool* executor, const ServeMux* mux,
+		const Peer* peer, string* pending)
+: executor(executor), mux(mux), peer(peer),
+	rw(new HTTPResponseWriter(peer->PeerSocket(), &responses)), handler(0),
+	next(kNextRequest), more(false)
+{
+	responses.swap(*pending);
+}
+
 void
 HTTProtocol::DecodeConnection(threadpp::ThreadPool* executor,
 		const ServeMux* mux, const Peer* peer)
 {
-	AcknowledgementDecorator* ack =
-		static_cast<AcknowledgementDecorator*>(peer->PeerSocket());
-	// Only attempt processing if we can own the connection.
-	if (!ack->TryReadLock())
+	// Someone else is busy with the connection, e.g. its handler is still
+	// running on the executor. They will look at it again once done.
+	if (!peer->BeginDecoding())
 		return;
 
-	ack->SetBlocking(true);
-	string alldata = ack->Receive();
-	ack->SetBlocking(false);
+	DecodeClaimed(executor, mux, peer);
+}
 
-	if (alldata.find("\n\n") == string::npos &&
-			alldata.find("\r\n\r\n") == string::npos)
+void
+HTTProtocol::DecodeClaimed(threadpp::ThreadPool* executor,
+		const ServeMux* mux, const Peer* peer)
+{
+	try
 	{
-		// Try again later when we have more data.
-		ack->Unlock();
-		return;
+		do
+		{
+			if (!DecodeRequests(executor, mux, peer))
+				return;
+		}
+		while (peer->EndDecoding());
 	}
-
-	HTTPResponseWriter rw(peer->PeerSocket());
-	Request req;
-	list<string> lines;
-	size_t pos = 0, lpos = 0;
-	Headers* hdr = new Headers;
-	string command;
-	string path;
-	string protocol;
-
-	while (lpos < alldata.length() &&
-			(pos = alldata.find("\n", lpos)) != string::npos)
+	catch (...)
 	{
-		size_t endpos = alldata[pos-1] == '\r' ? pos-1 : pos;
+		// The connection is going to be shut down, so there's no point
+		// in decoding it again. It has to be done before letting go,
+		// as the peer may be gone afterwards.
+		peer->PeerSocket()->DeferredShutdown();
+		while (peer->EndDecoding());
+		throw;
+	}
+}
 
-		if (endpos != lpos)
-			lines.push_back(alldata.substr(lpos, endpos - lpos));
-		else
+bool
+HTTProtocol::DecodeRequests(threadpp::ThreadPool* executor,
+		const ServeMux* mux, const Peer* peer)
+{
+	PeerConnection* conn = peer->PeerSocket();
+	// Only attempt processing if we can own the connection.
+	if (!conn->TryReadLock())
+		return true;
+
+	// Everything received is moved to the peers buffer right away, so
+	// the connection only hands out new data next time.
+	conn->SetBlocking(true);
+	string received = conn->Receive();
+	conn->SetBlocking(false);
+	conn->Acknowledge(received.length());
+
+	string* buffer = peer->ReceiveBuffer();
+	if (buffer->empty())
+		buffer->swap(received);
+	else
+		buffer->append(received);
+
+	// The parser remembers how far it got in previous attempts, so only
+	// the newly received data is looked at.
+	RequestParser* parser = peer->Parser();
+	string responses;
+	size_t offset = 0;
+	Disposition next = kNextRequest;
+
+	// Serve all requests which have been received completely, so
+	// pipelined requests don't have to wait for another wakeup. The
+	// responses are collected and sent together in request order.
+	while (next == kNextRequest && offset < buffer->length())
+	{
+		RequestParser::State state = parser->Parse(
+				buffer->data() + offset,
+				buffer->length() - offset);
+		if (state == RequestParser::kIncomplete)
+		{
+			// Try again later when we have more data, unless the
+			// client is just filling up our memory.
+			if (buffer->length() - offset > kMaxPendingData)
+			{
+				numHttpRequestErrors.Add("request-too-large",
+						1);
+				next = kCloseConnection;
+			}
 			break;
+		}
 
-		lpos = pos + 1;
+		offset += parser->Consumed();
+
+		if (!executor)
+		{
+			next = ServeRequest(mux, peer, &offset, &responses);
+			FinishRequest(peer);
+			continue;
+		}
+
+		// Parsing and routing are cheap enough for the I/O thread, but
+		// the handler runs on the executor so slow handlers don't hold
+		// up other connections.
+		Call* call = new (peer->RequestArena()) Call(executor, mux,
+				peer, &responses);
+		call->next = PrepareRequest(mux, peer, &offset, call->rw.Get(),
+				&call->req, &call->handler);
+		if (!call->handler)
+		{
+			// Answered already, e.g. with an error.
+			next = call->next;
+			call->rw.Reset();
+			responses.swap(call->responses);
+			delete call;
+			FinishRequest(peer);
+			continue;
+		}
+
+		// The peer stays claimed until the handler is done, so the
+		// next request is only decoded after this one was answered.
+		call->more = offset < buffer->length();
+		if (call->more && call->next == kNextRequest)
+			call->rw->HoldOutput();
+		buffer->erase(0, offset);
+		conn->Unlock();
+		executor->Add(NewCallback(this, &HTTProtocol::RunCall, call));
+		return false;
 	}
-	while (lpos < alldata.length() && (alldata[lpos] == '\r' ||
-				alldata[lpos] == '\n'))
-		lpos++;
-	alldata.clear();
-	ack->Acknowledge(lpos);
+
+	// Only the beginning of a request is kept for the next round.
+	buffer->erase(0, offset);
+
+	if (!responses.empty())
+		conn->Send(responses);
+	conn->Unlock();
+
+	if (next == kCloseConnection)
+		conn->DeferredShutdown();
+	return true;
+}
+
+// Tells the client that the connection is closed after the response.
+static void
+AnnounceClose(HTTPResponseWriter* rw)
+{
+	Headers h;
+	h.Set(kConnection, "close");
+	rw->AddHeaders(h);
+}
+
+HTTProtocol::Disposition
+HTTProtocol::PrepareRequest(const ServeMux* mux, const Peer* peer,
+		size_t* offset, HTTPResponseWriter* rw, Request* req,
+		Handler** handler)
+{
+	PeerConnection* conn = peer->PeerSocket();
+	RequestParser* parser = peer->Parser();
+	Disposition next = kNextRequest;
+
+	rw->SetBufferSize(peer->ResponseBufferSize());
+	rw->SetDefaults(peer->Defaults());
+	*handler = 0;
 
 	numHttpRequests.Add(1);
 
-	if (!lines.size())
+	if (parser->GetState() == RequestParser::kInvalid)
 	{
-		ScopedPtr<Handler> err =
-			Handler::ErrorHandler(400, "Invalid Request");
-		err->ServeHTTP(&rw, &req);
-		numHttpRequestErrors.Add("zero-sized-request", 1);
-		delete hdr;
-		ack->Unlock();
+		AnnounceClose(rw);
+		Handler::ErrorHandler(400, "Bad Request")->ServeHTTP(rw, req);
+		if (parser->Version().empty())
+			numHttpRequestErrors.Add("unknown-protocol-header", 1);
+		else
+			numHttpRequestErrors.Add("invalid-header", 1);
 		// Cut the connection, the peer isn't making any sense.
-		ack->DeferredShutdown();
-		return;
+		return kCloseConnection;
 	}
 
-	string command_str = lines.front();
-	lines.pop_front();
+	parser->Fill(req, peer->RequestArena());
+	Headers* hdr = req->GetHeaders();
 
-	pos = command_str.find(' ');
-	lpos = command_str.rfind(' ');
-	if (pos == string::npos || lpos == string::npos || pos == lpos)
+	const string& content_length = hdr->GetFirst(kContentLength);
+	if (content_length.length() > 0)
 	{
-		ScopedPtr<Handler> err =
-			Handler::ErrorHandler(400, "Invalid Request");
-		err->ServeHTTP(&rw, &req);
-		numHttpRequestErrors.Add("unknown-protocol-header", 1);
-		delete hdr;
-		ack->Unlock();
-		// Cut the connection, the peer isn't making any sense.
-		ack->DeferredShutdown();
-		return;
+		unsigned long length = strtoul(content_length.c_str(), NULL,
+				10);
+
+		if (length > 0)
+		{
+			string* buffer = peer->ReceiveBuffer();
+			size_t prefix = std::min<size_t>(length,
+					buffer->length() - *offset);
+
+			req->SetRequestBody(new BodyConnection(conn,
+						buffer->substr(*offset, prefix),
+						length));
+			*offset += prefix;
+
+			// Unless the whole body is here, we can't tell how
+			// much of it the handler is going to consume, so
+			// any further requests are left for the next round.
+			if (prefix < length)
+				next = kWaitForData;
+		}
 	}
-	req.SetProtocol(command_str.substr(lpos));
-	req.SetAction(command_str.substr(0, pos - 1));
-	req.SetPath(command_str.substr(pos + 1, lpos - pos - 1));
 
-	for (string line : lines)
+	// The host is normalized once, for both the stats and routing.
+	string host = NormalizeHost(hdr->GetFirst(kHost));
+	numHttpHostRequests.Add(host.empty() ? "unknown" : host, 1);
+
+	// HTTP/1.1 connections are persistent unless the client asks
+	// otherwise, older ones only if the client asks for it.
+	const string& connection = hdr->GetFirst(kConnection);
+	if (req->ProtoAtLeast(1, 1) ?
+			strncasecmp(connection.c_str(), "close", 5) == 0 :
+			strncasecmp(connection.c_str(), "keep-alive", 10) != 0)
 	{
-		size_t offset = line.find(':');
-		string key = line.substr(0, offset);
+		AnnounceClose(rw);
+		next = kCloseConnection;
+	}
 
-		while (line[++offset] == ' ' && offset < line.length());
+	if (req->Method() == kMethodHead)
+		rw->OmitBody();
 
-		string value = line.substr(offset, line.length() - offset);
+	*handler = mux->GetHandler(host, req->Path(), req);
+	if (!*handler)
+	{
+		Handler::ErrorHandler(404, "Not Found")->ServeHTTP(rw, req);
+		numHttpRequestErrors.Add("no-registered-handler", 1);
+	}
 
-		if (key == "Cookie")
-		{
-			size_t prev = 0, pos = -2;
+	return next;
+}
 
-			do
-			{
-				prev = pos + 2;
-				pos = value.find("; ", prev);
-
-				if (pos == string::npos)
-					pos = value.length();
-
-				string cookie = value.substr(prev, pos - prev);
-				size_t eq = cookie.find('=');
-				if (eq != string::npos)
-				{
-					Cookie* ck = new Cookie;
-					ck->name = cookie.substr(0, eq);
-					// TODO(tonnerre): decode?
-					ck->value = cookie.substr(eq + 1);
-
-					req.AddCookie(ck);
-				}
-			}
-			while (pos < value.length());
-		}
-		else
-			hdr->Add(key, value);
-	}
+HTTProtocol::Disposition
+HTTProtocol::ServeRequest(const ServeMux* mux, const Peer* peer,
+		size_t* offset, string* responses)
+{
+	HTTPResponseWriter rw(peer->PeerSocket(), responses);
+	Request req;
+	Handler* handler;
+	Disposition next = PrepareRequest(mux, peer, offset, &rw, &req,
+			&handler);
+
+	// Pipelined requests are waiting, so their responses are sent
+	// together. The last one goes out as it is written.
+	if (*offset < peer->ReceiveBuffer()->length() && next == kNextRequest)
+		rw.HoldOutput();
 
-	req.SetHeaders(hdr);
+	if (handler)
+		handler->ServeHTTP(&rw, &req);
 
-	if (hdr->GetFirst("Content-Length").length() > 0)
+	// Whatever follows would be taken for the rest of the body.
+	if (rw.Broken())
 	{
-		unsigned long length =
-			strtoul(hdr->GetFirst("Content-Length").c_str(),
-					NULL, 10);
+		numHttpRequestErrors.Add("incomplete-response", 1);
+		next = kCloseConnection;
+	}
 
-		if (length > 0)
+	return next;
+}
+
+void
+HTTProtocol::RunCall(Call* call)
+{
+	threadpp::ThreadPool* executor = call->executor;
+	const ServeMux* mux = call->mux;
+	const Peer* peer = call->peer;
+	PeerConnection* conn = peer->PeerSocket();
+	Disposition next = call->next;
+
+	try
+	{
+		call->handler->ServeHTTP(call->rw.Get(), &call->req);
+		if (call->rw->Broken())
 		{
-			ack->SetAutoAck(true);
-			req.SetRequestBody(new RangeReaderDecorator(ack,
-						length));
+			numHttpRequestErrors.Add("incomplete-response", 1);
+			next = kCloseConnection;
 		}
+		call->rw.Reset();
+		if (!call->responses.empty())
+			conn->Send(call->responses);
 	}
-
-	if (hdr->GetFirst("Host").length() > 0)
+	catch (toolbox::siot::ClientConnectionException ex)
 	{
-		std::string Host = hdr->GetFirst("Host");
-		std::string host;
-		host.resize(Host.size());
-		std::transform(Host.begin(), Host.end(), host.begin(),
-				::tolower);
-		numHttpHostRequests.Add(host, 1);
+		numHttpRequestErrors.Add(ex.identifier(), 1);
+		next = kCloseConnection;
 	}
-	else
-		numHttpHostRequests.Add("unknown", 1);
 
-	Handler* handler = mux->GetHandler(req.Path());
-	if (!handler)
+	bool more = call->more && next == kNextRequest;
+	delete call;
+	FinishRequest(peer);
+
+	if (next == kCloseConnection)
+		conn->DeferredShutdown();
+
+	// Re-arm the connection: go on with the requests pipelined behind
+	// this one, or with whatever arrived while the handler was running.
+	// Once let go of, the peer may be gone, along with its connection.
+	try
 	{
-		ScopedPtr<Handler> err =
-			Handler::ErrorHandler(404, "Not Found");
-		err->ServeHTTP(&rw, &req);
-		numHttpRequestErrors.Add("no-registered-handler", 1);
-		if (hdr->GetFirst("Connection").substr(0, 5) == "close")
-			ack->DeferredShutdown();
-		ack->Unlock();
-		return;
+		if (more || peer->EndDecoding())
+			DecodeClaimed(executor, mux, peer);
+	}
+	catch (toolbox::siot::ClientConnectionException ex)
+	{
+		numHttpRequestErrors.Add(ex.identifier(), 1);
 	}
+}
 
-	handler->ServeHTTP(&rw, &req);
-	ack->SetAutoAck(false);
-	ack->Unlock();
-	if (hdr->GetFirst("Connection").substr(0, 5) == "close")
-		ack->DeferredShutdown();
+void
+HTTProtocol::FinishRequest(const Peer* peer)
+{
+	peer->Parser()->Reset();
+	peer->RequestArena()->Reset();
 }
 
 Protocol*
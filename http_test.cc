@@ -0,0 +1,322 @@
+/*
+ * Unit Test for the HTTP Protocol.
+ */
+
+#include "server.h"
+#include "server_internal.h"
+#include "test_connection.h"
+#include <gtest/gtest.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <siot/connection.h>
+#include <string>
+#include <thread++/threadpool.h>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+// Handler responding with the path, in two writes.
+class StreamingHandler : public Handler
+{
+public:
+	explicit StreamingHandler(RecordingConnection* conn)
+	: conn_(conn), calls(0), sent_before_return(0)
+	{
+	}
+
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+		calls++;
+		w->Write(req->Path());
+		w->Write(string("!"));
+		sent_before_return = conn_->sent.size();
+	}
+
+private:
+	RecordingConnection* conn_;
+
+public:
+	int calls;
+	size_t sent_before_return;
+};
+
+// Handler responding with the request body.
+class EchoHandler : public Handler
+{
+public:
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+		BodyReader reader(req, 1024);
+		string body;
+
+		if (reader.ReadAll(&body) != BodyReader::kEnd)
+			w->WriteHeader(400, "Bad Request");
+		w->Write(body);
+	}
+};
+
+// Handler responding with the path, which holds the first request until
+// it is released.
+class GateHandler : public Handler
+{
+public:
+	GateHandler()
+	: calls(0), started_(false), released_(false)
+	{
+	}
+
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+		{
+			std::unique_lock<std::mutex> lk(mu_);
+			calls++;
+			started_ = true;
+			cv_.notify_all();
+			cv_.wait(lk, [this] { return released_; });
+		}
+		w->Write(req->Path());
+	}
+
+	// Waits for the first request to reach the handler.
+	void WaitStarted()
+	{
+		std::unique_lock<std::mutex> lk(mu_);
+		cv_.wait(lk, [this] { return started_; });
+	}
+
+	void Release()
+	{
+		std::lock_guard<std::mutex> lk(mu_);
+		released_ = true;
+		cv_.notify_all();
+	}
+
+	int calls;
+
+private:
+	std::mutex mu_;
+	std::condition_variable cv_;
+	bool started_;
+	bool released_;
+};
+
+// Connection handing out one of segments per call to Receive().
+class SegmentedConnection : public RecordingConnection
+{
+public:
+	virtual string Receive()
+	{
+		string ret;
+		if (!segments.empty())
+		{
+			ret = segments.front();
+			segments.pop_front();
+		}
+		return ret;
+	}
+
+	std::deque<string> segments;
+};
+
+class HTTPTest : public ::testing::Test
+{
+protected:
+	HTTPTest()
+	: proto_(Protocol::HTTP()), handler_(&conn_)
+	{
+		mux_.Handle("/", &handler_);
+		mux_.Handle("/echo", &echo_);
+		mux_.Handle("/gate", &gate_);
+	}
+
+	// Takes the Date headers out of response, they are different every
+	// second.
+	static string StripDates(string response)
+	{
+		size_t pos;
+		while ((pos = response.find("Date: ")) != string::npos)
+			response.erase(pos, response.find('\n', pos) + 1 - pos);
+		return response;
+	}
+
+	WebServer server_;
+	ServeMux mux_;
+	ScopedPtr<Protocol> proto_;
+	RecordingConnection conn_;
+	StreamingHandler handler_;
+	EchoHandler echo_;
+	GateHandler gate_;
+};
+
+TEST_F(HTTPTest, Pipelined)
+{
+	server_.SetResponseBufferSize(1024);
+	ProtocolServer ps(&server_, proto_.Get(), &mux_);
+	ScopedPtr<Connection> conn(ps.AddDecorators(&conn_));
+
+	conn_.input = "GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n"
+		"GET /b HTTP/1.1\r\nHost: example.com\r\n\r\n"
+		"GET /c HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	ps.DataReady(conn.Get());
+
+	// All responses go out together, in order.
+	EXPECT_EQ(3, handler_.calls);
+	ASSERT_EQ(1, conn_.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Length: 3\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"/a!"
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: 3\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"/b!"
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: 3\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"/c!", StripDates(conn_.sent[0]));
+	ps.ConnectionTerminated(conn.Get());
+}
+
+TEST_F(HTTPTest, Streamed)
+{
+	ProtocolServer ps(&server_, proto_.Get(), &mux_);
+	ScopedPtr<Connection> conn(ps.AddDecorators(&conn_));
+
+	conn_.input = "GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	ps.DataReady(conn.Get());
+
+	// The body reached the connection while the handler was running.
+	EXPECT_EQ(1, handler_.calls);
+	EXPECT_EQ(2, handler_.sent_before_return);
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"\r\n"
+			"2\r\n/a\r\n"
+			"1\r\n!\r\n"
+			"0\r\n\r\n", StripDates(conn_.All()));
+	ps.ConnectionTerminated(conn.Get());
+}
+
+TEST_F(HTTPTest, Trickle)
+{
+	server_.SetResponseBufferSize(1024);
+	ProtocolServer ps(&server_, proto_.Get(), &mux_);
+	ScopedPtr<Connection> conn(ps.AddDecorators(&conn_));
+	const string request = "GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n";
+
+	// The head arrives one byte at a time.
+	for (char c : request)
+	{
+		EXPECT_EQ(0, handler_.calls);
+		conn_.input.push_back(c);
+		ps.DataReady(conn.Get());
+	}
+
+	EXPECT_EQ(1, handler_.calls);
+	ASSERT_EQ(1, conn_.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Length: 3\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"/a!", StripDates(conn_.sent[0]));
+
+	// Nothing is left over to be served again.
+	ps.DataReady(conn.Get());
+	EXPECT_EQ(1, handler_.calls);
+	EXPECT_EQ(1, conn_.sent.size());
+	ps.ConnectionTerminated(conn.Get());
+}
+
+TEST_F(HTTPTest, Body)
+{
+	SegmentedConnection segmented;
+	server_.SetResponseBufferSize(1024);
+	ProtocolServer ps(&server_, proto_.Get(), &mux_);
+	ScopedPtr<Connection> conn(ps.AddDecorators(&segmented));
+
+	// The body comes partly with the head, partly later, followed by
+	// another request.
+	segmented.segments.push_back("POST /echo HTTP/1.1\r\n"
+			"Host: example.com\r\nContent-Length: 11\r\n\r\n"
+			"Hello");
+	segmented.segments.push_back(" World"
+			"GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n");
+	ps.DataReady(conn.Get());
+	ps.DataReady(conn.Get());
+
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Length: 11\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"Hello World"
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: 3\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"/a!", StripDates(segmented.All()));
+	ps.ConnectionTerminated(conn.Get());
+}
+
+TEST_F(HTTPTest, TerminatedWhileServing)
+{
+	server_.SetExecutor(new threadpp::ThreadPool(1));
+	ProtocolServer ps(&server_, proto_.Get(), &mux_);
+	ScopedPtr<Connection> conn(ps.AddDecorators(&conn_));
+
+	conn_.input = "GET /gate HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	ps.DataReady(conn.Get());
+	gate_.WaitStarted();
+
+	// The connection goes away under the handler, which must not touch
+	// it any more once it is done.
+	ps.ConnectionTerminated(conn.Get());
+	conn.Reset();
+	gate_.Release();
+	server_.SetExecutor(0);
+
+	EXPECT_EQ(1, gate_.calls);
+	EXPECT_TRUE(conn_.sent.empty());
+}
+
+TEST_F(HTTPTest, DataWhileServing)
+{
+	server_.SetExecutor(new threadpp::ThreadPool(1));
+	server_.SetResponseBufferSize(1024);
+	ProtocolServer ps(&server_, proto_.Get(), &mux_);
+	ScopedPtr<Connection> conn(ps.AddDecorators(&conn_));
+
+	conn_.input = "GET /gate HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	ps.DataReady(conn.Get());
+	gate_.WaitStarted();
+
+	// The next request arrives while the handler is still busy, it is
+	// served once the handler is done, without another wakeup.
+	conn_.input = "GET /gate/2 HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	ps.DataReady(conn.Get());
+	gate_.Release();
+	server_.SetExecutor(0);
+
+	EXPECT_EQ(2, gate_.calls);
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Length: 5\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"/gate"
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: 7\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"/gate/2", StripDates(conn_.All()));
+	ps.ConnectionTerminated(conn.Get());
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
@@ -0,0 +1,180 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <strings.h>
+
+#include "server.h"
+
+namespace http
+{
+namespace server
+{
+// Canonical names of the known headers, in the order of KnownHeader.
+static constexpr const char* kKnownHeaderNames[] = {
+	"Accept",
+	"Accept-Charset",
+	"Accept-Encoding",
+	"Accept-Language",
+	"Authorization",
+	"Cache-Control",
+	"Connection",
+	"Content-Encoding",
+	"Content-Length",
+	"Content-Type",
+	"Cookie",
+	"Date",
+	"Expect",
+	"Host",
+	"If-Match",
+	"If-Modified-Since",
+	"If-None-Match",
+	"If-Range",
+	"If-Unmodified-Since",
+	"Origin",
+	"Pragma",
+	"Range",
+	"Referer",
+	"Transfer-Encoding",
+	"Upgrade",
+	"User-Agent",
+	"X-Forwarded-For",
+	"X-Requested-With",
+};
+
+static_assert(sizeof(kKnownHeaderNames) / sizeof(kKnownHeaderNames[0]) ==
+		kNumKnownHeaders, "KnownHeader and its names are out of sync");
+
+// Number of slots in the hash table.
+static constexpr unsigned kNumSlots = 64;
+
+static constexpr unsigned
+fold(char c)
+{
+	return static_cast<unsigned char>(c >= 'A' && c <= 'Z' ?
+			c - 'A' + 'a' : c);
+}
+
+static constexpr size_t
+length(const char* str)
+{
+	return *str ? 1 + length(str + 1) : 0;
+}
+
+// Case insensitive hash over the length and three characters of a header
+// name. The weights have been chosen so the known headers don't collide.
+static constexpr unsigned
+hash(const char* name, size_t len)
+{
+	return (len + 7 * fold(name[0]) + fold(name[len - 1]) +
+			7 * fold(name[len / 2])) % kNumSlots;
+}
+
+static constexpr unsigned
+hash_known(int h)
+{
+	return hash(kKnownHeaderNames[h], length(kKnownHeaderNames[h]));
+}
+
+// Finds the first known header at or after h which hashes into slot.
+static constexpr int
+slot_owner(unsigned slot, int h = 0)
+{
+	return h == kNumKnownHeaders ? int(kUnknownHeader) :
+		hash_known(h) == slot ? h : slot_owner(slot, h + 1);
+}
+
+// Verifies that every known header owns the slot it hashes into.
+static constexpr bool
+is_perfect(int h = 0)
+{
+	return h == kNumKnownHeaders ||
+		(slot_owner(hash_known(h)) == h && is_perfect(h + 1));
+}
+
+static_assert(is_perfect(), "Known header names collide in the hash table, "
+		"please pick new weights");
+
+#define LENGTH(h) length(kKnownHeaderNames[h])
+#define LENGTHS4(h) LENGTH(h), LENGTH(h + 1), LENGTH(h + 2), LENGTH(h + 3)
+
+// Lengths of the known header names, so names containing a NUL byte can't
+// end the comparison early.
+static constexpr size_t kKnownHeaderLengths[] = {
+	LENGTHS4(0), LENGTHS4(4), LENGTHS4(8), LENGTHS4(12), LENGTHS4(16),
+	LENGTHS4(20), LENGTHS4(24),
+};
+
+#undef LENGTHS4
+#undef LENGTH
+
+static_assert(sizeof(kKnownHeaderLengths) / sizeof(kKnownHeaderLengths[0]) ==
+		kNumKnownHeaders, "KnownHeader and its lengths are out of sync");
+
+#define SLOT(n) KnownHeader(slot_owner(n))
+#define SLOTS4(n) SLOT(n), SLOT(n + 1), SLOT(n + 2), SLOT(n + 3)
+#define SLOTS16(n) SLOTS4(n), SLOTS4(n + 4), SLOTS4(n + 8), SLOTS4(n + 12)
+
+// Maps hash values to the only known header which could have it.
+static constexpr KnownHeader kSlots[kNumSlots] = {
+	SLOTS16(0), SLOTS16(16), SLOTS16(32), SLOTS16(48),
+};
+
+#undef SLOTS16
+#undef SLOTS4
+#undef SLOT
+
+KnownHeader
+LookupKnownHeader(StringPiece name)
+{
+	if (name.empty())
+		return kUnknownHeader;
+
+	KnownHeader h = kSlots[hash(name.data(), name.length())];
+	if (h == kUnknownHeader)
+		return kUnknownHeader;
+
+	if (name.length() != kKnownHeaderLengths[h] ||
+			strncasecmp(kKnownHeaderNames[h], name.data(),
+				name.length()) != 0)
+		return kUnknownHeader;
+
+	return h;
+}
+
+const char*
+KnownHeaderName(KnownHeader h)
+{
+	if (h >= kNumKnownHeaders)
+		return "";
+
+	return kKnownHeaderNames[h];
+}
+}  // namespace server
+}  // namespace http
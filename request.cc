@@ -27,11 +27,14 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <cstdlib>
 #include <list>
 #include <string>
 #include <utility>
 
 #include <iostream>
+#include <strings.h>
 
 #include <toolbox/crypto/base64.h>
 
@@ -47,8 +50,114 @@ using std::list;
 using std::pair;
 using std::string;
 
+// Returned by reference for missing headers.
+static const string kEmpty;
+
+// Names of the standard methods, indexed by RequestMethod.
+static const string kMethodNames[kMethodExtension] = {
+	"GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS",
+	"TRACE", "PATCH",
+};
+
+static const string kHTTP10 = "HTTP/1.0";
+static const string kHTTP11 = "HTTP/1.1";
+
+RequestMethod
+LookupMethod(StringPiece name)
+{
+	// Check the first letter and length before comparing any strings.
+	switch (name.empty() ? 0 : name[0])
+	{
+	case 'G':
+		if (name == "GET")
+			return kMethodGet;
+		break;
+	case 'H':
+		if (name == "HEAD")
+			return kMethodHead;
+		break;
+	case 'P':
+		if (name == "POST")
+			return kMethodPost;
+		if (name == "PUT")
+			return kMethodPut;
+		if (name == "PATCH")
+			return kMethodPatch;
+		break;
+	case 'D':
+		if (name == "DELETE")
+			return kMethodDelete;
+		break;
+	case 'C':
+		if (name == "CONNECT")
+			return kMethodConnect;
+		break;
+	case 'O':
+		if (name == "OPTIONS")
+			return kMethodOptions;
+		break;
+	case 'T':
+		if (name == "TRACE")
+			return kMethodTrace;
+		break;
+	}
+
+	return kMethodExtension;
+}
+
+bool
+ParseHTTPVersion(StringPiece version, int* major, int* minor)
+{
+	// HTTP-version = "HTTP/" DIGIT "." DIGIT
+	if (version.length() != 8 || version.substr(0, 5) != "HTTP/" ||
+			version[6] != '.' ||
+			version[5] < '0' || version[5] > '9' ||
+			version[7] < '0' || version[7] > '9')
+		return false;
+
+	*major = version[5] - '0';
+	*minor = version[7] - '0';
+	return true;
+}
+
+// Form bodies larger than this are not parsed.
+static const unsigned long kMaxFormBodySize = 10 << 20;
+
+static const char kFormContentType[] = "application/x-www-form-urlencoded";
+
+// Splits the URL encoded form data into name and value pieces, which are
+// appended to views.
+static void
+SplitForm(const StringPiece& data,
+		std::vector<pair<StringPiece, StringPiece> >* views)
+{
+	size_t prev = 0;
+
+	while (prev < data.length())
+	{
+		size_t end = data.find('&', prev);
+		if (end == StringPiece::npos)
+			end = data.length();
+
+		StringPiece field = data.substr(prev, end - prev);
+		prev = end + 1;
+		if (field.empty())
+			continue;
+
+		size_t eq = field.find('=');
+		if (eq == StringPiece::npos)
+			views->push_back(std::make_pair(field, StringPiece()));
+		else
+			views->push_back(std::make_pair(field.substr(0, eq),
+						field.substr(eq + 1)));
+	}
+}
+
 Request::Request()
-: request_body_reader_(0)
+: cookies_parsed_(false), cookies_materialized_(false),
+	form_parsed_(false), form_body_read_(false), request_body_reader_(0),
+	arena_(0), num_params_(0), method_(kMethodExtension),
+	proto_major_(0), proto_minor_(0)
 {
 }
 
@@ -57,6 +166,7 @@ Request::~Request()
 	for (map<string, Cookie*>::iterator cookie = cookies_.begin();
 			cookie != cookies_.end(); cookie++)
 		delete cookie->second;
+	ClearHeaderCookies();
 
 	if (request_body_reader_)
 		request_body_reader_->DeferredShutdown();
@@ -76,12 +186,135 @@ Request::AddCookie(Cookie* c)
 	cookies_.insert(std::make_pair(c->domain + ":" + c->name, c));
 }
 
+void
+Request::ParseCookies() const
+{
+	if (cookies_parsed_)
+		return;
+
+	cookies_parsed_ = true;
+	cookie_views_.clear();
+	cookie_header_.clear();
+
+	if (headers_.IsNull())
+		return;
+
+	const Header* h = headers_->Get(kCookie);
+	if (!h)
+		return;
+
+	// Keep a private copy of the header, so the views stay valid even if
+	// the headers are modified.
+	for (size_t i = 0; i < h->NumValues(); i++)
+	{
+		if (i > 0)
+			cookie_header_ += "; ";
+		cookie_header_ += h->GetValue(i);
+	}
+
+	StringPiece value(cookie_header_);
+	size_t prev = 0, pos, eq;
+
+	while (prev < value.length())
+	{
+		while (prev < value.length() && value[prev] == ' ')
+			prev++;
+
+		// Find both the end of the name and the end of the cookie in
+		// one go.
+		eq = prev + Scanner::FindFirstOf(value.data() + prev,
+				value.length() - prev, ";=", 2);
+		pos = eq;
+		if (eq < value.length() && value[eq] == '=')
+			pos = eq + 1 + Scanner::FindFirstOf(
+					value.data() + eq + 1,
+					value.length() - eq - 1, ";", 1);
+
+		if (pos > eq)
+			cookie_views_.push_back(std::make_pair(
+					value.substr(prev, eq - prev),
+					value.substr(eq + 1, pos - eq - 1)));
+
+		prev = pos + 1;
+	}
+}
+
+void
+Request::MaterializeCookies() const
+{
+	ParseCookies();
+
+	if (cookies_materialized_)
+		return;
+
+	cookies_materialized_ = true;
+
+	// Later cookies of the same name win.
+	for (size_t i = cookie_views_.size(); i > 0; i--)
+	{
+		const pair<StringPiece, StringPiece>& view =
+			cookie_views_[i - 1];
+		string key = ":" + view.first.ToString();
+
+		if (header_cookies_.find(key) != header_cookies_.end())
+			continue;
+
+		Cookie* ck = new (arena_) Cookie;
+		ck->name = view.first.ToString();
+		// TODO(tonnerre): decode?
+		ck->value = view.second.ToString();
+		header_cookies_.insert(std::make_pair(key, ck));
+	}
+}
+
+void
+Request::ClearHeaderCookies() const
+{
+	for (map<string, Cookie*>::iterator cookie = header_cookies_.begin();
+			cookie != header_cookies_.end(); cookie++)
+		delete cookie->second;
+	header_cookies_.clear();
+	cookies_materialized_ = false;
+}
+
+StringPiece
+Request::GetCookie(const StringPiece& name) const
+{
+	StringPiece ret;
+
+	ParseCookies();
+
+	for (size_t i = cookie_views_.size(); i > 0; i--)
+		if (cookie_views_[i - 1].first == name)
+		{
+			ret = cookie_views_[i - 1].second;
+			break;
+		}
+
+	// Cookies set explicitly win over those sent by the client.
+	if (!cookies_.empty())
+	{
+		map<string, Cookie*>::const_iterator it =
+			cookies_.find(":" + name.ToString());
+		if (it != cookies_.end())
+			return it->second->value;
+	}
+
+	return ret;
+}
+
 list<Cookie*>
 Request::GetCookies() const
 {
+	MaterializeCookies();
+
+	// Cookies set explicitly win over those sent by the client.
+	map<string, Cookie*> all(cookies_);
+	all.insert(header_cookies_.begin(), header_cookies_.end());
+
 	list<Cookie*> ret;
-	for (std::map<string, Cookie*>::const_iterator it = cookies_.begin();
-			it != cookies_.end(); it++)
+	for (std::map<string, Cookie*>::const_iterator it = all.begin();
+			it != all.end(); it++)
 	{
 		ret.push_back(it->second);
 	}
@@ -92,6 +325,15 @@ void
 Request::SetHeaders(Headers* headers)
 {
 	headers_.Reset(headers);
+	cookies_parsed_ = false;
+	// The cookies from the old headers are gone along with them.
+	ClearHeaderCookies();
+}
+
+void
+Request::SetArena(Arena* arena)
+{
+	arena_ = arena;
 }
 
 Headers*
@@ -100,91 +342,217 @@ Request::GetHeaders() const
 	return headers_.Get();
 }
 
+void
+Request::ParseForm() const
+{
+	if (form_parsed_)
+		return;
+
+	form_parsed_ = true;
+	form_views_.clear();
+
+	// The body can only be read once, so it is kept around in case the
+	// path changes and the form has to be split again.
+	if (!form_body_read_ && request_body_reader_ && !headers_.IsNull())
+	{
+		const string& type = headers_->GetFirst(kContentType);
+		size_t len = sizeof(kFormContentType) - 1;
+		unsigned long length = strtoul(
+				headers_->GetFirst(kContentLength).c_str(),
+				NULL, 10);
+
+		form_body_read_ = true;
+
+		// Ignore parameters of the media type, such as the charset.
+		if (strncasecmp(type.c_str(), kFormContentType, len) == 0 &&
+				(type.length() == len || type[len] == ';' ||
+				 type[len] == ' ') &&
+				length > 0 && length <= kMaxFormBodySize)
+		{
+			BodyReader reader(this, kMaxFormBodySize);
+
+			form_body_.reserve(length);
+			if (reader.ReadAll(&form_body_) != BodyReader::kEnd)
+				form_body_.clear();
+		}
+	}
+
+	SplitForm(form_body_, &form_views_);
+
+	size_t query = path_.find('?');
+	if (query != string::npos)
+		SplitForm(StringPiece(path_).substr(query + 1), &form_views_);
+}
+
 string
 Request::FirstFormValue(const string& key) const
 {
-	/* TODO(tonnerre): Stub! */ return "";
+	ParseForm();
+
+	for (const pair<StringPiece, StringPiece>& field : form_views_)
+	{
+		const StringPiece& name = field.first;
+
+		// Only decode names which actually contain escapes.
+		if (Scanner::FindFirstOf(name.data(), name.length(), "%+", 2)
+				== name.length())
+		{
+			if (name != key)
+				continue;
+		}
+		else if (URLDecode(name) != key)
+			continue;
+
+		return URLDecode(field.second);
+	}
+
+	return "";
 }
 
 bool
 Request::ProtoAtLeast(int major, int minor) const
 {
-	/* TODO(tonnerre): Stub! */ return false;
+	return proto_major_ > major ||
+		(proto_major_ == major && proto_minor_ >= minor);
 }
 
-string
+const string&
 Request::Referer() const
 {
 	if (headers_.IsNull())
-		return "";
-
-	const Header* ref = headers_->Get("Referer");
-	if (ref)
-		return ref->GetFirstValue();
+		return kEmpty;
 
-	return "";
+	return headers_->GetFirst(kReferer);
 }
 
-string
+const string&
 Request::UserAgent() const
 {
 	if (headers_.IsNull())
-		return "";
+		return kEmpty;
 
-	const Header* ref = headers_->Get("User-Agent");
-	if (ref)
-		return ref->GetFirstValue();
-
-	return "";
+	return headers_->GetFirst(kUserAgent);
 }
 
-string
+const string&
 Request::Host() const
 {
 	if (headers_.IsNull())
-		return "";
-
-	const Header* ref = headers_->Get("Host");
-	if (ref)
-		return ref->GetFirstValue();
+		return kEmpty;
 
-	return "";
+	return headers_->GetFirst(kHost);
 }
 
 void
 Request::SetPath(const string& path)
 {
 	path_ = path;
+	form_parsed_ = false;
+	num_params_ = 0;
 }
 
-string
+const string&
 Request::Path() const
 {
 	return path_;
 }
 
+void
+Request::SetRouteParams(const RouteParam* params, size_t count)
+{
+	num_params_ = count < kMaxRouteParams ? count : kMaxRouteParams;
+	std::copy(params, params + num_params_, params_);
+}
+
+StringPiece
+Request::Param(const StringPiece& name) const
+{
+	for (size_t i = 0; i < num_params_; i++)
+		if (params_[i].name == name)
+			return StringPiece(path_).substr(params_[i].offset,
+					params_[i].length);
+
+	return StringPiece();
+}
+
 void
 Request::SetProtocol(const string& protocol)
 {
-	protocol_ = protocol;
+	int major, minor;
+
+	if (ParseHTTPVersion(protocol, &major, &minor))
+		SetProtoVersion(major, minor);
+	else
+	{
+		protocol_ = protocol;
+		proto_major_ = proto_minor_ = 0;
+	}
 }
 
-string
+void
+Request::SetProtoVersion(int major, int minor)
+{
+	proto_major_ = major;
+	proto_minor_ = minor;
+
+	if (major == 1 && (minor == 0 || minor == 1))
+		protocol_.clear();
+	else
+		protocol_ = "HTTP/" + std::to_string(major) + "." +
+			std::to_string(minor);
+}
+
+const string&
 Request::Protocol() const
 {
+	if (protocol_.empty() && proto_major_ == 1)
+		return proto_minor_ == 0 ? kHTTP10 : kHTTP11;
+
 	return protocol_;
 }
 
+int
+Request::ProtoMajor() const
+{
+	return proto_major_;
+}
+
+int
+Request::ProtoMinor() const
+{
+	return proto_minor_;
+}
+
 void
 Request::SetAction(const string& action)
 {
-	action_ = action;
+	method_ = LookupMethod(action);
+	if (method_ == kMethodExtension)
+		action_ = action;
+	else
+		action_.clear();
 }
 
-string
+void
+Request::SetMethod(RequestMethod method)
+{
+	method_ = method;
+	action_.clear();
+}
+
+RequestMethod
+Request::Method() const
+{
+	return method_;
+}
+
+const string&
 Request::Action() const
 {
-	return action_;
+	if (method_ == kMethodExtension)
+		return action_;
+
+	return kMethodNames[method_];
 }
 
 void
@@ -199,7 +567,7 @@ Request::SetBasicAuth(const string& username, const string& password)
 	if (headers_.IsNull())
 		return;
 
-	headers_->Set("Authorization", "Basic " +
+	headers_->Set(kAuthorization, "Basic " +
 			Base64::Encode(username + ":" + password));
 }
 
@@ -209,7 +577,7 @@ Request::GetBasicAuth() const
 	if (headers_.IsNull())
 		return std::make_pair("", "");
 
-	const Header* h = headers_->Get("Authorization");
+	const Header* h = headers_->Get(kAuthorization);
 	if (!h)
 		return std::make_pair("", "");
 
@@ -46,6 +46,134 @@ TEST_F(RequestTest, AddCookie)
 	EXPECT_EQ(b, cookies.back());
 }
 
+TEST_F(RequestTest, GetCookie)
+{
+	Request r;
+	Headers* hdr = new Headers;
+
+	EXPECT_EQ("", r.GetCookie("SID").ToString());
+
+	hdr->Add(kCookie, "SID=31d4d96e407aad42; lang=en-US;  empty=; a=1");
+	hdr->Add(kCookie, "a=2;novalue");
+	r.SetHeaders(hdr);
+
+	EXPECT_EQ("31d4d96e407aad42", r.GetCookie("SID").ToString());
+	EXPECT_EQ("en-US", r.GetCookie("lang").ToString());
+	EXPECT_EQ("", r.GetCookie("empty").ToString());
+	EXPECT_EQ("2", r.GetCookie("a").ToString());
+	EXPECT_EQ("", r.GetCookie("novalue").ToString());
+	EXPECT_EQ("", r.GetCookie("sid").ToString());
+
+	// Explicitly added cookies take precedence.
+	Cookie* c = new Cookie;
+	c->name = "lang";
+	c->value = "de-CH";
+	r.AddCookie(c);
+	EXPECT_EQ("de-CH", r.GetCookie("lang").ToString());
+
+	list<Cookie*> cookies = r.GetCookies();
+	ASSERT_EQ(4, cookies.size());
+	for (Cookie* ck : cookies)
+	{
+		if (ck->name == "lang")
+			EXPECT_EQ(c, ck);
+		else
+			EXPECT_EQ(r.GetCookie(ck->name), ck->value);
+	}
+
+	// Cookies from replaced headers are forgotten, explicit ones stay.
+	hdr = new Headers;
+	hdr->Add(kCookie, "SID=0123456789abcdef");
+	r.SetHeaders(hdr);
+	EXPECT_EQ("0123456789abcdef", r.GetCookie("SID").ToString());
+	EXPECT_EQ("", r.GetCookie("a").ToString());
+	EXPECT_EQ("de-CH", r.GetCookie("lang").ToString());
+
+	cookies = r.GetCookies();
+	ASSERT_EQ(2, cookies.size());
+	for (Cookie* ck : cookies)
+	{
+		if (ck->name == "lang")
+			EXPECT_EQ(c, ck);
+		else
+			EXPECT_EQ("0123456789abcdef", ck->value);
+	}
+}
+
+TEST_F(RequestTest, FirstFormValue)
+{
+	Request r;
+
+	EXPECT_EQ("", r.FirstFormValue("q"));
+
+	r.SetPath("/search?q=hello+world&lang=de%2DCH&q=again&flag&"
+			"a%20b=c&&empty=");
+	EXPECT_EQ("hello world", r.FirstFormValue("q"));
+	EXPECT_EQ("de-CH", r.FirstFormValue("lang"));
+	EXPECT_EQ("", r.FirstFormValue("flag"));
+	EXPECT_EQ("c", r.FirstFormValue("a b"));
+	EXPECT_EQ("", r.FirstFormValue("empty"));
+	EXPECT_EQ("", r.FirstFormValue("missing"));
+
+	r.SetPath("/search?q=changed");
+	EXPECT_EQ("changed", r.FirstFormValue("q"));
+	EXPECT_EQ("", r.FirstFormValue("lang"));
+}
+
+TEST_F(RequestTest, Method)
+{
+	Request r;
+
+	EXPECT_EQ(kMethodExtension, r.Method());
+	EXPECT_EQ("", r.Action());
+
+	r.SetAction("GET");
+	EXPECT_EQ(kMethodGet, r.Method());
+	EXPECT_EQ("GET", r.Action());
+
+	r.SetMethod(kMethodPatch);
+	EXPECT_EQ("PATCH", r.Action());
+
+	r.SetAction("PROPFIND");
+	EXPECT_EQ(kMethodExtension, r.Method());
+	EXPECT_EQ("PROPFIND", r.Action());
+
+	r.SetAction("get");
+	EXPECT_EQ(kMethodExtension, r.Method());
+	EXPECT_EQ(kMethodOptions, LookupMethod("OPTIONS"));
+	EXPECT_EQ(kMethodExtension, LookupMethod(""));
+}
+
+TEST_F(RequestTest, ProtoAtLeast)
+{
+	Request r;
+
+	EXPECT_FALSE(r.ProtoAtLeast(1, 0));
+	EXPECT_EQ("", r.Protocol());
+
+	r.SetProtocol("HTTP/1.1");
+	EXPECT_EQ("HTTP/1.1", r.Protocol());
+	EXPECT_EQ(1, r.ProtoMajor());
+	EXPECT_EQ(1, r.ProtoMinor());
+	EXPECT_TRUE(r.ProtoAtLeast(1, 0));
+	EXPECT_TRUE(r.ProtoAtLeast(1, 1));
+	EXPECT_FALSE(r.ProtoAtLeast(1, 2));
+	EXPECT_FALSE(r.ProtoAtLeast(2, 0));
+
+	r.SetProtoVersion(1, 0);
+	EXPECT_EQ("HTTP/1.0", r.Protocol());
+	EXPECT_FALSE(r.ProtoAtLeast(1, 1));
+
+	r.SetProtoVersion(2, 0);
+	EXPECT_EQ("HTTP/2.0", r.Protocol());
+	EXPECT_TRUE(r.ProtoAtLeast(1, 1));
+
+	r.SetProtocol("SPDY/3");
+	EXPECT_EQ("SPDY/3", r.Protocol());
+	EXPECT_EQ(0, r.ProtoMajor());
+	EXPECT_FALSE(r.ProtoAtLeast(1, 0));
+}
+
 TEST_F(RequestTest, Headers)
 {
 	Request r;
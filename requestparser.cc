@@ -0,0 +1,271 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "server.h"
+#include "server_internal.h"
+
+namespace http
+{
+namespace server
+{
+using std::string;
+
+static inline bool
+is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+RequestParser::RequestParser()
+{
+	Reset();
+}
+
+RequestParser::~RequestParser()
+{
+}
+
+void
+RequestParser::Reset()
+{
+	data_ = 0;
+	pos_ = 0;
+	line_start_ = 0;
+	state_ = kIncomplete;
+	have_request_line_ = false;
+	method_.offset = method_.length = 0;
+	target_.offset = target_.length = 0;
+	version_.offset = version_.length = 0;
+	headers_.clear();
+}
+
+RequestParser::State
+RequestParser::Parse(const char* data, size_t len)
+{
+	data_ = data;
+
+	while (state_ == kIncomplete && pos_ < len)
+	{
+		size_t end = pos_ + Scanner::FindLineEnd(data + pos_,
+				len - pos_);
+		if (end == len)
+		{
+			// Remember how far we got so the bytes scanned so far
+			// aren't looked at again once more data arrives.
+			pos_ = len;
+			break;
+		}
+		else if (data[end] != '\n')
+		{
+			// Control characters aren't allowed in the head.
+			state_ = kInvalid;
+			break;
+		}
+
+		pos_ = end + 1;
+		if (end > line_start_ && data[end - 1] == '\r')
+			end--;
+
+		if (end == line_start_)
+		{
+			// Empty lines before the request line are ignored as
+			// suggested by RFC 7230, section 3.5. Afterwards, an
+			// empty line terminates the request head.
+			if (have_request_line_)
+				state_ = kComplete;
+		}
+		else if (!have_request_line_)
+		{
+			if (!ParseRequestLine(line_start_, end))
+				state_ = kInvalid;
+			have_request_line_ = true;
+		}
+		else if (!ParseHeaderLine(line_start_, end))
+			state_ = kInvalid;
+
+		line_start_ = pos_;
+	}
+
+	return state_;
+}
+
+bool
+RequestParser::ParseRequestLine(size_t start, size_t end)
+{
+	const char* line = data_ + start;
+	size_t len = end - start;
+	const char* sp = static_cast<const char*>(memchr(line, ' ', len));
+	size_t rsp = len;
+
+	while (rsp > 0 && line[rsp - 1] != ' ')
+		rsp--;
+
+	// The method is everything up to the first space, the version
+	// everything after the last one.
+	if (!sp || sp == line || rsp == len ||
+			size_t(sp - line) + 1 >= rsp)
+		return false;
+
+	method_.offset = start;
+	method_.length = sp - line;
+	target_.offset = start + method_.length + 1;
+	target_.length = rsp - method_.length - 2;
+	version_.offset = start + rsp;
+	version_.length = len - rsp;
+
+	return true;
+}
+
+bool
+RequestParser::ParseHeaderLine(size_t start, size_t end)
+{
+	const char* line = data_ + start;
+	size_t len = end - start;
+	const char* colon = static_cast<const char*>(memchr(line, ':', len));
+	Span name, value;
+
+	// Obsolete line folding and whitespace before the colon are both
+	// rejected, see RFC 7230, sections 3.2.4.
+	if (!colon || colon == line || is_space(line[0]) ||
+			is_space(colon[-1]))
+		return false;
+
+	name.offset = start;
+	name.length = colon - line;
+
+	value.offset = name.length + 1;
+	while (value.offset < len && is_space(line[value.offset]))
+		value.offset++;
+	value.length = len - value.offset;
+	while (value.length > 0 &&
+			is_space(line[value.offset + value.length - 1]))
+		value.length--;
+	value.offset += start;
+
+	headers_.push_back(std::make_pair(name, value));
+	return true;
+}
+
+RequestParser::State
+RequestParser::GetState() const
+{
+	return state_;
+}
+
+size_t
+RequestParser::Consumed() const
+{
+	return pos_;
+}
+
+StringPiece
+RequestParser::Piece(const Span& span) const
+{
+	return StringPiece(data_ + span.offset, span.length);
+}
+
+StringPiece
+RequestParser::Method() const
+{
+	return Piece(method_);
+}
+
+StringPiece
+RequestParser::Target() const
+{
+	return Piece(target_);
+}
+
+StringPiece
+RequestParser::Version() const
+{
+	return Piece(version_);
+}
+
+size_t
+RequestParser::NumHeaders() const
+{
+	return headers_.size();
+}
+
+StringPiece
+RequestParser::HeaderName(size_t i) const
+{
+	return Piece(headers_[i].first);
+}
+
+StringPiece
+RequestParser::HeaderValue(size_t i) const
+{
+	return Piece(headers_[i].second);
+}
+
+void
+RequestParser::Fill(Request* req, Arena* arena) const
+{
+	Headers* hdr = new (arena) Headers;
+	req->SetArena(arena);
+
+	RequestMethod method = LookupMethod(Method());
+	int major, minor;
+
+	// Only keep the strings if they're not standard.
+	if (method == kMethodExtension)
+		req->SetAction(Method().ToString());
+	else
+		req->SetMethod(method);
+
+	req->SetPath(Target().ToString());
+
+	if (ParseHTTPVersion(Version(), &major, &minor))
+		req->SetProtoVersion(major, minor);
+	else
+		req->SetProtocol(Version().ToString());
+
+	for (size_t i = 0; i < headers_.size(); i++)
+	{
+		StringPiece key = HeaderName(i);
+		StringPiece value = HeaderValue(i);
+		// Match the name against the well known ones only once.
+		KnownHeader known = LookupKnownHeader(key);
+
+		if (known != kUnknownHeader)
+			hdr->Add(known, value.ToString());
+		else
+			hdr->Add(key.ToString(), value.ToString());
+	}
+
+	req->SetHeaders(hdr);
+}
+}  // namespace server
+}  // namespace http
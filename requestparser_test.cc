@@ -0,0 +1,311 @@
+/*
+ * Unit Test for the Incremental Request Parser.
+ */
+
+#include "server.h"
+#include "server_internal.h"
+#include <gtest/gtest.h>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+// Requests as sent by real clients.
+static const char* kCorpus[] = {
+	// Chromium
+	"GET /search?q=libhttp-server&ie=UTF-8 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+	"(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+	"image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Referer: https://www.example.com/\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+	"Cookie: SID=31d4d96e407aad42; lang=en-US; _ga=GA1.2.3.4\r\n"
+	"\r\n",
+	// Firefox
+	"GET /static/app.css HTTP/1.1\r\n"
+	"Host: lolcathost.example.com:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+	"Gecko/20100101 Firefox/118.0\r\n"
+	"Accept: text/css,*/*;q=0.1\r\n"
+	"Accept-Language: de,en-US;q=0.7,en;q=0.3\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Connection: keep-alive\r\n"
+	"If-Modified-Since: Mon, 11 Feb 2013 00:28:57 GMT\r\n"
+	"If-None-Match: \"5c3f-4d56e1a2\"\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"\r\n",
+	// curl
+	"HEAD /debug/vars/ HTTP/1.1\r\n"
+	"Host: [::1]:8889\r\n"
+	"User-Agent: curl/7.88.1\r\n"
+	"Accept: */*\r\n"
+	"\r\n",
+	// Form submission with a body.
+	"POST /login HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Content-Type: application/x-www-form-urlencoded\r\n"
+	"Content-Length: 27\r\n"
+	"Origin: https://www.example.com\r\n"
+	"Cookie: csrf=abc123\r\n"
+	"\r\n"
+	"user=tonnerre&password=foo",
+	// Old-school client using bare newlines.
+	"GET / HTTP/1.0\n"
+	"Host: www.example.com\n"
+	"User-Agent: Lynx/2.8.4rel.1 libwww-FM/2.14 SSL-MM/1.4.1\n"
+	"Accept: text/html\n"
+	"Accept: text/plain\n"
+	"\n",
+	// WebSocket handshake.
+	"GET /chat HTTP/1.1\r\n"
+	"Host: server.example.com\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"\r\n",
+};
+
+// The decoding previously done in HTTProtocol::DecodeConnection, kept for
+// comparison. The only deviations are the fixed off-by-one errors in the
+// method (which used to lose its last character) and the protocol (which
+// used to keep the preceding space).
+static size_t
+LegacyDecode(const string& alldata, Request* req)
+{
+	list<string> lines;
+	size_t pos = 0, lpos = 0;
+	Headers* hdr = new Headers;
+
+	while (lpos < alldata.length() &&
+			(pos = alldata.find("\n", lpos)) != string::npos)
+	{
+		size_t endpos = alldata[pos-1] == '\r' ? pos-1 : pos;
+
+		if (endpos != lpos)
+			lines.push_back(alldata.substr(lpos, endpos - lpos));
+		else
+		{
+			lpos = pos + 1;
+			break;
+		}
+
+		lpos = pos + 1;
+	}
+
+	string command_str = lines.front();
+	lines.pop_front();
+
+	pos = command_str.find(' ');
+	size_t rpos = command_str.rfind(' ');
+	req->SetProtocol(command_str.substr(rpos + 1));
+	req->SetAction(command_str.substr(0, pos));
+	req->SetPath(command_str.substr(pos + 1, rpos - pos - 1));
+
+	for (string line : lines)
+	{
+		size_t offset = line.find(':');
+		string key = line.substr(0, offset);
+
+		while (line[++offset] == ' ' && offset < line.length());
+
+		string value = line.substr(offset, line.length() - offset);
+
+		if (key == "Cookie")
+		{
+			size_t prev = 0, pos = -2;
+
+			do
+			{
+				prev = pos + 2;
+				pos = value.find("; ", prev);
+
+				if (pos == string::npos)
+					pos = value.length();
+
+				string cookie = value.substr(prev, pos - prev);
+				size_t eq = cookie.find('=');
+				if (eq != string::npos)
+				{
+					Cookie* ck = new Cookie;
+					ck->name = cookie.substr(0, eq);
+					ck->value = cookie.substr(eq + 1);
+
+					req->AddCookie(ck);
+				}
+			}
+			while (pos < value.length());
+		}
+
+		// The request keeps the raw Cookie header around for
+		// Request::GetCookie().
+		hdr->Add(key, value);
+	}
+
+	req->SetHeaders(hdr);
+	return lpos;
+}
+
+static void
+ExpectSameRequest(const Request& expected, const Request& actual)
+{
+	EXPECT_EQ(expected.Action(), actual.Action());
+	EXPECT_EQ(expected.Path(), actual.Path());
+	EXPECT_EQ(expected.Protocol(), actual.Protocol());
+
+	Headers* eh = expected.GetHeaders();
+	Headers* ah = actual.GetHeaders();
+	ASSERT_NE((Headers*) 0, ah);
+	EXPECT_EQ(eh->HeaderNames(), ah->HeaderNames());
+	for (const string& name : eh->HeaderNames())
+	{
+		ASSERT_NE((Header*) 0, ah->Get(name)) << name;
+		EXPECT_EQ(eh->Get(name)->GetValues(),
+				ah->Get(name)->GetValues()) << name;
+	}
+
+	list<Cookie*> ec = expected.GetCookies();
+	list<Cookie*> ac = actual.GetCookies();
+	ASSERT_EQ(ec.size(), ac.size());
+	for (list<Cookie*>::iterator e = ec.begin(), a = ac.begin();
+			e != ec.end(); e++, a++)
+	{
+		EXPECT_EQ((*e)->name, (*a)->name);
+		EXPECT_EQ((*e)->value, (*a)->value);
+	}
+}
+
+class RequestParserTest : public ::testing::Test
+{
+};
+
+TEST_F(RequestParserTest, MatchesLegacyDecoder)
+{
+	for (const char* raw : kCorpus)
+	{
+		string data(raw);
+		Request expected, actual;
+		RequestParser parser;
+
+		size_t consumed = LegacyDecode(data, &expected);
+		ASSERT_EQ(RequestParser::kComplete,
+				parser.Parse(data.data(), data.length()));
+		EXPECT_EQ(consumed, parser.Consumed());
+		parser.Fill(&actual);
+
+		ExpectSameRequest(expected, actual);
+	}
+}
+
+TEST_F(RequestParserTest, ByteByByte)
+{
+	for (const char* raw : kCorpus)
+	{
+		string data(raw);
+		Request expected, actual;
+		RequestParser parser;
+		RequestParser::State state = RequestParser::kIncomplete;
+		string partial;
+		size_t len;
+
+		LegacyDecode(data, &expected);
+
+		// Feed a growing buffer like the acknowledgement decorator
+		// does until the head is complete.
+		for (len = 1; len <= data.length(); len++)
+		{
+			partial = data.substr(0, len);
+			state = parser.Parse(partial.data(), partial.length());
+			if (state != RequestParser::kIncomplete)
+				break;
+		}
+
+		ASSERT_EQ(RequestParser::kComplete, state);
+		EXPECT_EQ(len, parser.Consumed());
+		parser.Fill(&actual);
+
+		ExpectSameRequest(expected, actual);
+	}
+}
+
+TEST_F(RequestParserTest, Incomplete)
+{
+	string data = "GET / HTTP/1.1\r\nHost: www.example.com\r\n";
+	RequestParser parser;
+
+	EXPECT_EQ(RequestParser::kIncomplete,
+			parser.Parse(data.data(), data.length()));
+	EXPECT_EQ(RequestParser::kIncomplete, parser.GetState());
+
+	data += "\r\n";
+	EXPECT_EQ(RequestParser::kComplete,
+			parser.Parse(data.data(), data.length()));
+	EXPECT_EQ(data.length(), parser.Consumed());
+	EXPECT_EQ("GET", parser.Method().ToString());
+	EXPECT_EQ("/", parser.Target().ToString());
+	EXPECT_EQ("HTTP/1.1", parser.Version().ToString());
+	ASSERT_EQ(1, parser.NumHeaders());
+	EXPECT_EQ("Host", parser.HeaderName(0).ToString());
+	EXPECT_EQ("www.example.com", parser.HeaderValue(0).ToString());
+}
+
+TEST_F(RequestParserTest, LeadingEmptyLines)
+{
+	string data = "\r\n\r\nGET /foo HTTP/1.1\r\n\r\n";
+	RequestParser parser;
+
+	EXPECT_EQ(RequestParser::kComplete,
+			parser.Parse(data.data(), data.length()));
+	EXPECT_EQ("/foo", parser.Target().ToString());
+	EXPECT_EQ(0, parser.NumHeaders());
+	EXPECT_EQ(data.length(), parser.Consumed());
+}
+
+TEST_F(RequestParserTest, Invalid)
+{
+	const char* invalid[] = {
+		"GET\r\n\r\n",
+		"GET /\r\n\r\n",
+		" / HTTP/1.1\r\n\r\n",
+		"GET / \r\n\r\n",
+		"GET / HTTP/1.1\r\nHost\r\n\r\n",
+		"GET / HTTP/1.1\r\nHost : foo\r\n\r\n",
+		"GET / HTTP/1.1\r\nX-Foo: bar\r\n baz\r\n\r\n",
+		"GET / HTTP/1.1\r\n: foo\r\n\r\n",
+	};
+
+	for (const char* raw : invalid)
+	{
+		RequestParser parser;
+		EXPECT_EQ(RequestParser::kInvalid,
+				parser.Parse(raw, strlen(raw))) << raw;
+	}
+}
+
+TEST_F(RequestParserTest, Reset)
+{
+	string first = "GET /a HTTP/1.1\r\nX-A: a\r\n\r\n";
+	string second = "GET /b HTTP/1.0\r\n\r\n";
+	RequestParser parser;
+
+	EXPECT_EQ(RequestParser::kComplete,
+			parser.Parse(first.data(), first.length()));
+	parser.Reset();
+	EXPECT_EQ(RequestParser::kComplete,
+			parser.Parse(second.data(), second.length()));
+	EXPECT_EQ("/b", parser.Target().ToString());
+	EXPECT_EQ("HTTP/1.0", parser.Version().ToString());
+	EXPECT_EQ(0, parser.NumHeaders());
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
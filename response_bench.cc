@@ -0,0 +1,157 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Benchmark for the response writer, counting the number of sends (and
+// thus syscalls) it takes to deliver typical small responses.
+
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+#include <siot/connection.h>
+
+#include "server.h"
+#include "server_internal.h"
+
+using http::server::Headers;
+using http::server::HTTPResponseWriter;
+using std::string;
+using toolbox::siot::Connection;
+
+// Connection which just counts what is sent through it.
+class CountingConnection : public Connection
+{
+public:
+	CountingConnection()
+	: sends(0), bytes(0)
+	{
+	}
+
+	virtual int Send(string data)
+	{
+		sends++;
+		bytes += data.length();
+		return data.length();
+	}
+
+	long sends;
+	long bytes;
+};
+
+static const char* kJSON =
+	"{\"id\":4711,\"name\":\"libhttp-server\",\"tags\":[\"http\",\"c++\"]}";
+
+// Headers of a typical small API response.
+static void
+AddResponseHeaders(Headers* h)
+{
+	h->Set(http::server::kContentType, "application/json; charset=utf-8");
+	h->Set(http::server::kCacheControl, "no-cache");
+	h->Set("Server", "libhttp-server");
+	h->Add("X-Content-Type-Options", "nosniff");
+	h->Add("X-Frame-Options", "DENY");
+	h->Add("Set-Cookie", "session=31d4d96e407aad42; Secure");
+	h->Add("Set-Cookie", "lang=en-US; Path=/");
+}
+
+// What HTTPResponseWriter used to do: one send for the status line, every
+// header value, the empty line, every chunk and the final chunk.
+static void
+LegacyResponse(Connection* conn, const Headers& to_add, int writes)
+{
+	// Copy the headers like the writer does, to keep the timing fair.
+	Headers headers;
+	headers.Merge(to_add);
+	headers.Set(http::server::kTransferEncoding, "chunked");
+
+	conn->Send("HTTP/1.1 200 OK\r\n");
+	for (const http::server::Header& hdr : headers)
+		for (size_t i = 0; i < hdr.NumValues(); i++)
+			conn->Send(hdr.GetName() + ": " + hdr.GetValue(i) +
+					"\r\n");
+	conn->Send("\r\n");
+
+	for (int i = 0; i < writes; i++)
+	{
+		string data = kJSON;
+		std::ostringstream oss;
+		oss << std::hex << data.length();
+		conn->Send(oss.str() + "\r\n" + data + "\r\n");
+	}
+
+	conn->Send("0\r\n\r\n");
+}
+
+static void
+CurrentResponse(Connection* conn, const Headers& headers, int writes)
+{
+	HTTPResponseWriter rw(conn);
+	rw.AddHeaders(headers);
+	for (int i = 0; i < writes; i++)
+		rw.Write(kJSON);
+}
+
+template<typename Func>
+static void
+Run(const char* name, int writes, Func func)
+{
+	const int iterations = 100000;
+	CountingConnection conn;
+	Headers headers;
+
+	AddResponseHeaders(&headers);
+
+	std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++)
+		func(&conn, headers, writes);
+	std::chrono::steady_clock::time_point end =
+		std::chrono::steady_clock::now();
+
+	printf("%-8s %8d %12.2f %12.1f %12.1f\n", name, writes,
+			double(conn.sends) / iterations,
+			double(conn.bytes) / iterations,
+			std::chrono::duration<double, std::nano>(end -
+				start).count() / iterations);
+}
+
+int main(void)
+{
+	printf("%-8s %8s %12s %12s %12s\n", "variant", "writes", "sends/req",
+			"bytes/req", "ns/req");
+
+	for (int writes : { 0, 1, 4 })
+	{
+		Run("legacy", writes, LegacyResponse);
+		Run("current", writes, CurrentResponse);
+	}
+
+	return 0;
+}
@@ -0,0 +1,567 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <strings.h>
+#include <thread++/mutex.h>
+#include <toolbox/expvar.h>
+#include <toolbox/scopedptr.h>
+
+#include "server.h"
+#include "server_internal.h"
+
+namespace http
+{
+namespace server
+{
+using std::string;
+using threadpp::Mutex;
+using threadpp::MutexLock;
+using toolbox::ExpVar;
+using toolbox::ScopedPtr;
+
+static ExpVar<int64_t> numResponseCacheHits(
+		"http-server-response-cache-hits");
+static ExpVar<int64_t> numResponseCacheMisses(
+		"http-server-response-cache-misses");
+
+typedef std::chrono::steady_clock Clock;
+
+// Bookkeeping overhead assumed for every cache entry.
+static const size_t kEntryOverhead = 128;
+
+ResponseCacheOptions::ResponseCacheOptions()
+: ttl(1000), max_memory(64 << 20), max_response_size(1 << 20),
+	num_shards(16)
+{
+	vary.push_back("Accept-Encoding");
+}
+
+// A complete response, serialized as it goes out on the wire.
+struct CachedResponse
+{
+	// Status line and headers, followed by the body.
+	string response;
+	size_t head_length;
+	// Validators of the response, and the head of a 304 response for
+	// requests whose copy is still valid. Only set for 200 responses.
+	string etag;
+	string last_modified;
+	string not_modified_head;
+	Clock::time_point expires;
+	// Whether Cache-Control explicitly allows sharing the response with
+	// requests carrying cookies.
+	bool shared;
+};
+
+// Whether the Cache-Control header value forbids sharing the response.
+static bool
+Uncacheable(const string& cache_control)
+{
+	for (const char* directive : { "no-store", "no-cache", "private" })
+		if (strcasestr(cache_control.c_str(), directive))
+			return true;
+
+	return false;
+}
+
+// Whether the Cache-Control header value marks the response as public.
+static bool
+Public(const string& cache_control)
+{
+	return strcasestr(cache_control.c_str(), "public") != 0;
+}
+
+// Whether all header names listed in the Vary header value names are
+// among those in vary.
+static bool
+VaryCovered(const string& names, const std::vector<string>& vary)
+{
+	size_t pos = 0;
+
+	while (pos < names.length())
+	{
+		size_t end = std::min(names.find(',', pos), names.length());
+		size_t last = end;
+
+		while (pos < end && names[pos] == ' ')
+			pos++;
+		while (last > pos && names[last - 1] == ' ')
+			last--;
+
+		bool found = pos == last;
+		for (const string& name : vary)
+			if (name.length() == last - pos &&
+					strncasecmp(name.c_str(),
+						names.c_str() + pos,
+						last - pos) == 0)
+				found = true;
+		if (!found)
+			return false;
+
+		pos = end + 1;
+	}
+
+	return true;
+}
+
+// Response writer passing everything on to another writer, keeping a copy
+// of the response as long as it may be cached.
+class CapturingResponseWriter : public ResponseWriter
+{
+public:
+	CapturingResponseWriter(ResponseWriter* w, size_t max_size);
+	virtual ~CapturingResponseWriter();
+
+	// Implements ResponseWriter.
+	using ResponseWriter::Write;
+	virtual void AddHeaders(const Headers& to_add);
+	virtual void WriteHeader(int status_code, string message = "OK");
+	virtual int Write(const char* data, size_t length);
+	virtual int Write(string&& data);
+	virtual int SendFile(int fd, off_t offset, size_t length);
+
+	// Serializes the captured response into entry, if it may be cached
+	// for requests varying only in the headers vary. Responses to
+	// requests with cookies are only kept if they are public.
+	bool Finish(const std::vector<string>& vary, bool cookies,
+			CachedResponse* entry);
+
+private:
+	// Records the start of the body.
+	void Start();
+
+	ResponseWriter* w_;
+	size_t max_size_;
+	Headers headers_;
+	string message_;
+	string body_;
+	int status_code_;
+	bool capturing_;
+};
+
+CapturingResponseWriter::CapturingResponseWriter(ResponseWriter* w,
+		size_t max_size)
+: w_(w), max_size_(max_size), status_code_(0), capturing_(true)
+{
+}
+
+CapturingResponseWriter::~CapturingResponseWriter()
+{
+}
+
+void
+CapturingResponseWriter::AddHeaders(const Headers& to_add)
+{
+	if (!status_code_)
+		headers_.Merge(to_add);
+	w_->AddHeaders(to_add);
+}
+
+void
+CapturingResponseWriter::WriteHeader(int status_code, string message)
+{
+	if (!status_code_)
+	{
+		status_code_ = status_code;
+		message_ = message;
+	}
+	w_->WriteHeader(status_code, message);
+}
+
+void
+CapturingResponseWriter::Start()
+{
+	if (!status_code_)
+	{
+		status_code_ = 200;
+		message_ = "OK";
+	}
+}
+
+int
+CapturingResponseWriter::Write(const char* data, size_t length)
+{
+	Start();
+	if (capturing_)
+	{
+		capturing_ = body_.length() + length <= max_size_;
+		if (capturing_)
+			body_.append(data, length);
+	}
+
+	return w_->Write(data, length);
+}
+
+int
+CapturingResponseWriter::Write(string&& data)
+{
+	Start();
+	if (capturing_)
+	{
+		capturing_ = body_.length() + data.length() <= max_size_;
+		if (capturing_)
+			body_.append(data);
+	}
+
+	return w_->Write(std::move(data));
+}
+
+int
+CapturingResponseWriter::SendFile(int fd, off_t offset, size_t length)
+{
+	Start();
+	if (capturing_ && body_.length() + length <= max_size_)
+		// Read the file through Write() to get a copy.
+		return ResponseWriter::SendFile(fd, offset, length);
+
+	capturing_ = false;
+	return w_->SendFile(fd, offset, length);
+}
+
+bool
+CapturingResponseWriter::Finish(const std::vector<string>& vary, bool cookies,
+		CachedResponse* entry)
+{
+	if (!capturing_)
+		return false;
+
+	Start();
+	if (status_code_ != 200 && status_code_ != 203 &&
+			status_code_ != 301 && status_code_ != 404 &&
+			status_code_ != 410)
+		return false;
+
+	const string& cache_control = headers_.GetFirst(kCacheControl);
+	if (headers_.Get("Set-Cookie") || Uncacheable(cache_control))
+		return false;
+
+	entry->shared = Public(cache_control);
+	if (cookies && !entry->shared)
+		return false;
+
+	// The response may only depend on the request headers in the key.
+	const Header* response_vary = headers_.Get("Vary");
+	for (size_t i = 0; response_vary && i < response_vary->NumValues();
+			i++)
+		if (!VaryCovered(response_vary->GetValue(i), vary))
+			return false;
+
+	headers_.Delete(kConnection);
+	headers_.Delete(kTransferEncoding);
+	headers_.Set(kContentLength, std::to_string(body_.length()));
+
+	string& out = entry->response;
+	out.reserve(256 + body_.length());
+	out.append("HTTP/1.1 ");
+	out.append(std::to_string(status_code_));
+	out.push_back(' ');
+	out.append(message_);
+	out.append("\r\n");
+	for (const Header& hdr : headers_)
+	{
+		for (size_t i = 0; i < hdr.NumValues(); i++)
+		{
+			out.append(hdr.GetName());
+			out.append(": ");
+			out.append(hdr.GetValue(i));
+			out.append("\r\n");
+		}
+	}
+	out.append("\r\n");
+	entry->head_length = out.length();
+	out.append(body_);
+
+	if (status_code_ != 200)
+		return true;
+
+	// A 304 response has the headers a cache would have to update.
+	entry->etag = headers_.GetFirst("ETag");
+	entry->last_modified = headers_.GetFirst("Last-Modified");
+	if (entry->etag.empty() && entry->last_modified.empty())
+		return true;
+
+	string& head = entry->not_modified_head;
+	head.append("HTTP/1.1 304 Not Modified\r\n");
+	for (const char* name : { "Cache-Control", "Content-Location",
+			"ETag", "Expires", "Last-Modified", "Vary" })
+	{
+		const Header* hdr = headers_.Get(name);
+		for (size_t i = 0; hdr && i < hdr->NumValues(); i++)
+		{
+			head.append(hdr->GetName());
+			head.append(": ");
+			head.append(hdr->GetValue(i));
+			head.append("\r\n");
+		}
+	}
+	head.append("\r\n");
+	return true;
+}
+
+// Whether the conditional request headers rh say that the client's copy of
+// entry is still valid.
+static bool
+NotModified(const Headers* rh, const CachedResponse& entry)
+{
+	if (entry.not_modified_head.empty())
+		return false;
+
+	// If-Modified-Since only counts without If-None-Match.
+	const Header* inm = rh->Get(kIfNoneMatch);
+	if (inm)
+	{
+		for (size_t i = 0; i < inm->NumValues(); i++)
+			if (MatchesETag(inm->GetValue(i), entry.etag))
+				return true;
+		return false;
+	}
+
+	const string& ims = rh->GetFirst(kIfModifiedSince);
+	time_t since, modified;
+	return !ims.empty() && !entry.last_modified.empty() &&
+		(ims == entry.last_modified ||
+		 (ParseHTTPDate(ims, &since) &&
+		  ParseHTTPDate(entry.last_modified, &modified) &&
+		  modified <= since));
+}
+
+// Serves the responses of another handler from memory for a short while.
+// Only responses to GET are stored, so the method is implied by the key;
+// HEAD requests are served from them as well. The cache is split into
+// shards with a lock and a share of the memory each. Since all entries
+// live equally long, every shard keeps them in a queue in the order they
+// were stored, which is also the order in which they expire.
+class CachingHandlerImpl : public Handler
+{
+public:
+	CachingHandlerImpl(Handler* handler,
+			const ResponseCacheOptions& options);
+	virtual ~CachingHandlerImpl();
+
+	// Serve the request from the cache, or through the other handler if
+	// that's not possible.
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req);
+
+private:
+	struct Shard
+	{
+		Shard();
+
+		ScopedPtr<Mutex> lock;
+		std::unordered_map<string,
+			std::shared_ptr<const CachedResponse> > entries;
+		std::deque<std::pair<string,
+			std::shared_ptr<const CachedResponse> > > queue;
+		size_t memory;
+	};
+
+	// Computes the cache key for req.
+	string Key(const Request* req) const;
+
+	Shard* GetShard(const string& key);
+
+	// Stores entry under key, making room for it if necessary.
+	void Store(const string& key,
+			const std::shared_ptr<const CachedResponse>& entry);
+
+	Handler* handler_;
+	ResponseCacheOptions options_;
+	size_t num_shards_;
+	size_t shard_memory_;
+	std::unique_ptr<Shard[]> shards_;
+};
+
+CachingHandlerImpl::Shard::Shard()
+: lock(Mutex::Create()), memory(0)
+{
+}
+
+CachingHandlerImpl::CachingHandlerImpl(Handler* handler,
+		const ResponseCacheOptions& options)
+: handler_(handler), options_(options),
+	num_shards_(std::max<size_t>(options.num_shards, 1)),
+	shard_memory_(options.max_memory / num_shards_),
+	shards_(new Shard[num_shards_])
+{
+}
+
+CachingHandlerImpl::~CachingHandlerImpl()
+{
+}
+
+string
+CachingHandlerImpl::Key(const Request* req) const
+{
+	const Headers* rh = req->GetHeaders();
+	// Hosts are told apart like for routing.
+	string key = NormalizeHost(req->Host());
+
+	key.push_back('\0');
+	key.append(req->Path());
+	for (const string& name : options_.vary)
+	{
+		key.push_back('\0');
+		if (rh)
+			key.append(rh->GetFirst(name));
+	}
+
+	return key;
+}
+
+CachingHandlerImpl::Shard*
+CachingHandlerImpl::GetShard(const string& key)
+{
+	return &shards_[std::hash<string>()(key) % num_shards_];
+}
+
+void
+CachingHandlerImpl::Store(const string& key,
+		const std::shared_ptr<const CachedResponse>& entry)
+{
+	size_t size = key.length() + entry->response.length() +
+		entry->not_modified_head.length() + kEntryOverhead;
+	Shard* shard = GetShard(key);
+	Clock::time_point now = Clock::now();
+
+	if (size > shard_memory_)
+		return;
+
+	MutexLock lk(shard->lock.Get());
+
+	// Drop expired entries first, then the oldest ones until there is
+	// enough room.
+	while (!shard->queue.empty() &&
+			(shard->queue.front().second->expires <= now ||
+			 shard->memory + size > shard_memory_))
+	{
+		const string& old_key = shard->queue.front().first;
+		const std::shared_ptr<const CachedResponse>& old =
+			shard->queue.front().second;
+		auto it = shard->entries.find(old_key);
+
+		if (it != shard->entries.end() && it->second == old)
+			shard->entries.erase(it);
+		shard->memory -= old_key.length() + old->response.length() +
+			old->not_modified_head.length() + kEntryOverhead;
+		shard->queue.pop_front();
+	}
+
+	shard->entries[key] = entry;
+	shard->queue.push_back(std::make_pair(key, entry));
+	shard->memory += size;
+}
+
+void
+CachingHandlerImpl::ServeHTTP(ResponseWriter* w, const Request* req)
+{
+	RequestMethod method = req->Method();
+	const Headers* rh = req->GetHeaders();
+
+	// Only requests whose response doesn't depend on who's asking are
+	// cached. Cookies aren't part of the key, so requests carrying them
+	// only share responses explicitly marked public.
+	if ((method != kMethodGet && method != kMethodHead) ||
+			(rh && rh->Get(kAuthorization)))
+	{
+		handler_->ServeHTTP(w, req);
+		return;
+	}
+	bool cookies = rh && rh->Get(kCookie);
+
+	string key = Key(req);
+	Shard* shard = GetShard(key);
+	std::shared_ptr<const CachedResponse> entry;
+
+	{
+		MutexLock lk(shard->lock.Get());
+		auto it = shard->entries.find(key);
+		if (it != shard->entries.end())
+			entry = it->second;
+	}
+
+	if (entry && entry->expires > Clock::now() &&
+			(!cookies || entry->shared))
+	{
+		numResponseCacheHits.Add(1);
+		if (rh && NotModified(rh, *entry))
+		{
+			w->WriteResponse(entry->not_modified_head, "");
+			return;
+		}
+
+		const string& response = entry->response;
+		w->WriteResponse(StringPiece(response.data(),
+					entry->head_length),
+				StringPiece(response.data() +
+					entry->head_length,
+					response.length() -
+					entry->head_length));
+		return;
+	}
+
+	numResponseCacheMisses.Add(1);
+
+	// The writer for HEAD requests drops the body, so it is served
+	// from the response to GET, but the handler may not produce a body
+	// for HEAD at all.
+	if (method == kMethodHead)
+	{
+		handler_->ServeHTTP(w, req);
+		return;
+	}
+
+	CapturingResponseWriter cw(w, options_.max_response_size);
+	handler_->ServeHTTP(&cw, req);
+
+	std::shared_ptr<CachedResponse> fresh(new CachedResponse);
+	if (cw.Finish(options_.vary, cookies, fresh.get()))
+	{
+		fresh->expires = Clock::now() + options_.ttl;
+		Store(key, fresh);
+	}
+}
+
+Handler*
+Handler::CachingHandler(Handler* handler, const ResponseCacheOptions& options)
+{
+	return new CachingHandlerImpl(handler, options);
+}
+}  // namespace server
+}  // namespace http
@@ -0,0 +1,271 @@
+/*
+ * Unit Test for the Response Cache.
+ */
+
+#include "server.h"
+#include "server_internal.h"
+#include "test_connection.h"
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+// Handler counting how often it's invoked, responding with the path.
+class CountingHandler : public Handler
+{
+public:
+	CountingHandler()
+	: calls(0)
+	{
+	}
+
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+		calls++;
+		w->AddHeaders(headers);
+		w->Write("calls=" + std::to_string(calls) + " path=" +
+				req->Path());
+	}
+
+	Headers headers;
+	int calls;
+};
+
+class ResponseCacheTest : public ::testing::Test
+{
+protected:
+	// Serves a request for path with the given method and headers
+	// through handler, returning what was sent.
+	string Serve(Handler* handler, const string& path,
+			RequestMethod method = kMethodGet,
+			Headers* headers = 0)
+	{
+		RecordingConnection conn;
+		Request req;
+
+		req.SetMethod(method);
+		req.SetPath(path);
+		req.SetProtoVersion(1, 1);
+		if (!headers)
+			headers = new Headers;
+		if (!headers->Get(kHost))
+			headers->Set(kHost, "example.com");
+		req.SetHeaders(headers);
+
+		{
+			HTTPResponseWriter rw(&conn);
+			if (method == kMethodHead)
+				rw.OmitBody();
+			handler->ServeHTTP(&rw, &req);
+		}
+
+		string ret;
+		for (const string& s : conn.sent)
+			ret += s;
+		return ret;
+	}
+
+	CountingHandler counter_;
+};
+
+TEST_F(ResponseCacheTest, Hit)
+{
+	ScopedPtr<Handler> cache(Handler::CachingHandler(&counter_));
+	counter_.headers.Set(kContentType, "text/plain");
+
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"\r\n"
+			"13\r\ncalls=1 path=/flags\r\n"
+			"0\r\n\r\n", Serve(cache.Get(), "/flags"));
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: 19\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"calls=1 path=/flags", Serve(cache.Get(), "/flags"));
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: 19\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n", Serve(cache.Get(), "/flags", kMethodHead));
+	EXPECT_EQ(1, counter_.calls);
+
+	Serve(cache.Get(), "/flags?v=2");
+	EXPECT_EQ(2, counter_.calls);
+
+	Headers* h = new Headers;
+	h->Set(kHost, "other.example.com");
+	Serve(cache.Get(), "/flags", kMethodGet, h);
+	EXPECT_EQ(3, counter_.calls);
+
+	// Hosts are normalized like for routing.
+	Headers* port = new Headers;
+	Headers* dot = new Headers;
+	port->Set(kHost, "Example.COM:80");
+	dot->Set(kHost, "example.com.");
+	Serve(cache.Get(), "/flags", kMethodGet, port);
+	Serve(cache.Get(), "/flags", kMethodGet, dot);
+	EXPECT_EQ(3, counter_.calls);
+}
+
+TEST_F(ResponseCacheTest, Vary)
+{
+	ScopedPtr<Handler> cache(Handler::CachingHandler(&counter_));
+	Headers* gzip = new Headers;
+	Headers* gzip_again = new Headers;
+	gzip->Set(kAcceptEncoding, "gzip");
+	gzip_again->Set(kAcceptEncoding, "gzip");
+
+	Serve(cache.Get(), "/");
+	Serve(cache.Get(), "/", kMethodGet, gzip);
+	Serve(cache.Get(), "/", kMethodGet, gzip_again);
+	EXPECT_EQ(2, counter_.calls);
+
+	// Responses varying on anything else can't be cached.
+	counter_.headers.Set("Vary", "Accept-Encoding, User-Agent");
+	Serve(cache.Get(), "/ua");
+	Serve(cache.Get(), "/ua");
+	EXPECT_EQ(4, counter_.calls);
+}
+
+TEST_F(ResponseCacheTest, Uncacheable)
+{
+	ScopedPtr<Handler> cache(Handler::CachingHandler(&counter_));
+
+	Serve(cache.Get(), "/", kMethodPost);
+	Serve(cache.Get(), "/", kMethodPost);
+	EXPECT_EQ(2, counter_.calls);
+
+	Headers* auth = new Headers;
+	auth->Set(kAuthorization, "Basic YTpi");
+	Serve(cache.Get(), "/auth", kMethodGet, auth);
+	Serve(cache.Get(), "/auth");
+	EXPECT_EQ(4, counter_.calls);
+
+	counter_.headers.Set("Set-Cookie", "session=1");
+	Serve(cache.Get(), "/cookie");
+	Serve(cache.Get(), "/cookie");
+	EXPECT_EQ(6, counter_.calls);
+
+	counter_.headers.Delete("Set-Cookie");
+	counter_.headers.Set(kCacheControl, "private, max-age=60");
+	Serve(cache.Get(), "/private");
+	Serve(cache.Get(), "/private");
+	EXPECT_EQ(8, counter_.calls);
+
+	// HEAD doesn't populate the cache.
+	counter_.headers.Delete(kCacheControl);
+	Serve(cache.Get(), "/head", kMethodHead);
+	Serve(cache.Get(), "/head", kMethodHead);
+	EXPECT_EQ(10, counter_.calls);
+}
+
+TEST_F(ResponseCacheTest, Cookies)
+{
+	ScopedPtr<Handler> cache(Handler::CachingHandler(&counter_));
+	std::vector<Headers*> alice, bob;
+	for (int i = 0; i < 2; i++)
+	{
+		alice.push_back(new Headers);
+		alice.back()->Set(kCookie, "user=alice");
+		bob.push_back(new Headers);
+		bob.back()->Set(kCookie, "user=bob");
+	}
+
+	// Personalized responses are neither stored nor replayed.
+	Serve(cache.Get(), "/home", kMethodGet, alice[0]);
+	string response = Serve(cache.Get(), "/home", kMethodGet, bob[0]);
+	EXPECT_NE(string::npos, response.find("calls=2"));
+	Serve(cache.Get(), "/home");
+	EXPECT_EQ(3, counter_.calls);
+
+	// Unless they are explicitly public.
+	counter_.headers.Set(kCacheControl, "public, max-age=60");
+	Serve(cache.Get(), "/logo", kMethodGet, alice[1]);
+	Serve(cache.Get(), "/logo", kMethodGet, bob[1]);
+	Serve(cache.Get(), "/logo");
+	EXPECT_EQ(4, counter_.calls);
+}
+
+TEST_F(ResponseCacheTest, Conditional)
+{
+	ScopedPtr<Handler> cache(Handler::CachingHandler(&counter_));
+	std::vector<Headers*> h;
+	for (int i = 0; i < 5; i++)
+		h.push_back(new Headers);
+	counter_.headers.Set(kCacheControl, "max-age=60");
+	counter_.headers.Set("ETag", "\"v1\"");
+	counter_.headers.Set("Last-Modified", "Sun, 06 Nov 1994 08:49:37 GMT");
+	const string not_modified = "HTTP/1.1 304 Not Modified\r\n"
+		"Cache-Control: max-age=60\r\n"
+		"ETag: \"v1\"\r\n"
+		"Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+		"\r\n";
+	Serve(cache.Get(), "/doc");
+
+	// Clients revalidating their copy are answered from the cache.
+	h[0]->Set(kIfNoneMatch, "\"v0\", W/\"v1\"");
+	EXPECT_EQ(not_modified, Serve(cache.Get(), "/doc", kMethodGet, h[0]));
+	h[1]->Set(kIfModifiedSince, "Mon, 07 Nov 1994 08:49:37 GMT");
+	EXPECT_EQ(not_modified, Serve(cache.Get(), "/doc", kMethodGet, h[1]));
+
+	// Outdated copies are replaced.
+	h[2]->Set(kIfNoneMatch, "\"v0\"");
+	EXPECT_NE(string::npos, Serve(cache.Get(), "/doc", kMethodGet,
+				h[2]).find("200 OK"));
+	h[3]->Set(kIfModifiedSince, "Sat, 05 Nov 1994 08:49:37 GMT");
+	EXPECT_NE(string::npos, Serve(cache.Get(), "/doc", kMethodGet,
+				h[3]).find("200 OK"));
+	// If-None-Match takes precedence.
+	h[4]->Set(kIfNoneMatch, "\"v0\"");
+	h[4]->Set(kIfModifiedSince, "Mon, 07 Nov 1994 08:49:37 GMT");
+	EXPECT_NE(string::npos, Serve(cache.Get(), "/doc", kMethodGet,
+				h[4]).find("200 OK"));
+	EXPECT_EQ(1, counter_.calls);
+}
+
+TEST_F(ResponseCacheTest, Limits)
+{
+	ResponseCacheOptions options;
+	options.ttl = std::chrono::milliseconds(20);
+	options.max_response_size = 20;
+	options.max_memory = 1024;
+	options.num_shards = 1;
+	ScopedPtr<Handler> cache(Handler::CachingHandler(&counter_,
+				options));
+
+	// Too large.
+	Serve(cache.Get(), "/long/path");
+	Serve(cache.Get(), "/long/path");
+	EXPECT_EQ(2, counter_.calls);
+
+	// Expired.
+	Serve(cache.Get(), "/");
+	Serve(cache.Get(), "/");
+	EXPECT_EQ(3, counter_.calls);
+	std::this_thread::sleep_for(std::chrono::milliseconds(30));
+	Serve(cache.Get(), "/");
+	EXPECT_EQ(4, counter_.calls);
+
+	// Only a few entries fit, the oldest ones are evicted.
+	for (int i = 0; i < 10; i++)
+		Serve(cache.Get(), "/" + std::to_string(i));
+	EXPECT_EQ(14, counter_.calls);
+	Serve(cache.Get(), "/9");
+	EXPECT_EQ(14, counter_.calls);
+	Serve(cache.Get(), "/0");
+	EXPECT_EQ(15, counter_.calls);
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
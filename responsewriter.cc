@@ -27,8 +27,16 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <string>
-#include <sstream>
+#include <strings.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
 
 #include "server.h"
 #include "server_internal.h"
@@ -40,21 +48,376 @@ namespace server
 using toolbox::siot::Connection;
 using std::string;
 
+// Size of the blocks in which files are read.
+static const size_t kFileBlockSize = 65536;
+
 ResponseWriter::~ResponseWriter()
 {
 }
 
-HTTPResponseWriter::HTTPResponseWriter(Connection* conn)
-: conn_(conn), written_(false)
+int
+ResponseWriter::Write(string&& data)
+{
+	return Write(data.data(), data.length());
+}
+
+int
+ResponseWriter::Write(const StringPiece* pieces, size_t count)
+{
+	int total = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		int ret = Write(pieces[i].data(), pieces[i].length());
+		if (ret < 0)
+			return ret;
+		total += ret;
+	}
+
+	return total;
+}
+
+int
+ResponseWriter::SendFile(int fd, off_t offset, size_t length)
+{
+	char buf[kFileBlockSize];
+	size_t sent = 0;
+
+	while (sent < length)
+	{
+		ssize_t got = pread(fd, buf, std::min(length - sent,
+					sizeof(buf)), offset + sent);
+		if (got <= 0)
+			return -1;
+
+		int ret = Write(buf, got);
+		if (ret < 0)
+			return ret;
+		sent += got;
+	}
+
+	return sent;
+}
+
+int
+ResponseWriter::WriteResponse(const StringPiece& head,
+		const StringPiece& body)
+{
+	// Take the head apart again: status line first, then the headers.
+	size_t eol = head.find('\n');
+	StringPiece status = head.substr(0, eol);
+	size_t code = status.find(' ');
+	size_t message = status.find(' ', code + 1);
+	Headers h;
+
+	if (code == StringPiece::npos)
+		return -1;
+
+	for (size_t pos = eol + 1; pos < head.length(); pos = eol + 1)
+	{
+		eol = head.find('\n', pos);
+		if (eol == StringPiece::npos)
+			eol = head.length();
+
+		StringPiece line = head.substr(pos, eol - pos);
+		size_t colon = line.find(':');
+		if (colon == StringPiece::npos)
+			continue;
+
+		size_t value = colon + 1;
+		while (value < line.length() && line[value] == ' ')
+			value++;
+		size_t end = line.length();
+		if (end > value && line[end - 1] == '\r')
+			end--;
+		h.Add(line.substr(0, colon).ToString(),
+				line.substr(value, end - value).ToString());
+	}
+
+	StringPiece text;
+	if (message != StringPiece::npos)
+		text = status.substr(message + 1);
+	if (!text.empty() && text[text.length() - 1] == '\r')
+		text = text.substr(0, text.length() - 1);
+
+	AddHeaders(h);
+	WriteHeader(atoi(status.substr(code + 1).ToString().c_str()),
+			text.ToString());
+	return body.empty() ? 0 : Write(body.data(), body.length());
+}
+
+int
+ResponseWriter::Write(const StringPiece& data)
+{
+	return Write(data.data(), data.length());
+}
+
+int
+ResponseWriter::Write(const char* data)
+{
+	return Write(data, strlen(data));
+}
+
+// Size up to which responses to pipelined requests are collected before
+// they're sent to the client.
+static const size_t kMaxQueuedOutput = 65536;
+
+// Space reserved up front for the status line and headers, which is enough
+// for most responses.
+static const size_t kHeadReserve = 512;
+
+// Longest possible chunk header: the length in hex and a line break.
+static const size_t kMaxChunkHeader = 2 * sizeof(size_t) + 2;
+
+// Formats the header of a chunk of length bytes into buf, which must have
+// room for kMaxChunkHeader bytes. Returns the length of the header.
+static size_t
+FormatChunkHeader(size_t length, char* buf)
+{
+	static const char kHexDigits[] = "0123456789abcdef";
+	size_t digits = 0;
+
+	for (size_t l = length; l > 0 || digits == 0; l >>= 4)
+		digits++;
+
+	for (size_t i = digits; i > 0; i--, length >>= 4)
+		buf[i - 1] = kHexDigits[length & 0xF];
+
+	buf[digits] = '\r';
+	buf[digits + 1] = '\n';
+	return digits + 2;
+}
+
+// Whether responses with the given status may have a body at all.
+static inline bool
+StatusHasBody(int status_code)
+{
+	return status_code >= 200 && status_code != 204 &&
+		status_code != 304;
+}
+
+// Serializes all values of headers onto out, one line each.
+static void
+AppendHeaders(const Headers& headers, string* out)
+{
+	for (const Header& hdr : headers)
+	{
+		for (size_t i = 0; i < hdr.NumValues(); i++)
+		{
+			out->append(hdr.GetName());
+			out->append(": ");
+			out->append(hdr.GetValue(i));
+			out->append("\r\n");
+		}
+	}
+}
+
+// Whether the serialized response head contains a field called name.
+static bool
+HeadHasField(const StringPiece& head, const StringPiece& name)
+{
+	for (size_t pos = head.find('\n'); pos != StringPiece::npos;
+			pos = head.find('\n', pos + 1))
+	{
+		StringPiece line = head.substr(pos + 1);
+		if (line.length() > name.length() &&
+				line[name.length()] == ':' &&
+				strncasecmp(line.data(), name.data(),
+					name.length()) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+// Gets the Date header line for the current second. Every thread formats
+// it at most once a second.
+static const string&
+DateHeaderLine()
+{
+	thread_local time_t cached_time = 0;
+	thread_local string cached_line;
+	time_t now = time(0);
+
+	if (now != cached_time)
+	{
+		cached_line = "Date: " + FormatHTTPDate(now) + "\r\n";
+		cached_time = now;
+	}
+
+	return cached_line;
+}
+
+string
+FormatHTTPDate(time_t t)
+{
+	// strftime() would use the names of the current locale.
+	static const char kDays[][4] = {
+		"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat",
+	};
+	static const char kMonths[][4] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+	};
+	struct tm tm;
+	char buf[32];
+
+	gmtime_r(&t, &tm);
+	return string(buf, snprintf(buf, sizeof(buf),
+				"%s, %02d %s %04d %02d:%02d:%02d GMT",
+				kDays[tm.tm_wday], tm.tm_mday,
+				kMonths[tm.tm_mon], tm.tm_year + 1900,
+				tm.tm_hour, tm.tm_min, tm.tm_sec));
+}
+
+bool
+ParseHTTPDate(const string& date, time_t* t)
+{
+	struct tm tm = {};
+	const char* end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT",
+			&tm);
+
+	if (!end || *end)
+		return false;
+
+	*t = timegm(&tm);
+	return true;
+}
+
+bool
+MatchesETag(const string& if_none_match, const string& etag)
+{
+	// Weak tags match strong ones with the same value.
+	size_t skip = etag.compare(0, 2, "W/") == 0 ? 2 : 0;
+	size_t length = etag.length() - skip;
+	size_t pos = 0;
+
+	while (pos < if_none_match.length())
+	{
+		size_t end = std::min(if_none_match.find(',', pos),
+				if_none_match.length());
+		size_t last = end;
+
+		while (pos < end && if_none_match[pos] == ' ')
+			pos++;
+		while (last > pos && if_none_match[last - 1] == ' ')
+			last--;
+		if (if_none_match.compare(pos, 2, "W/") == 0)
+			pos += 2;
+
+		if (last == pos + 1 && if_none_match[pos] == '*')
+			return true;
+		if (length > 0 && last == pos + length &&
+				if_none_match.compare(pos, length, etag, skip,
+					length) == 0)
+			return true;
+
+		pos = end + 1;
+	}
+
+	return false;
+}
+
+ResponseDefaults::ResponseDefaults(const Headers& headers)
+{
+	headers_.Merge(headers);
+	AppendHeaders(headers_, &serialized_);
+}
+
+ResponseDefaults::~ResponseDefaults()
+{
+}
+
+void
+ResponseDefaults::AppendTo(const Headers& set, const StringPiece& head,
+		string* out) const
+{
+	if (!set.Get(kDate) && !HeadHasField(head, KnownHeaderName(kDate)))
+		out->append(DateHeaderLine());
+
+	if (set.size() == 0 && head.empty())
+	{
+		out->append(serialized_);
+		return;
+	}
+
+	// The headers set by the handler take precedence.
+	for (const Header& hdr : headers_)
+	{
+		if (set.Get(hdr.GetName()) || HeadHasField(head, hdr.GetName()))
+			continue;
+
+		for (size_t i = 0; i < hdr.NumValues(); i++)
+		{
+			out->append(hdr.GetName());
+			out->append(": ");
+			out->append(hdr.GetValue(i));
+			out->append("\r\n");
+		}
+	}
+}
+
+HTTPResponseWriter::HTTPResponseWriter(Connection* conn, string* output)
+: conn_(conn), output_(output), defaults_(0), status_code_(0), buffer_size_(0),
+	remaining_(0), written_(false), chunked_(false), omit_body_(false),
+	buffering_(false), sized_(false), hold_(false), broken_(false)
 {
 }
 
 HTTPResponseWriter::~HTTPResponseWriter()
 {
+	// Handlers which don't write anything still produce a response.
+	if (!written_)
+		WriteHeader(200);
+
+	if (buffering_)
+	{
+		// The whole body fit into the buffer, so its length is known.
+		if (StatusHasBody(status_code_))
+			headers_.Set(kContentLength,
+					std::to_string(body_.length()));
+		WriteHead(status_code_, message_);
+		if (!omit_body_)
+			pending_.append(body_);
+	}
 	// If the connection was actually encoded as chunked, we need to
-	// send the final 0 byte to indicate the last chunk.
-	if (headers_.GetFirst("Transfer-Encoding") == "chunked")
-		conn_->Send("0\r\n\r\n");
+	// send the final 0 byte to indicate the last chunk. Broken responses
+	// mustn't look complete, though.
+	else if (!omit_body_ && chunked_ && !broken_)
+		pending_.append("0\r\n\r\n");
+
+	if (!pending_.empty())
+		Send(pending_);
+}
+
+void
+HTTPResponseWriter::OmitBody()
+{
+	omit_body_ = true;
+}
+
+void
+HTTPResponseWriter::SetBufferSize(size_t max_size)
+{
+	buffer_size_ = max_size;
+}
+
+void
+HTTPResponseWriter::SetDefaults(const ResponseDefaults* defaults)
+{
+	defaults_ = defaults;
+}
+
+void
+HTTPResponseWriter::HoldOutput()
+{
+	hold_ = true;
+}
+
+bool
+HTTPResponseWriter::Broken() const
+{
+	return broken_;
 }
 
 void
@@ -70,38 +433,283 @@ HTTPResponseWriter::WriteHeader(int status_code, string message)
 		return;
 
 	written_ = true;
-	if (!headers_.Get("Content-Length"))
-		headers_.Set("Transfer-Encoding", "chunked");
-	else if (!headers_.Get("Connection"))
-		headers_.Set("Connection", "keep-alive");
 
-	conn_->Send("HTTP/1.1 " + std::to_string(status_code) +
-			" " + message + "\r\n");
-	for (const string& h_name : headers_.HeaderNames())
+	// If the handler didn't decide on the framing, wait until it's clear
+	// whether the response is small enough to send with a length.
+	if (buffer_size_ > 0 && !headers_.Get(kContentLength) &&
+			!headers_.Get(kTransferEncoding))
+	{
+		buffering_ = true;
+		status_code_ = status_code;
+		message_.swap(message);
+		return;
+	}
+
+	WriteHead(status_code, message);
+}
+
+void
+HTTPResponseWriter::WriteHead(int status_code, const string& message)
+{
+	// Responses which can't have a body don't need any framing.
+	if (StatusHasBody(status_code))
+	{
+		if (!headers_.Get(kContentLength))
+			headers_.Set(kTransferEncoding, "chunked");
+		else if (!headers_.Get(kConnection))
+			headers_.Set(kConnection, "keep-alive");
+	}
+	else
+		omit_body_ = true;
+	chunked_ = headers_.GetFirst(kTransferEncoding) == "chunked";
+	const string& length = headers_.GetFirst(kContentLength);
+	sized_ = !chunked_ && !length.empty();
+	remaining_ = strtoull(length.c_str(), 0, 10);
+
+	// The head is only sent with the first body data, or once the
+	// response is complete.
+	pending_.reserve(kHeadReserve);
+	pending_.append("HTTP/1.1 ");
+	pending_.append(std::to_string(status_code));
+	pending_.push_back(' ');
+	pending_.append(message);
+	pending_.append("\r\n");
+	if (defaults_)
+		defaults_->AppendTo(headers_, StringPiece(), &pending_);
+	AppendHeaders(headers_, &pending_);
+	pending_.append("\r\n");
+}
+
+int
+HTTPResponseWriter::Write(const char* data, size_t length)
+{
+	StringPiece piece(data, length);
+	return Write(&piece, 1);
+}
+
+int
+HTTPResponseWriter::Write(string&& data)
+{
+	if (!written_)
+		WriteHeader(200);
+
+	if (broken_)
+		return -1;
+
+	// Hand the buffer to the connection as it is if there is nothing
+	// to add to it.
+	if (output_ || chunked_ || omit_body_ || buffering_ ||
+			!pending_.empty())
+		return Write(data.data(), data.length());
+
+	return conn_->Send(std::move(data));
+}
+
+int
+HTTPResponseWriter::Write(const StringPiece* pieces, size_t count)
+{
+	size_t length = 0;
+
+	if (!written_)
+		WriteHeader(200);
+
+	if (broken_)
+		return -1;
+
+	for (size_t i = 0; i < count; i++)
+		length += pieces[i].length();
+
+	if (buffering_)
 	{
-		const Header* hdr = headers_.Get(h_name);
+		if (body_.length() + length <= buffer_size_)
+		{
+			for (size_t i = 0; i < count; i++)
+				body_.append(pieces[i].data(),
+						pieces[i].length());
+			return length;
+		}
+
+		// Too large after all: send it chunked, starting with what
+		// has been buffered so far.
+		std::vector<StringPiece> all;
+		all.reserve(count + 1);
+		all.push_back(body_);
+		all.insert(all.end(), pieces, pieces + count);
+
+		buffering_ = false;
+		WriteHead(status_code_, message_);
+		int ret = Write(all.data(), all.size());
+		body_.clear();
+		return ret < 0 ? ret : length;
+	}
+
+	// An empty chunk would end the body.
+	if (omit_body_ || length == 0)
+		return length;
 
-		for (const string& value : hdr->GetValues())
-			conn_->Send(h_name + ": " + value + "\r\n");
+	// The data is copied exactly once: into the batch of pipelined
+	// responses if there is one, or else behind the pending head.
+	string* out = OutputBuffer();
+
+	if (chunked_)
+	{
+		char header[kMaxChunkHeader];
+		out->append(header, FormatChunkHeader(length, header));
 	}
 
-	conn_->Send("\r\n");
+	for (size_t i = 0; i < count; i++)
+		out->append(pieces[i].data(), pieces[i].length());
+
+	if (chunked_)
+		out->append("\r\n");
+
+	int ret = FlushOutput(Consume(length));
+	return ret < 0 ? ret : length;
 }
 
 int
-HTTPResponseWriter::Write(string data)
+HTTPResponseWriter::SendFile(int fd, off_t offset, size_t length)
 {
+	size_t sent = 0;
+
 	if (!written_)
 		WriteHeader(200);
 
-	if (headers_.GetFirst("Transfer-Encoding") == "chunked")
+	if (omit_body_)
+		return length;
+
+	// Buffered responses need to look at the data anyway.
+	if (buffering_)
+		return ResponseWriter::SendFile(fd, offset, length);
+
+	// Read the file straight into the output buffer, so every byte is
+	// only copied once in user space.
+	while (sent < length)
+	{
+		size_t block = std::min(length - sent, kFileBlockSize);
+		string* out = OutputBuffer();
+		size_t start = out->length();
+
+		if (chunked_)
+		{
+			char header[kMaxChunkHeader];
+			out->append(header, FormatChunkHeader(block, header));
+		}
+
+		size_t data = out->length();
+		out->resize(data + block);
+		ssize_t got = pread(fd, &(*out)[data], block, offset + sent);
+		if (got != ssize_t(block))
+		{
+			// The file is shorter than promised; the response
+			// can't be completed any more.
+			out->resize(start);
+			broken_ = true;
+			return -1;
+		}
+
+		if (chunked_)
+			out->append("\r\n");
+
+		if (FlushOutput(Consume(block)) < 0)
+			return -1;
+		sent += block;
+	}
+
+	return sent;
+}
+
+int
+HTTPResponseWriter::WriteResponse(const StringPiece& head,
+		const StringPiece& body)
+{
+	if (written_)
+		return -1;
+
+	written_ = true;
+
+	// Like in WriteHead(), responses with a body get the connection
+	// kept open unless someone said otherwise.
+	bool connection = headers_.Get(kConnection) ||
+		head.length() < 12 ||
+		!StatusHasBody(atoi(head.data() + 9)) ||
+		HeadHasField(head, KnownHeaderName(kConnection));
+
+	string* out = OutputBuffer();
+	if ((defaults_ || headers_.size() > 0 || !connection) &&
+			head.length() >= 2)
+	{
+		// Slip the other headers in ahead of the empty line.
+		out->append(head.data(), head.length() - 2);
+		if (defaults_)
+			defaults_->AppendTo(headers_, head, out);
+		AppendHeaders(headers_, out);
+		if (!connection)
+			out->append("Connection: keep-alive\r\n");
+		out->append("\r\n");
+	}
+	else
+		out->append(head.data(), head.length());
+	if (!omit_body_)
+		out->append(body.data(), body.length());
+
+	int ret = FlushOutput(true);
+	return ret < 0 ? ret : body.length();
+}
+
+string*
+HTTPResponseWriter::OutputBuffer()
+{
+	if (!output_)
+		return &pending_;
+
+	if (!pending_.empty())
+	{
+		output_->append(pending_);
+		pending_.clear();
+	}
+
+	return output_;
+}
+
+int
+HTTPResponseWriter::FlushOutput(bool complete)
+{
+	string* out = output_ ? output_ : &pending_;
+
+	if (output_ && (complete || hold_) &&
+			output_->length() < kMaxQueuedOutput)
+		return 0;
+
+	int ret = conn_->Send(*out);
+	out->clear();
+	return ret;
+}
+
+bool
+HTTPResponseWriter::Consume(size_t length)
+{
+	if (!sized_)
+		return false;
+
+	remaining_ -= std::min(remaining_, length);
+	return remaining_ == 0;
+}
+
+int
+HTTPResponseWriter::Send(const string& data)
+{
+	if (!output_)
+		return conn_->Send(data);
+
+	output_->append(data);
+	if (output_->length() >= kMaxQueuedOutput)
 	{
-		std::ostringstream oss;
-		oss << std::hex << data.length();
-		data = oss.str() + "\r\n" + data + "\r\n";
+		conn_->Send(*output_);
+		output_->clear();
 	}
 
-	return conn_->Send(data);
+	return data.length();
 }
 }  // namespace server
 }  // namespace http
@@ -0,0 +1,410 @@
+/*
+ * Unit Test for the HTTP Response Writer.
+ */
+
+#include "server.h"
+#include "server_internal.h"
+#include "test_connection.h"
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+class ResponseWriterTest : public ::testing::Test
+{
+};
+
+TEST_F(ResponseWriterTest, HeadWithFirstChunk)
+{
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		Headers h;
+		h.Set(kContentType, "text/plain");
+		rw.AddHeaders(h);
+
+		EXPECT_EQ(5, rw.Write("Hello"));
+		EXPECT_EQ(1, conn.sent.size());
+		EXPECT_EQ(0, rw.Write(""));
+		EXPECT_EQ(1, conn.sent.size());
+		EXPECT_EQ(17, rw.Write(string(17, 'x')));
+	}
+
+	ASSERT_EQ(3, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"\r\n"
+			"5\r\nHello\r\n", conn.sent[0]);
+	EXPECT_EQ("11\r\n" + string(17, 'x') + "\r\n", conn.sent[1]);
+	EXPECT_EQ("0\r\n\r\n", conn.sent[2]);
+}
+
+TEST_F(ResponseWriterTest, NothingWritten)
+{
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+	}
+
+	ASSERT_EQ(1, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"\r\n"
+			"0\r\n\r\n", conn.sent[0]);
+}
+
+TEST_F(ResponseWriterTest, Gather)
+{
+	RecordingConnection conn;
+	const StringPiece pieces[] = { "{\"a\":", "1", "}" };
+
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.WriteHeader(201, "Created");
+		EXPECT_EQ(7, rw.Write(pieces, 3));
+	}
+
+	EXPECT_EQ("HTTP/1.1 201 Created\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"\r\n"
+			"7\r\n{\"a\":1}\r\n"
+			"0\r\n\r\n", conn.All());
+}
+
+TEST_F(ResponseWriterTest, ContentLength)
+{
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		Headers h;
+		h.Set(kContentLength, "10");
+		rw.AddHeaders(h);
+		EXPECT_EQ(5, rw.Write(string("Hello")));
+		EXPECT_EQ(5, rw.Write(string("World")));
+	}
+
+	ASSERT_EQ(2, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Length: 10\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"Hello", conn.sent[0]);
+	EXPECT_EQ("World", conn.sent[1]);
+}
+
+TEST_F(ResponseWriterTest, OmitBody)
+{
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.OmitBody();
+		EXPECT_EQ(5, rw.Write("Hello"));
+	}
+
+	ASSERT_EQ(1, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"\r\n", conn.sent[0]);
+}
+
+TEST_F(ResponseWriterTest, HeadWithFirstData)
+{
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		Headers h;
+		h.Set(kContentLength, "5");
+		rw.AddHeaders(h);
+		EXPECT_EQ(5, rw.Write("Hello"));
+		// The head went out together with the body.
+		EXPECT_EQ(1, conn.sent.size());
+	}
+
+	ASSERT_EQ(1, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Length: 5\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"Hello", conn.sent[0]);
+}
+
+TEST_F(ResponseWriterTest, NoContent)
+{
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.WriteHeader(204, "No Content");
+		rw.Write("Hello");
+	}
+
+	ASSERT_EQ(1, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 204 No Content\r\n"
+			"\r\n", conn.sent[0]);
+}
+
+TEST_F(ResponseWriterTest, BufferedSmall)
+{
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.SetBufferSize(64);
+		EXPECT_EQ(6, rw.Write("Hello "));
+		EXPECT_EQ(5, rw.Write(string("World")));
+		EXPECT_EQ(0, conn.sent.size());
+	}
+
+	ASSERT_EQ(1, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Content-Length: 11\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"Hello World", conn.sent[0]);
+}
+
+TEST_F(ResponseWriterTest, BufferedOverflow)
+{
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.SetBufferSize(8);
+		rw.WriteHeader(404, "Not Found");
+		EXPECT_EQ(5, rw.Write("Hello"));
+		EXPECT_EQ(6, rw.Write(" World"));
+		EXPECT_EQ(1, conn.sent.size());
+	}
+
+	EXPECT_EQ("HTTP/1.1 404 Not Found\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"\r\n"
+			"b\r\nHello World\r\n"
+			"0\r\n\r\n", conn.All());
+}
+
+TEST_F(ResponseWriterTest, BufferedNoBody)
+{
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.SetBufferSize(64);
+		rw.WriteHeader(204, "No Content");
+	}
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.SetBufferSize(64);
+		rw.OmitBody();
+		rw.Write("Hello");
+	}
+
+	EXPECT_EQ("HTTP/1.1 204 No Content\r\n"
+			"\r\n"
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: 5\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n", conn.All());
+}
+
+TEST_F(ResponseWriterTest, SendFile)
+{
+	RecordingConnection conn;
+	FILE* f = tmpfile();
+	ASSERT_NE((FILE*) 0, f);
+	fputs("Hello, World!", f);
+	fflush(f);
+
+	{
+		HTTPResponseWriter rw(&conn);
+		EXPECT_EQ(5, rw.SendFile(fileno(f), 7, 5));
+		EXPECT_FALSE(rw.Broken());
+		// The file is too short, the response can't be completed.
+		EXPECT_EQ(-1, rw.SendFile(fileno(f), 7, 10));
+		EXPECT_TRUE(rw.Broken());
+		EXPECT_EQ(-1, rw.Write("more"));
+	}
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.SetBufferSize(64);
+		EXPECT_EQ(5, rw.SendFile(fileno(f), 0, 5));
+	}
+	fclose(f);
+
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"\r\n"
+			"5\r\nWorld\r\n"
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: 5\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"Hello", conn.All());
+}
+
+TEST_F(ResponseWriterTest, Batched)
+{
+	RecordingConnection conn;
+	string output;
+
+	{
+		HTTPResponseWriter rw(&conn, &output);
+		rw.HoldOutput();
+		rw.Write("a");
+	}
+	{
+		HTTPResponseWriter rw(&conn, &output);
+		Headers h;
+		h.Set(kContentLength, "1");
+		rw.AddHeaders(h);
+		rw.Write("b");
+	}
+
+	EXPECT_EQ(0, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"\r\n"
+			"1\r\na\r\n0\r\n\r\n"
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: 1\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"b", output);
+}
+
+TEST_F(ResponseWriterTest, Streamed)
+{
+	RecordingConnection conn;
+	string output = "HTTP/1.1 204 No Content\r\n\r\n";
+
+	{
+		HTTPResponseWriter rw(&conn, &output);
+		rw.Write("a");
+		// Incomplete responses go out right away, after the
+		// earlier ones.
+		ASSERT_EQ(1, conn.sent.size());
+		EXPECT_EQ("HTTP/1.1 204 No Content\r\n\r\n"
+				"HTTP/1.1 200 OK\r\n"
+				"Transfer-Encoding: chunked\r\n"
+				"\r\n"
+				"1\r\na\r\n", conn.sent[0]);
+		EXPECT_EQ("", output);
+	}
+
+	EXPECT_EQ(1, conn.sent.size());
+	EXPECT_EQ("0\r\n\r\n", output);
+}
+
+TEST_F(ResponseWriterTest, Defaults)
+{
+	RecordingConnection conn;
+	Headers defaults;
+	defaults.Set("Server", "libhttp-server");
+	defaults.Set("X-Content-Type-Options", "nosniff");
+	ResponseDefaults rd(defaults);
+
+	{
+		HTTPResponseWriter rw(&conn);
+		Headers h;
+		h.Set("Server", "custom");
+		h.Set(kContentLength, "5");
+		rw.SetDefaults(&rd);
+		rw.AddHeaders(h);
+		rw.Write("Hello");
+	}
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.SetDefaults(&rd);
+		rw.WriteResponse("HTTP/1.1 204 No Content\r\n\r\n", "");
+	}
+
+	ASSERT_EQ(2, conn.sent.size());
+
+	// Take the date out, it's different every second.
+	string date = "Date: " + FormatHTTPDate(time(0)) + "\r\n";
+	for (string& response : conn.sent)
+	{
+		size_t pos = response.find("Date: ");
+		ASSERT_NE(string::npos, pos);
+		EXPECT_EQ(date.length(), response.find('\n', pos) + 1 - pos);
+		response.erase(pos, date.length());
+	}
+
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"X-Content-Type-Options: nosniff\r\n"
+			"Server: custom\r\n"
+			"Content-Length: 5\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+			"Hello", conn.sent[0]);
+	EXPECT_EQ("HTTP/1.1 204 No Content\r\n"
+			"Server: libhttp-server\r\n"
+			"X-Content-Type-Options: nosniff\r\n"
+			"\r\n", conn.sent[1]);
+}
+
+TEST_F(ResponseWriterTest, DefaultsNotRepeated)
+{
+	Headers defaults;
+	defaults.Set("Server", "libhttp-server");
+	ResponseDefaults rd(defaults);
+	RecordingConnection conn;
+
+	{
+		HTTPResponseWriter rw(&conn);
+		Headers h;
+		h.Set(kDate, "Sun, 06 Nov 1994 08:49:37 GMT");
+		h.Set(kContentLength, "0");
+		rw.SetDefaults(&rd);
+		rw.AddHeaders(h);
+	}
+	{
+		HTTPResponseWriter rw(&conn);
+		rw.SetDefaults(&rd);
+		rw.WriteResponse("HTTP/1.1 200 OK\r\n"
+				"date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+				"Server: cached\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: keep-alive\r\n"
+				"\r\n", "");
+	}
+
+	ASSERT_EQ(2, conn.sent.size());
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"Server: libhttp-server\r\n"
+			"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n", conn.sent[0]);
+	EXPECT_EQ("HTTP/1.1 200 OK\r\n"
+			"date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+			"Server: cached\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n", conn.sent[1]);
+}
+
+TEST_F(ResponseWriterTest, FormatHTTPDate)
+{
+	EXPECT_EQ("Sun, 06 Nov 1994 08:49:37 GMT", FormatHTTPDate(784111777));
+	EXPECT_EQ("Thu, 01 Jan 1970 00:00:00 GMT", FormatHTTPDate(0));
+	EXPECT_EQ("Wed, 31 Dec 2025 23:59:59 GMT",
+			FormatHTTPDate(1767225599));
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
@@ -0,0 +1,167 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Benchmark for route templates, matching typical API paths against a
+// few dozen routes, compared to trying one std::regex per route in turn.
+
+#include <chrono>
+#include <cstdio>
+#include <regex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "server.h"
+#include "server_internal.h"
+
+using http::server::Handler;
+using http::server::Request;
+using http::server::ResponseWriter;
+using http::server::ServeMux;
+using std::string;
+
+class NullHandler : public Handler
+{
+public:
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+	}
+};
+
+// A router as it is commonly done: one regular expression per route, with
+// a capture group for each parameter.
+class RegexRouter
+{
+public:
+	void Handle(const string& route, Handler* handler)
+	{
+		string re;
+		size_t pos = 0;
+
+		while (pos < route.length())
+		{
+			size_t open = route.find('{', pos);
+			if (open == string::npos)
+			{
+				re += route.substr(pos);
+				break;
+			}
+
+			size_t close = route.find('}', open);
+			string param = route.substr(open + 1, close - open - 1);
+			re += route.substr(pos, open - pos);
+			if (param.find(":int") != string::npos)
+				re += "([0-9]+)";
+			else if (param.find("...") != string::npos)
+				re += "(.*)";
+			else
+				re += "([^/]+)";
+			pos = close + 1;
+		}
+
+		routes_.push_back(std::make_pair(std::regex(re), handler));
+	}
+
+	Handler* GetHandler(const string& path, std::smatch* match) const
+	{
+		for (const std::pair<std::regex, Handler*>& route : routes_)
+			if (std::regex_match(path, *match, route.first))
+				return route.second;
+
+		return 0;
+	}
+
+private:
+	std::vector<std::pair<std::regex, Handler*> > routes_;
+};
+
+template<typename Func>
+static void
+Run(const char* name, const std::vector<string>& paths, Func func)
+{
+	const int iterations = 200000;
+	std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	long found = 0;
+
+	for (int i = 0; i < iterations; i++)
+		found += func(paths[i % paths.size()]) != 0;
+
+	std::chrono::steady_clock::time_point end =
+		std::chrono::steady_clock::now();
+
+	printf("%-8s %12.1f %8ld\n", name,
+			std::chrono::duration<double, std::nano>(end -
+				start).count() / iterations, found);
+}
+
+int main(void)
+{
+	static const char* kResources[] = { "users", "orders", "invoices",
+		"products", "reviews", "teams", "projects", "tickets" };
+	NullHandler handler;
+	RegexRouter regex_router;
+	ServeMux mux;
+	std::vector<string> paths;
+
+	// 48 routes, 6 for each resource.
+	for (const char* resource : kResources)
+	{
+		string base = string("/api/v1/") + resource;
+		for (const string& route : { base, base + "/{id:int}",
+				base + "/{id:int}/comments",
+				base + "/{id:int}/comments/{comment:int}",
+				base + "/by-name/{name}",
+				base + "/{id:int}/files/{path...}" })
+		{
+			mux.Handle(route, &handler);
+			regex_router.Handle(route, &handler);
+		}
+
+		paths.push_back(base);
+		paths.push_back(base + "/4711");
+		paths.push_back(base + "/4711/comments/42");
+		paths.push_back(base + "/by-name/tonnerre");
+		paths.push_back(base + "/4711/files/docs/readme.txt");
+	}
+	paths.push_back("/api/v2/unknown");
+
+	printf("%-8s %12s %8s\n", "variant", "ns/lookup", "found");
+	Run("regex", paths, [&regex_router](const string& path) {
+			std::smatch match;
+			return regex_router.GetHandler(path, &match);
+		});
+	Request req;
+	Run("compiled", paths, [&mux, &req](const string& path) {
+			req.SetPath(path);
+			return mux.GetHandler("", req.Path(), &req);
+		});
+
+	return 0;
+}
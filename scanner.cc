@@ -0,0 +1,271 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SCANNER 1
+#include <immintrin.h>
+#endif
+
+#include "server.h"
+#include "server_internal.h"
+
+namespace http
+{
+namespace server
+{
+typedef size_t (*LineEndFunc)(const char* data, size_t len);
+typedef size_t (*FirstOfFunc)(const char* data, size_t len,
+		const char* set, size_t setlen);
+
+static inline bool
+ends_line(unsigned char c)
+{
+	return (c < 0x20 && c != '\t' && c != '\r') || c == 0x7f;
+}
+
+static size_t
+find_line_end_scalar(const char* data, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		if (ends_line(data[i]))
+			return i;
+
+	return len;
+}
+
+static size_t
+find_first_of_scalar(const char* data, size_t len, const char* set,
+		size_t setlen)
+{
+	if (setlen == 1)
+	{
+		const void* p = memchr(data, set[0], len);
+		return p ? static_cast<const char*>(p) - data : len;
+	}
+
+	for (size_t i = 0; i < len; i++)
+		if (memchr(set, data[i], setlen))
+			return i;
+
+	return len;
+}
+
+#ifdef HAVE_X86_SCANNER
+// Returns a bit mask of the bytes in x which end a line.
+__attribute__((target("sse4.2"))) static inline unsigned
+line_end_mask(__m128i x)
+{
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	// x <= 0x1f, unsigned.
+	__m128i c = _mm_cmpeq_epi8(_mm_min_epu8(x, ctl), x);
+	__m128i ok = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\t')),
+			_mm_cmpeq_epi8(x, _mm_set1_epi8('\r')));
+	__m128i hit = _mm_or_si128(_mm_andnot_si128(ok, c),
+			_mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f)));
+
+	return _mm_movemask_epi8(hit);
+}
+
+__attribute__((target("sse4.2"))) static size_t
+find_line_end_sse42(const char* data, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		unsigned mask = line_end_mask(_mm_loadu_si128(
+				reinterpret_cast<const __m128i*>(data + i)));
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + find_line_end_scalar(data + i, len - i);
+}
+
+__attribute__((target("sse4.2"))) static size_t
+find_first_of_sse42(const char* data, size_t len, const char* set,
+		size_t setlen)
+{
+	char setbuf[16] = { 0 };
+	size_t i = 0;
+
+	memcpy(setbuf, set, setlen);
+	const __m128i s = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(setbuf));
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128(
+				reinterpret_cast<const __m128i*>(data + i));
+		int idx = _mm_cmpestri(s, setlen, x, 16,
+				_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+				_SIDD_LEAST_SIGNIFICANT);
+
+		if (idx < 16)
+			return i + idx;
+	}
+
+	return i + find_first_of_scalar(data + i, len - i, set, setlen);
+}
+
+__attribute__((target("avx2"))) static size_t
+find_line_end_avx2(const char* data, size_t len)
+{
+	const __m256i ctl = _mm256_set1_epi8(0x1f);
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(data + i));
+		__m256i c = _mm256_cmpeq_epi8(_mm256_min_epu8(x, ctl), x);
+		__m256i ok = _mm256_or_si256(_mm256_cmpeq_epi8(x, tab),
+				_mm256_cmpeq_epi8(x, cr));
+		__m256i hit = _mm256_or_si256(_mm256_andnot_si256(ok, c),
+				_mm256_cmpeq_epi8(x, del));
+		unsigned mask = _mm256_movemask_epi8(hit);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	// Header lines are often shorter than 32 bytes, so try a 16 byte
+	// step before falling back to looking at single bytes. Calling the
+	// SSE version instead would mix VEX and legacy encoded instructions.
+	if (i + 16 <= len)
+	{
+		unsigned mask = line_end_mask(_mm_loadu_si128(
+				reinterpret_cast<const __m128i*>(data + i)));
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+
+	return i + find_line_end_scalar(data + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+find_first_of_avx2(const char* data, size_t len, const char* set,
+		size_t setlen)
+{
+	__m256i s[16];
+	size_t i = 0;
+
+	for (size_t j = 0; j < setlen; j++)
+		s[j] = _mm256_set1_epi8(set[j]);
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(data + i));
+		__m256i hit = _mm256_cmpeq_epi8(x, s[0]);
+
+		for (size_t j = 1; j < setlen; j++)
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(x, s[j]));
+
+		unsigned mask = _mm256_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + find_first_of_scalar(data + i, len - i, set, setlen);
+}
+#endif  /* HAVE_X86_SCANNER */
+
+static LineEndFunc find_line_end = find_line_end_scalar;
+static FirstOfFunc find_first_of = find_first_of_scalar;
+
+// Picks the best implementation before main() runs.
+static struct ScannerInit
+{
+	ScannerInit()
+	{
+		Scanner::Use(Scanner::Best());
+	}
+} scanner_init;
+
+size_t
+Scanner::FindLineEnd(const char* data, size_t len)
+{
+	return find_line_end(data, len);
+}
+
+size_t
+Scanner::FindFirstOf(const char* data, size_t len, const char* set,
+		size_t setlen)
+{
+	if (setlen == 0)
+		return len;
+
+	return find_first_of(data, len, set, setlen);
+}
+
+Scanner::Implementation
+Scanner::Best()
+{
+#ifdef HAVE_X86_SCANNER
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return kAVX2;
+	if (__builtin_cpu_supports("sse4.2"))
+		return kSSE42;
+#endif
+	return kScalar;
+}
+
+void
+Scanner::Use(Implementation impl)
+{
+	switch (impl)
+	{
+#ifdef HAVE_X86_SCANNER
+	case kAVX2:
+		find_line_end = find_line_end_avx2;
+		find_first_of = find_first_of_avx2;
+		break;
+	case kSSE42:
+		find_line_end = find_line_end_sse42;
+		find_first_of = find_first_of_sse42;
+		break;
+#endif
+	default:
+		find_line_end = find_line_end_scalar;
+		find_first_of = find_first_of_scalar;
+	}
+}
+}  // namespace server
+}  // namespace http
@@ -0,0 +1,149 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Microbenchmark for the delimiter scanner on typical browser request
+// heads between 500 bytes and 8KB.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "server.h"
+#include "server_internal.h"
+
+using http::server::Request;
+using http::server::RequestParser;
+using http::server::Scanner;
+using std::string;
+
+static const char* kHead =
+	"GET /search?q=libhttp-server&ie=UTF-8 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+	"(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+	"image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+	"Referer: https://www.example.com/\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n";
+
+static const char* kImplNames[] = { "scalar", "sse4.2", "avx2" };
+
+// Builds a request head of roughly size bytes by adding cookies.
+static string
+MakeHead(size_t size)
+{
+	string head = kHead;
+	int n = 0;
+
+	head += "Cookie: ";
+	while (head.length() + 4 < size)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "cookie%d=%016x%016x; ", n, n * 7919,
+				n * 104729);
+		head += buf;
+		n++;
+	}
+	head += "last=1\r\n\r\n";
+	return head;
+}
+
+template<typename Func>
+static double
+NanosPerRun(Func func, int iterations)
+{
+	std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++)
+		func();
+	std::chrono::steady_clock::time_point end =
+		std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end - start).count() /
+		iterations;
+}
+
+int main(void)
+{
+	const size_t sizes[] = { 512, 1024, 2048, 4096, 8192 };
+	const int iterations = 20000;
+	volatile size_t sink = 0;
+
+	printf("%-8s %-12s %12s %12s\n", "size", "variant", "ns/head",
+			"MB/s");
+
+	for (size_t size : sizes)
+	{
+		string head = MakeHead(size);
+
+		// What DecodeConnection used to do to find the lines.
+		double ns = NanosPerRun([&]() {
+			size_t pos = 0, lpos = 0;
+			while ((pos = head.find("\n", lpos)) != string::npos)
+				lpos = pos + 1;
+			sink += lpos;
+		}, iterations);
+		printf("%-8zu %-12s %12.1f %12.1f\n", head.length(),
+				"string-find", ns, head.length() * 1e3 / ns);
+
+		for (int impl = Scanner::kScalar; impl <= Scanner::Best();
+				impl++)
+		{
+			Scanner::Use(static_cast<Scanner::Implementation>(impl));
+
+			ns = NanosPerRun([&]() {
+				size_t pos = 0;
+				while (pos < head.length())
+					pos += Scanner::FindLineEnd(
+							head.data() + pos,
+							head.length() - pos) + 1;
+				sink += pos;
+			}, iterations);
+			printf("%-8zu %-12s %12.1f %12.1f\n", head.length(),
+					kImplNames[impl], ns,
+					head.length() * 1e3 / ns);
+
+			ns = NanosPerRun([&]() {
+				RequestParser parser;
+				Request req;
+				parser.Parse(head.data(), head.length());
+				parser.Fill(&req);
+				sink += parser.Consumed();
+			}, iterations / 10);
+			printf("%-8zu %-12s %12.1f %12.1f\n", head.length(),
+					(string(kImplNames[impl]) +
+					 "+fill").c_str(), ns,
+					head.length() * 1e3 / ns);
+		}
+	}
+
+	return sink == 0;
+}
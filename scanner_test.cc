@@ -0,0 +1,124 @@
+/*
+ * Unit Test for the Delimiter Scanner.
+ */
+
+#include "server.h"
+#include "server_internal.h"
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+class ScannerTest : public ::testing::Test
+{
+protected:
+	virtual void TearDown()
+	{
+		Scanner::Use(Scanner::Best());
+	}
+
+	// Runs the given check with every implementation supported here.
+	template<typename Check>
+	void ForAllImplementations(Check check)
+	{
+		for (int impl = Scanner::kScalar; impl <= Scanner::Best();
+				impl++)
+		{
+			Scanner::Use(static_cast<Scanner::Implementation>(impl));
+			check(impl);
+		}
+	}
+};
+
+TEST_F(ScannerTest, FindLineEnd)
+{
+	ForAllImplementations([](int impl) {
+		string line = "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n";
+
+		EXPECT_EQ(line.length() - 1, Scanner::FindLineEnd(
+					line.data(), line.length())) << impl;
+		EXPECT_EQ(line.length() - 1, Scanner::FindLineEnd(
+					line.data(), line.length() - 1)) << impl;
+		EXPECT_EQ(0, Scanner::FindLineEnd(line.data(), 0)) << impl;
+
+		string tabbed = "X-Foo:\tbar\xc3\xa4 \r\n";
+		EXPECT_EQ(tabbed.length() - 1, Scanner::FindLineEnd(
+					tabbed.data(), tabbed.length())) << impl;
+
+		string nul = "User-Agent: Mozilla/5.0 (X11; Linux x86_64)";
+		nul[30] = '\0';
+		EXPECT_EQ(30, Scanner::FindLineEnd(nul.data(),
+					nul.length())) << impl;
+
+		string del = "Host: www.example.com\x7f";
+		EXPECT_EQ(del.length() - 1, Scanner::FindLineEnd(
+					del.data(), del.length())) << impl;
+	});
+}
+
+TEST_F(ScannerTest, FindFirstOf)
+{
+	ForAllImplementations([](int impl) {
+		string cookie = "SID=31d4d96e407aad42d96e407aad42; lang=en-US";
+
+		EXPECT_EQ(3, Scanner::FindFirstOf(cookie.data(),
+					cookie.length(), ";=", 2)) << impl;
+		EXPECT_EQ(32, Scanner::FindFirstOf(cookie.data(),
+					cookie.length(), ";", 1)) << impl;
+		EXPECT_EQ(cookie.length(), Scanner::FindFirstOf(
+					cookie.data(), cookie.length(), "!",
+					1)) << impl;
+		EXPECT_EQ(cookie.length(), Scanner::FindFirstOf(
+					cookie.data(), cookie.length(), "",
+					0)) << impl;
+	});
+}
+
+TEST_F(ScannerTest, MatchesScalar)
+{
+	const char alphabet[] = "abcXYZ019 ;=:,\t\r\n\x01\x7f\x80\xff";
+	const char* sets[] = { ";", ";=", ": \t", "\r\n\x80\xff" };
+	std::srand(42);
+
+	for (int round = 0; round < 500; round++)
+	{
+		string data;
+		size_t len = std::rand() % 200;
+		for (size_t i = 0; i < len; i++)
+		{
+			// Mostly harmless characters, with the odd
+			// delimiter thrown in.
+			if (std::rand() % 16)
+				data.push_back('a' + std::rand() % 26);
+			else
+				data.push_back(alphabet[std::rand() %
+						(sizeof(alphabet) - 1)]);
+		}
+		size_t start = len ? std::rand() % len : 0;
+		const char* set = sets[round % 4];
+
+		Scanner::Use(Scanner::kScalar);
+		size_t line_end = Scanner::FindLineEnd(data.data() + start,
+				len - start);
+		size_t first_of = Scanner::FindFirstOf(data.data() + start,
+				len - start, set, strlen(set));
+
+		ForAllImplementations([&](int impl) {
+			EXPECT_EQ(line_end, Scanner::FindLineEnd(
+						data.data() + start,
+						len - start)) << impl;
+			EXPECT_EQ(first_of, Scanner::FindFirstOf(
+						data.data() + start,
+						len - start, set,
+						strlen(set))) << impl;
+		});
+	}
+}
+}  // namespace testing
+}  // namespace server
+}  // namespace http
@@ -27,11 +27,14 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
 #include <string>
-#include <regex>
+#include <vector>
 
-#include <iostream>
+#include <thread++/mutex.h>
 
 #include "server.h"
 #include "server_internal.h"
@@ -40,38 +43,697 @@ namespace http
 {
 namespace server
 {
-using std::pair;
-using std::regex;
 using std::string;
 
-static inline bool
-starts_with(string a, string b)
+// Node of the radix tree. The patterns are spelled out by the labels on
+// the way from the root to the nodes they end in.
+struct ServeMux::Node
 {
-	if (a.length() > b.length())
+	explicit Node(const string& l, Handler* h = 0)
+	: label(l), handler(h)
+	{
+	}
+
+	~Node()
+	{
+		for (Node* child : children)
+			delete child;
+	}
+
+	// Finds the position of the child whose label starts with c, or
+	// where it would have to be inserted.
+	std::vector<Node*>::const_iterator Find(char c) const
+	{
+		return std::lower_bound(children.begin(), children.end(), c,
+				[](const Node* n, char first) {
+					return n->label[0] < first;
+				});
+	}
+
+	// Gets the child whose label starts with c, if any.
+	Node* Child(char c) const
+	{
+		std::vector<Node*>::const_iterator it = Find(c);
+		return it != children.end() && (*it)->label[0] == c ? *it : 0;
+	}
+
+	// Label of the edge leading to this node; never empty, except for
+	// the root.
+	string label;
+
+	// Handler for the pattern ending here, if any.
+	Handler* handler;
+
+	// Children, ordered by the first byte of their labels, which are all
+	// different.
+	std::vector<Node*> children;
+};
+
+// Kinds of segments in route templates.
+enum RouteSegmentKind
+{
+	kLiteralSegment,
+	kIntSegment,
+	kStringSegment,
+	kRestSegment,
+};
+
+// Node of the automaton matching route templates, one segment of the path
+// at a time. Literal segments are tried first, then parameters, integer
+// ones before others, and finally a trailing wildcard.
+struct ServeMux::RouteNode
+{
+	explicit RouteNode(RouteSegmentKind k = kLiteralSegment,
+			const string& t = "")
+	: kind(k), text(t), handler(0), rest(0)
+	{
+	}
+
+	~RouteNode()
+	{
+		for (RouteNode* child : literals)
+			delete child;
+		for (RouteNode* child : params)
+			delete child;
+		delete rest;
+	}
+
+	// Finds the position of the literal child for the segment of len
+	// bytes at data, or where it would have to be inserted.
+	std::vector<RouteNode*>::const_iterator Find(const char* data,
+			size_t len) const
+	{
+		return std::lower_bound(literals.begin(), literals.end(),
+				StringPiece(data, len),
+				[](const RouteNode* n, const StringPiece& seg) {
+					return n->text.compare(0, string::npos,
+							seg.data(),
+							seg.length()) < 0;
+				});
+	}
+
+	// Gets the child for the given segment, creating it if necessary.
+	RouteNode* Child(RouteSegmentKind k, const string& t)
+	{
+		if (k == kLiteralSegment)
+		{
+			std::vector<RouteNode*>::const_iterator it =
+				Find(t.data(), t.length());
+			if (it == literals.end() || (*it)->text != t)
+				it = literals.insert(it, new RouteNode(k, t));
+			return *it;
+		}
+
+		if (k == kRestSegment)
+		{
+			if (!rest)
+				rest = new RouteNode(k, t);
+			return rest;
+		}
+
+		for (RouteNode* child : params)
+			if (child->kind == k && child->text == t)
+				return child;
+
+		// Integer parameters are more specific, so they go first.
+		std::vector<RouteNode*>::iterator it = params.begin();
+		if (k == kStringSegment)
+			it = params.end();
+		return *params.insert(it, new RouteNode(k, t));
+	}
+
+	RouteSegmentKind kind;
+
+	// The literal segment, or the name of the parameter.
+	string text;
+
+	// Name of the parameter, pointing into ServeMux::param_names_ so
+	// it can be referenced by requests.
+	StringPiece name;
+
+	// Handler for the route ending here, if any.
+	Handler* handler;
+
+	// Literal children ordered by their text, parameter children, and
+	// the trailing wildcard.
+	std::vector<RouteNode*> literals;
+	std::vector<RouteNode*> params;
+	RouteNode* rest;
+};
+
+// All patterns for one host, for the subdomains of one domain, or for all
+// hosts.
+struct ServeMux::Tree
+{
+	Tree()
+	: prefixes(""), has_routes(false)
+	{
+	}
+
+	Node prefixes;
+	RouteNode routes;
+	bool has_routes;
+};
+
+// An immutable set of trees, one for all hosts and one for every host or
+// wildcard domain with patterns of its own.
+struct ServeMux::Table
+{
+	~Table()
+	{
+		for (const std::pair<const string, Tree*>& host : hosts)
+			delete host.second;
+		for (const std::pair<const string, Tree*>& domain : wildcards)
+			delete domain.second;
+	}
+
+	Tree root;
+
+	// Trees for specific hosts, and for the subdomains of the domains
+	// in wildcards, keyed by the domain with a leading dot.
+	std::unordered_map<string, Tree*> hosts;
+	std::unordered_map<string, Tree*> wildcards;
+};
+
+// Tables are reclaimed based on epochs: every thread looking up a handler
+// announces the epoch it started in, in a slot of its own, and a table
+// replaced in some epoch can be freed once no thread announced that or an
+// earlier one. The slots are never freed, but reused once their thread
+// exits. Each one takes up a cache line of its own, so the threads don't
+// contend for them.
+struct ReaderSlot
+{
+	ReaderSlot()
+	: epoch(0), in_use(true), next(0)
+	{
+	}
+
+	// Epoch of the lookup in progress, or 0.
+	std::atomic<uint64_t> epoch;
+	std::atomic<bool> in_use;
+	ReaderSlot* next;
+	char padding[64];
+};
+
+static std::atomic<uint64_t> current_epoch(1);
+static std::atomic<ReaderSlot*> reader_slots(0);
+
+// Claims a reader slot for the thread for as long as it runs.
+class ThreadReaderSlot
+{
+public:
+	ThreadReaderSlot()
+	{
+		for (slot_ = reader_slots.load(); slot_; slot_ = slot_->next)
+		{
+			bool unused = false;
+			if (slot_->in_use.compare_exchange_strong(unused, true))
+				return;
+		}
+
+		slot_ = new ReaderSlot;
+		slot_->next = reader_slots.load();
+		while (!reader_slots.compare_exchange_weak(slot_->next, slot_))
+			;
+	}
+
+	~ThreadReaderSlot()
+	{
+		slot_->in_use.store(false);
+	}
+
+	ReaderSlot* Get() const
+	{
+		return slot_;
+	}
+
+private:
+	ReaderSlot* slot_;
+};
+
+// Marks the calling thread as looking at a routing table for as long as it
+// exists.
+class ReadSection
+{
+public:
+	ReadSection()
+	{
+		static thread_local ThreadReaderSlot thread_slot;
+
+		slot_ = thread_slot.Get();
+		slot_->epoch.store(current_epoch.load());
+	}
+
+	~ReadSection()
+	{
+		slot_->epoch.store(0, std::memory_order_release);
+	}
+
+private:
+	ReaderSlot* slot_;
+};
+
+// Finds the oldest epoch a lookup may still be going on in.
+static uint64_t
+OldestActiveEpoch()
+{
+	uint64_t oldest = current_epoch.load();
+
+	for (ReaderSlot* slot = reader_slots.load(); slot; slot = slot->next)
+	{
+		uint64_t epoch = slot->epoch.load();
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+
+	return oldest;
+}
+
+// One segment of a parsed route template.
+struct RouteSegment
+{
+	RouteSegmentKind kind;
+
+	// The literal segment, or the name of the parameter.
+	string text;
+};
+
+// Splits the route template into segments. Returns false if it is
+// malformed.
+static bool
+ParseRoute(const string& route, std::vector<RouteSegment>* segments)
+{
+	size_t num_params = 0;
+	size_t pos = 1;
+	bool last = false;
+
+	if (route.empty() || route[0] != '/')
 		return false;
 
-	return b.substr(0, a.length()) == a;
+	while (!last)
+	{
+		size_t end = std::min(route.find('/', pos), route.length());
+		RouteSegment seg = { kLiteralSegment,
+			route.substr(pos, end - pos) };
+		string& text = seg.text;
+
+		last = end == route.length();
+		pos = end + 1;
+
+		if (text.find_first_of("{}") == string::npos)
+		{
+			segments->push_back(seg);
+			continue;
+		}
+
+		if (text.length() < 3 || text[0] != '{' ||
+				text[text.length() - 1] != '}' ||
+				++num_params > Request::kMaxRouteParams)
+			return false;
+
+		text = text.substr(1, text.length() - 2);
+		size_t colon = text.find(':');
+		seg.kind = kStringSegment;
+
+		if (text.length() > 3 &&
+				text.compare(text.length() - 3, 3, "...") == 0)
+		{
+			// Wildcards take the rest of the path.
+			if (!last)
+				return false;
+			seg.kind = kRestSegment;
+			text.resize(text.length() - 3);
+		}
+		else if (colon != string::npos)
+		{
+			if (text.compare(colon + 1, string::npos, "int") == 0)
+				seg.kind = kIntSegment;
+			else if (text.compare(colon + 1, string::npos,
+						"string") != 0)
+				return false;
+			text.resize(colon);
+		}
+
+		if (text.empty() || text.find_first_of("{}:") != string::npos)
+			return false;
+
+		segments->push_back(seg);
+	}
+
+	return true;
+}
+
+string
+NormalizeHost(const string& host)
+{
+	size_t end = host.length();
+
+	// IPv6 addresses are in brackets, since they contain colons.
+	if (!host.empty() && host[0] == '[')
+	{
+		size_t bracket = host.find(']');
+		if (bracket != string::npos)
+			end = bracket + 1;
+	}
+	else
+		end = std::min(host.find(':'), end);
+
+	if (end > 0 && host[end - 1] == '.')
+		end--;
+
+	string ret(host, 0, end);
+	std::transform(ret.begin(), ret.end(), ret.begin(),
+			[](unsigned char c) { return std::tolower(c); });
+	return ret;
+}
+
+// Whether pattern is a valid prefix pattern or route template.
+static bool
+ValidPattern(const string& pattern)
+{
+	size_t slash = 0;
+	std::vector<RouteSegment> segments;
+
+	if (!pattern.empty() && pattern[0] != '/')
+		slash = std::min(pattern.find('/'), pattern.length());
+
+	return pattern.find('{', slash) == string::npos ||
+		ParseRoute(pattern.substr(slash), &segments);
+}
+
+ServeMux::ServeMux()
+: lock_(threadpp::Mutex::Create()), table_(new Table)
+{
 }
 
 ServeMux::~ServeMux()
 {
+	// Nobody can be looking up handlers anymore.
+	delete table_.load();
+	for (const std::pair<Table*, uint64_t>& retired : retired_)
+		delete retired.first;
 }
 
-void
+bool
 ServeMux::Handle(const string& pattern, Handler* handler)
 {
-	candidates_.insert(std::make_pair(pattern, handler));
+	return Register(pattern, handler, false);
+}
+
+bool
+ServeMux::Replace(const string& pattern, Handler* handler)
+{
+	return Register(pattern, handler, true);
+}
+
+bool
+ServeMux::Register(const string& pattern, Handler* handler, bool replace)
+{
+	threadpp::MutexLock lk(lock_.Get());
+
+	if (!ValidPattern(pattern))
+		return false;
+
+	for (std::pair<string, Handler*>& p : patterns_)
+	{
+		if (p.first == pattern)
+		{
+			if (replace && p.second != handler)
+			{
+				p.second = handler;
+				Publish();
+			}
+			return true;
+		}
+	}
+
+	patterns_.push_back(std::make_pair(pattern, handler));
+	Publish();
+	return true;
+}
+
+bool
+ServeMux::Remove(const string& pattern)
+{
+	threadpp::MutexLock lk(lock_.Get());
+
+	for (std::vector<std::pair<string, Handler*> >::iterator it =
+			patterns_.begin(); it != patterns_.end(); it++)
+	{
+		if (it->first == pattern)
+		{
+			patterns_.erase(it);
+			Publish();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void
+ServeMux::Publish()
+{
+	Table* table = new Table;
+
+	for (const std::pair<string, Handler*>& p : patterns_)
+	{
+		const string& pattern = p.first;
+		Tree* tree = &table->root;
+		size_t slash = 0;
+
+		if (!pattern.empty() && pattern[0] != '/')
+		{
+			slash = std::min(pattern.find('/'), pattern.length());
+			string host = NormalizeHost(pattern.substr(0, slash));
+			Tree*& t = host.compare(0, 2, "*.") == 0 ?
+				table->wildcards[host.substr(1)] :
+				table->hosts[host];
+
+			if (!t)
+				t = new Tree;
+			tree = t;
+		}
+
+		if (pattern.find('{', slash) == string::npos)
+		{
+			InsertPrefix(&tree->prefixes, pattern.substr(slash),
+					p.second);
+			continue;
+		}
+
+		std::vector<RouteSegment> segments;
+		ParseRoute(pattern.substr(slash), &segments);
+
+		RouteNode* n = &tree->routes;
+		for (const RouteSegment& seg : segments)
+		{
+			n = n->Child(seg.kind, seg.text);
+			if (seg.kind != kLiteralSegment)
+				n->name = *param_names_.insert(seg.text).first;
+		}
+		if (!n->handler)
+			n->handler = p.second;
+		tree->has_routes = true;
+	}
+
+	// Lookups starting from now on get the new table; the old one may
+	// only be in use by lookups which started in this epoch or before.
+	Table* old = table_.exchange(table);
+	retired_.push_back(std::make_pair(old, current_epoch.fetch_add(1)));
+
+	uint64_t oldest = OldestActiveEpoch();
+	std::vector<std::pair<Table*, uint64_t> >::iterator keep =
+		std::partition(retired_.begin(), retired_.end(),
+				[oldest](const std::pair<Table*,
+					uint64_t>& retired) {
+					return retired.second >= oldest;
+				});
+	for (std::vector<std::pair<Table*, uint64_t> >::iterator it = keep;
+			it != retired_.end(); it++)
+		delete it->first;
+	retired_.erase(keep, retired_.end());
+}
+
+void
+ServeMux::InsertPrefix(Node* root, const string& pattern, Handler* handler)
+{
+	Node* n = root;
+	size_t pos = 0;
+
+	while (pos < pattern.length())
+	{
+		Node* child = n->Child(pattern[pos]);
+		if (!child)
+		{
+			n->children.insert(n->Find(pattern[pos]),
+					new Node(pattern.substr(pos), handler));
+			return;
+		}
+
+		size_t common = 1;
+		while (common < child->label.length() &&
+				pos + common < pattern.length() &&
+				child->label[common] == pattern[pos + common])
+			common++;
+
+		if (common < child->label.length())
+		{
+			// The pattern ends or branches off within the label,
+			// so split it up.
+			Node* middle = new Node(child->label.substr(0, common));
+			child->label.erase(0, common);
+			middle->children.push_back(child);
+			*std::find(n->children.begin(), n->children.end(),
+					child) = middle;
+			child = middle;
+		}
+
+		pos += common;
+		n = child;
+	}
+
+	if (!n->handler)
+		n->handler = handler;
 }
 
 Handler*
 ServeMux::GetHandler(const string& path) const
 {
+	ReadSection section;
+
+	return Lookup(&table_.load()->root, path, 0);
+}
+
+Handler*
+ServeMux::GetHandler(const string& host, const string& path,
+		Request* req) const
+{
+	ReadSection section;
+	const Table* table = table_.load();
 	Handler* ret = 0;
 
-	for (pair<string, Handler*> p : candidates_)
+	if (!table->hosts.empty())
+	{
+		std::unordered_map<string, Tree*>::const_iterator it =
+			table->hosts.find(host);
+		if (it != table->hosts.end())
+			ret = Lookup(it->second, path, req);
+	}
+
+	// Try the wildcards for the parent domains, most specific first.
+	for (size_t dot = host.find('.'); !ret && !table->wildcards.empty() &&
+			dot != string::npos; dot = host.find('.', dot + 1))
+	{
+		std::unordered_map<string, Tree*>::const_iterator it =
+			table->wildcards.find(host.substr(dot));
+		if (it != table->wildcards.end())
+			ret = Lookup(it->second, path, req);
+	}
+
+	return ret ? ret : Lookup(&table->root, path, req);
+}
+
+Handler*
+ServeMux::Lookup(const Tree* tree, const string& path, Request* req)
+{
+	// Routes have to match the whole path, so they come first.
+	if (tree->has_routes && !path.empty() && path[0] == '/')
+	{
+		RouteParam params[Request::kMaxRouteParams];
+		size_t num_params = 0;
+		size_t len = std::min(path.find('?'), path.length());
+		Handler* handler = MatchRoute(&tree->routes, path.data(), len,
+				1, params, &num_params);
+
+		if (handler)
+		{
+			if (req)
+				req->SetRouteParams(params, num_params);
+			return handler;
+		}
+	}
+
+	return LookupPrefix(&tree->prefixes, path);
+}
+
+// Whether the bytes between begin and end are all decimal digits.
+static bool
+IsNumber(const char* begin, const char* end)
+{
+	return std::all_of(begin, end,
+			[](unsigned char c) { return std::isdigit(c) != 0; });
+}
+
+Handler*
+ServeMux::MatchRoute(const RouteNode* n, const char* path, size_t len,
+		size_t pos, RouteParam* params, size_t* num_params)
+{
+	// All segments are used up.
+	if (pos > len)
+		return n->handler;
+
+	const char* end = static_cast<const char*>(memchr(path + pos, '/',
+				len - pos));
+	size_t seg_end = end ? end - path : len;
+	size_t seg_len = seg_end - pos;
+	size_t count = *num_params;
+	Handler* ret;
+
+	std::vector<RouteNode*>::const_iterator it = n->Find(path + pos,
+			seg_len);
+	if (it != n->literals.end() && (*it)->text.length() == seg_len &&
+			memcmp((*it)->text.data(), path + pos, seg_len) == 0 &&
+			(ret = MatchRoute(*it, path, len, seg_end + 1, params,
+					  num_params)))
+		return ret;
+
+	for (const RouteNode* child : n->params)
 	{
-		if (starts_with(p.first, path))
-			ret = p.second;
+		if (seg_len == 0 || (child->kind == kIntSegment &&
+					!IsNumber(path + pos, path + seg_end)))
+			continue;
+
+		params[count].name = child->name;
+		params[count].offset = pos;
+		params[count].length = seg_len;
+		*num_params = count + 1;
+		if ((ret = MatchRoute(child, path, len, seg_end + 1, params,
+						num_params)))
+			return ret;
+		*num_params = count;
+	}
+
+	if (n->rest && n->rest->handler)
+	{
+		params[count].name = n->rest->name;
+		params[count].offset = pos;
+		params[count].length = len - pos;
+		*num_params = count + 1;
+		return n->rest->handler;
+	}
+
+	return 0;
+}
+
+Handler*
+ServeMux::LookupPrefix(const Node* root, const string& path)
+{
+	const Node* n = root;
+	Handler* ret = n->handler;
+	size_t pos = 0;
+
+	while (pos < path.length())
+	{
+		n = n->Child(path[pos]);
+		if (!n || n->label.length() > path.length() - pos ||
+				path.compare(pos, n->label.length(),
+					n->label) != 0)
+			break;
+
+		pos += n->label.length();
+		if (n->handler)
+			ret = n->handler;
 	}
 
 	return ret;
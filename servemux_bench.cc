@@ -0,0 +1,130 @@
+/*-
+ * Copyright (c) 2013 Tonnerre Lombard <tonnerre@ancient-solutions.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Benchmark for the serve multiplexer, looking up typical request paths
+// among a few hundred registered prefixes, compared to the linear scan
+// it used to do.
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "server.h"
+#include "server_internal.h"
+
+using http::server::Handler;
+using http::server::ResponseWriter;
+using http::server::Request;
+using http::server::ServeMux;
+using std::string;
+
+class NullHandler : public Handler
+{
+public:
+	virtual void ServeHTTP(ResponseWriter* w, const Request* req)
+	{
+	}
+};
+
+// What ServeMux used to do: walk all patterns, copying each of them.
+static Handler*
+LegacyGetHandler(const std::map<string, Handler*>& candidates,
+		const string& path)
+{
+	Handler* ret = 0;
+
+	for (std::pair<string, Handler*> p : candidates)
+		if (p.first.length() <= path.length() &&
+				path.substr(0, p.first.length()) == p.first)
+			ret = p.second;
+
+	return ret;
+}
+
+template<typename Func>
+static void
+Run(const char* name, const std::vector<string>& paths, Func func)
+{
+	const int iterations = 1000000;
+	std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	long found = 0;
+
+	for (int i = 0; i < iterations; i++)
+		found += func(paths[i % paths.size()]) != 0;
+
+	std::chrono::steady_clock::time_point end =
+		std::chrono::steady_clock::now();
+
+	printf("%-8s %12.1f %8ld\n", name,
+			std::chrono::duration<double, std::nano>(end -
+				start).count() / iterations, found);
+}
+
+int main(void)
+{
+	static const char* kServices[] = { "users", "orders", "billing",
+		"search", "flags", "config", "status", "media", "reports",
+		"auth" };
+	NullHandler handler;
+	std::map<string, Handler*> candidates;
+	ServeMux mux;
+	std::vector<string> paths;
+
+	// 300 prefixes of the form /api/v<n>/<service>/<resource>/.
+	for (int version = 1; version <= 3; version++)
+		for (const char* service : kServices)
+			for (int resource = 0; resource < 10; resource++)
+			{
+				string pattern = "/api/v" +
+					std::to_string(version) + "/" +
+					service + "/r" +
+					std::to_string(resource) + "/";
+				mux.Handle(pattern, &handler);
+				candidates.insert(std::make_pair(pattern,
+							&handler));
+				paths.push_back(pattern + "4711?fields=id");
+			}
+	mux.Handle("/", &handler);
+	candidates.insert(std::make_pair("/", &handler));
+	paths.push_back("/favicon.ico");
+	paths.push_back("/api/v4/unknown");
+
+	printf("%-8s %12s %8s\n", "variant", "ns/lookup", "found");
+	Run("legacy", paths, [&candidates](const string& path) {
+			return LegacyGetHandler(candidates, path);
+		});
+	Run("radix", paths, [&mux](const string& path) {
+			return mux.GetHandler(path);
+		});
+
+	return 0;
+}
@@ -6,7 +6,12 @@
 #include "server_internal.h"
 #include <gtest/gtest.h>
 
-#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace http
 {
@@ -52,6 +57,288 @@ TEST_F(ServeMuxTest, SimpleMatches)
 	EXPECT_EQ(&a, mux.GetHandler("/foo/bar/baz"));
 	EXPECT_EQ(&b, mux.GetHandler("/bar/foo/baz"));
 }
+
+TEST_F(ServeMuxTest, LongestPrefix)
+{
+	MockHandler a, b, c, d;
+	ServeMux mux;
+
+	mux.Handle("/api/", &a);
+	mux.Handle("/api/v1/", &b);
+	mux.Handle("/apis", &c);
+	mux.Handle("/api/v1/users", &d);
+
+	EXPECT_EQ(0, mux.GetHandler("/"));
+	EXPECT_EQ(0, mux.GetHandler("/api"));
+	EXPECT_EQ(&a, mux.GetHandler("/api/"));
+	EXPECT_EQ(&a, mux.GetHandler("/api/v2/users"));
+	EXPECT_EQ(&b, mux.GetHandler("/api/v1/user"));
+	EXPECT_EQ(&d, mux.GetHandler("/api/v1/users/4711"));
+	EXPECT_EQ(&c, mux.GetHandler("/apis/foo"));
+	EXPECT_EQ(0, mux.GetHandler(""));
+}
+
+TEST_F(ServeMuxTest, FirstRegistrationWins)
+{
+	MockHandler a, b;
+	ServeMux mux;
+
+	mux.Handle("/foo", &a);
+	mux.Handle("/foo", &b);
+	mux.Handle("/fo", &b);
+
+	EXPECT_EQ(&a, mux.GetHandler("/foo"));
+	EXPECT_EQ(&b, mux.GetHandler("/fox"));
+}
+
+TEST_F(ServeMuxTest, NormalizeHost)
+{
+	EXPECT_EQ("example.com", NormalizeHost("Example.COM"));
+	EXPECT_EQ("example.com", NormalizeHost("example.com:8080"));
+	EXPECT_EQ("example.com", NormalizeHost("example.com."));
+	EXPECT_EQ("[::1]", NormalizeHost("[::1]:443"));
+	EXPECT_EQ("", NormalizeHost(""));
+	// Bytes beyond ASCII are left alone.
+	EXPECT_EQ("b\xc3\xbc" "cher.example",
+			NormalizeHost("B\xc3\xbc" "cher.Example"));
+}
+
+TEST_F(ServeMuxTest, VirtualHosts)
+{
+	MockHandler all, static_files, example, wildcard, deep_wildcard;
+	ServeMux mux;
+
+	mux.Handle("/", &all);
+	mux.Handle("/static/", &static_files);
+	mux.Handle("Example.com", &example);
+	mux.Handle("*.example.com/api/", &wildcard);
+	mux.Handle("*.eu.example.com/api/", &deep_wildcard);
+
+	EXPECT_EQ(&example, mux.GetHandler("example.com", "/"));
+	EXPECT_EQ(&example, mux.GetHandler("example.com", "/static/a"));
+	EXPECT_EQ(&wildcard, mux.GetHandler("www.example.com", "/api/x"));
+	EXPECT_EQ(&deep_wildcard, mux.GetHandler("www.eu.example.com",
+				"/api/x"));
+	EXPECT_EQ(&wildcard, mux.GetHandler("eu.example.com", "/api/x"));
+
+	// Paths not covered for the host fall back to the other patterns.
+	EXPECT_EQ(&all, mux.GetHandler("www.example.com", "/"));
+	EXPECT_EQ(&static_files, mux.GetHandler("www.eu.example.com",
+				"/static/b"));
+	EXPECT_EQ(&all, mux.GetHandler("other.org", "/api/x"));
+	EXPECT_EQ(&all, mux.GetHandler("", "/api/x"));
+	EXPECT_EQ(&all, mux.GetHandler("/api/x"));
+}
+
+TEST_F(ServeMuxTest, Routes)
+{
+	MockHandler user, post, by_name, me, files, prefix;
+	ServeMux mux;
+	Request req;
+
+	EXPECT_TRUE(mux.Handle("/users/{id:int}", &user));
+	EXPECT_TRUE(mux.Handle("/users/{id:int}/posts/{post}", &post));
+	EXPECT_TRUE(mux.Handle("/users/{name}", &by_name));
+	EXPECT_TRUE(mux.Handle("/users/me/{tab}", &me));
+	EXPECT_TRUE(mux.Handle("/files/{path...}", &files));
+	EXPECT_TRUE(mux.Handle("/", &prefix));
+
+	req.SetPath("/users/42/posts/hello-world?draft=1");
+	EXPECT_EQ(&post, mux.GetHandler("", req.Path(), &req));
+	EXPECT_EQ("42", req.Param("id").ToString());
+	EXPECT_EQ("hello-world", req.Param("post").ToString());
+	EXPECT_EQ("", req.Param("name").ToString());
+
+	req.SetPath("/users/42");
+	EXPECT_EQ(&user, mux.GetHandler("", req.Path(), &req));
+	EXPECT_EQ("42", req.Param("id").ToString());
+	EXPECT_EQ("", req.Param("post").ToString());
+
+	// Not a number, even though the bytes are above 0x7f.
+	req.SetPath("/users/4\xd9\xa2");
+	EXPECT_EQ(&by_name, mux.GetHandler("", req.Path(), &req));
+
+	req.SetPath("/users/tonnerre");
+	EXPECT_EQ(&by_name, mux.GetHandler("", req.Path(), &req));
+	EXPECT_EQ("tonnerre", req.Param("name").ToString());
+
+	// Literal segments win over parameters.
+	req.SetPath("/users/me/settings");
+	EXPECT_EQ(&me, mux.GetHandler("", req.Path(), &req));
+	EXPECT_EQ("settings", req.Param("tab").ToString());
+	EXPECT_EQ("", req.Param("name").ToString());
+
+	req.SetPath("/files/a/b/c.txt");
+	EXPECT_EQ(&files, mux.GetHandler("", req.Path(), &req));
+	EXPECT_EQ("a/b/c.txt", req.Param("path").ToString());
+
+	// Paths not matching any route go to the prefix patterns.
+	EXPECT_EQ(&prefix, mux.GetHandler("/users/"));
+	EXPECT_EQ(&prefix, mux.GetHandler("/users/42/posts"));
+	EXPECT_EQ(&prefix, mux.GetHandler("/users/42/posts/"));
+	EXPECT_EQ(&prefix, mux.GetHandler("/files"));
+	EXPECT_EQ(&files, mux.GetHandler("/files/"));
+}
+
+TEST_F(ServeMuxTest, RouteBacktracking)
+{
+	MockHandler a, b;
+	ServeMux mux;
+	Request req;
+
+	// The literal segment matches first, but only the parameter leads
+	// to a complete route.
+	mux.Handle("/a/b/c", &a);
+	mux.Handle("/a/{x}/d", &b);
+
+	req.SetPath("/a/b/d");
+	EXPECT_EQ(&b, mux.GetHandler("", req.Path(), &req));
+	EXPECT_EQ("b", req.Param("x").ToString());
+	EXPECT_EQ(&a, mux.GetHandler("/a/b/c"));
+	EXPECT_EQ(0, mux.GetHandler("/a/b/e"));
+}
+
+TEST_F(ServeMuxTest, InvalidRoutes)
+{
+	MockHandler a;
+	ServeMux mux;
+
+	EXPECT_FALSE(mux.Handle("/users/{id", &a));
+	EXPECT_FALSE(mux.Handle("/users/{}", &a));
+	EXPECT_FALSE(mux.Handle("/users/x{id}", &a));
+	EXPECT_FALSE(mux.Handle("/users/{id:float}", &a));
+	EXPECT_FALSE(mux.Handle("/files/{path...}/x", &a));
+	EXPECT_FALSE(mux.Handle("/{a}/{b}/{c}/{d}/{e}/{f}/{g}/{h}/{i}", &a));
+	EXPECT_TRUE(mux.Handle("/{a}/{b}/{c}/{d}/{e}/{f}/{g}/{h}", &a));
+	EXPECT_EQ(0, mux.GetHandler("/users/1"));
+}
+
+TEST_F(ServeMuxTest, ReplaceAndRemove)
+{
+	MockHandler a, b;
+	ServeMux mux;
+
+	EXPECT_TRUE(mux.Handle("/foo/", &a));
+	EXPECT_TRUE(mux.Handle("/users/{id}", &a));
+	EXPECT_EQ(&a, mux.GetHandler("/foo/bar"));
+
+	EXPECT_TRUE(mux.Replace("/foo/", &b));
+	EXPECT_EQ(&b, mux.GetHandler("/foo/bar"));
+	EXPECT_FALSE(mux.Replace("/users/{", &b));
+
+	EXPECT_TRUE(mux.Remove("/foo/"));
+	EXPECT_FALSE(mux.Remove("/foo/"));
+	EXPECT_FALSE(mux.Remove("/bar/"));
+	EXPECT_EQ(0, mux.GetHandler("/foo/bar"));
+	EXPECT_EQ(&a, mux.GetHandler("/users/1"));
+
+	EXPECT_TRUE(mux.Remove("/users/{id}"));
+	EXPECT_EQ(0, mux.GetHandler("/users/1"));
+}
+
+TEST_F(ServeMuxTest, ConcurrentChanges)
+{
+	MockHandler stable, a, b;
+	ServeMux mux;
+	std::atomic<bool> done(false);
+	std::atomic<long> errors(0);
+	std::vector<std::thread> readers;
+
+	mux.Handle("/", &stable);
+
+	for (int i = 0; i < 4; i++)
+		readers.push_back(std::thread([&]() {
+			Request req;
+			req.SetPath("/users/42");
+
+			while (!done.load())
+			{
+				Handler* h = mux.GetHandler("", req.Path(),
+						&req);
+				Handler* p = mux.GetHandler("/api/x");
+				if ((h != &stable && h != &a && h != &b) ||
+						(p != &stable && p != &a &&
+						 p != &b) ||
+						(h != &stable &&
+						 req.Param("id") != "42"))
+					errors++;
+			}
+		}));
+
+	for (int i = 0; i < 2000; i++)
+	{
+		mux.Handle("/users/{id:int}", &a);
+		mux.Handle("/api/", &a);
+		mux.Replace("/api/", &b);
+		mux.Remove("/users/{id:int}");
+		mux.Remove("/api/");
+	}
+
+	done = true;
+	for (std::thread& t : readers)
+		t.join();
+
+	EXPECT_EQ(0, errors.load());
+	EXPECT_EQ(&stable, mux.GetHandler("/users/42"));
+}
+
+// The multiplexer as it used to be: the last of the patterns in
+// lexicographic order which are a prefix of the path.
+static Handler*
+ReferenceGetHandler(const std::map<string, Handler*>& candidates,
+		const string& path)
+{
+	Handler* ret = 0;
+
+	for (const std::pair<const string, Handler*>& p : candidates)
+		if (path.compare(0, p.first.length(), p.first) == 0)
+			ret = p.second;
+
+	return ret;
+}
+
+// Builds a random string of up to max_length bytes from a small alphabet,
+// so many strings share prefixes.
+static string
+RandomString(size_t max_length)
+{
+	static const char kAlphabet[] = "/ab.";
+	string ret(rand() % (max_length + 1), ' ');
+
+	for (char& c : ret)
+		c = kAlphabet[rand() % (sizeof(kAlphabet) - 1)];
+
+	return ret;
+}
+
+TEST_F(ServeMuxTest, Randomized)
+{
+	std::vector<MockHandler> handlers(200);
+
+	srand(4711);
+	for (int round = 0; round < 50; round++)
+	{
+		std::map<string, Handler*> reference;
+		ServeMux mux;
+
+		for (int i = rand() % handlers.size(); i >= 0; i--)
+		{
+			// Patterns not starting with a slash are for hosts.
+			string pattern = rand() % 20 == 0 ? "" :
+				"/" + RandomString(7);
+			mux.Handle(pattern, &handlers[i]);
+			reference.insert(std::make_pair(pattern,
+						&handlers[i]));
+		}
+
+		for (int i = 0; i < 1000; i++)
+		{
+			string path = RandomString(12);
+			ASSERT_EQ(ReferenceGetHandler(reference, path),
+					mux.GetHandler(path)) << path;
+		}
+	}
+}
 }  // namespace testing
 }  // namespace server
 }  // namespace http
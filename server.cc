@@ -31,6 +31,7 @@
 #include <siot/connection.h>
 #include <siot/server.h>
 #include <string>
+#include <thread>
 #include <thread++/mutex.h>
 #include <thread++/threadpool.h>
 #include <toolbox/expvar.h>
@@ -64,8 +65,12 @@ static ExpMap<int64_t> clientConnectionErrors("http-server-client-connection-err
 class TCPPeer : public Peer
 {
 public:
-	TCPPeer(Protocol* proto, Connection* sock)
-	: proto_(proto), sock_(sock)
+	TCPPeer(Protocol* proto, Connection* sock, size_t response_buffer_size,
+			const ResponseDefaults* defaults)
+	: proto_(proto), sock_(static_cast<AcknowledgementDecorator*>(sock)),
+		response_buffer_size_(response_buffer_size),
+		defaults_(defaults), lock_(Mutex::Create()), busy_(false),
+		woken_(false), terminated_(false)
 	{
 	}
 
@@ -76,27 +81,120 @@ public:
 
 	virtual string PeerAddress() const
 	{
-		return sock_->PeerAsText();
+		return sock_.PeerAsText();
 	}
 
-	virtual Connection* PeerSocket() const
+	virtual PeerConnection* PeerSocket() const
 	{
-		return sock_;
+		return &sock_;
 	}
 
 	virtual Server* Parent() const
 	{
-		return sock_->GetServer();
+		return sock_.GetServer();
+	}
+
+	virtual RequestParser* Parser() const
+	{
+		return &parser_;
+	}
+
+	virtual string* ReceiveBuffer() const
+	{
+		return &received_;
+	}
+
+	virtual Arena* RequestArena() const
+	{
+		return &arena_;
+	}
+
+	virtual size_t ResponseBufferSize() const
+	{
+		return response_buffer_size_;
+	}
+
+	virtual const ResponseDefaults* Defaults() const
+	{
+		return defaults_;
+	}
+
+	virtual bool BeginDecoding() const
+	{
+		MutexLock lk(lock_.Get());
+		if (busy_)
+		{
+			woken_ = true;
+			return false;
+		}
+		busy_ = true;
+		return true;
+	}
+
+	virtual bool EndDecoding() const
+	{
+		{
+			MutexLock lk(lock_.Get());
+			if (woken_ && !terminated_)
+			{
+				woken_ = false;
+				return true;
+			}
+			busy_ = false;
+			if (!terminated_)
+				return false;
+		}
+		// The connection went away while we were busy with it.
+		delete this;
+		return false;
+	}
+
+	// Makes sure the peer is decoded again once it is done with the
+	// current request, if it is busy.
+	void Wake()
+	{
+		MutexLock lk(lock_.Get());
+		if (busy_)
+			woken_ = true;
+	}
+
+	// Called when the connection has been terminated, before it is
+	// freed. Returns true if the peer can be deleted right away, or false
+	// if it is still busy, in which case it deletes itself in
+	// EndDecoding().
+	bool Terminate()
+	{
+		bool busy;
+		{
+			MutexLock lk(lock_.Get());
+			terminated_ = true;
+			busy = busy_;
+		}
+		sock_.Detach();
+		return !busy;
 	}
 
 private:
 	Protocol* const proto_;
-	Connection* const sock_;
+	mutable PeerConnection sock_;
+	const size_t response_buffer_size_;
+	const ResponseDefaults* const defaults_;
+	mutable RequestParser parser_;
+	mutable string received_;
+	mutable Arena arena_;
+
+	// Protects the state below, which tracks who is decoding the
+	// connection.
+	ScopedPtr<Mutex> lock_;
+	mutable bool busy_;
+	mutable bool woken_;
+	bool terminated_;
 };
 
 WebServer::WebServer()
 : multiplexer_(new ServeMux), executor_lock_(Mutex::Create()),
-	num_threads_(10), idle_timeout_(180), shutdown_(false)
+	num_threads_(10), idle_timeout_(180), response_buffer_size_(0),
+	defaults_(new ResponseDefaults(Headers())), shutdown_(false)
 {
 }
 
@@ -104,10 +202,22 @@ WebServer::~WebServer()
 {
 }
 
-void
+bool
 WebServer::Handle(const string& pattern, Handler* handler)
 {
-	multiplexer_->Handle(pattern, handler);
+	return multiplexer_->Handle(pattern, handler);
+}
+
+bool
+WebServer::Replace(const string& pattern, Handler* handler)
+{
+	return multiplexer_->Replace(pattern, handler);
+}
+
+bool
+WebServer::Remove(const string& pattern)
+{
+	return multiplexer_->Remove(pattern);
 }
 
 void
@@ -155,6 +265,30 @@ WebServer::SetIdleTimeout(int timeout)
 	idle_timeout_ = timeout;
 }
 
+void
+WebServer::SetResponseBufferSize(size_t max_size)
+{
+	response_buffer_size_ = max_size;
+}
+
+size_t
+WebServer::GetResponseBufferSize() const
+{
+	return response_buffer_size_;
+}
+
+void
+WebServer::SetDefaultHeaders(const Headers& headers)
+{
+	defaults_.Reset(new ResponseDefaults(headers));
+}
+
+const ResponseDefaults*
+WebServer::GetDefaults() const
+{
+	return defaults_.Get();
+}
+
 void
 WebServer::Shutdown()
 {
@@ -177,12 +311,33 @@ WebServer::ServeConnection(const Peer* peer)
 
 ProtocolServer::ProtocolServer(WebServer* parent, Protocol* proto,
 	       	ServeMux* mux)
-: parent_(parent), proto_(proto), multiplexer_(mux)
+: parent_(parent), proto_(proto), multiplexer_(mux),
+	peers_lock_(Mutex::Create())
 {
 }
 
 ProtocolServer::~ProtocolServer()
 {
+	// Peers still serving a request are left to delete themselves once
+	// they're done, without their connection.
+	for (map<Connection*, TCPPeer*>::iterator it = peers_.begin();
+			it != peers_.end(); it++)
+		if (it->second->Terminate())
+			delete it->second;
+}
+
+TCPPeer*
+ProtocolServer::GetPeer(Connection* conn)
+{
+	MutexLock lk(peers_lock_.Get());
+	TCPPeer*& peer = peers_[conn];
+
+	if (!peer)
+		peer = new TCPPeer(proto_, conn,
+				parent_->GetResponseBufferSize(),
+				parent_->GetDefaults());
+
+	return peer;
 }
 
 Connection*
@@ -194,13 +349,19 @@ ProtocolServer::AddDecorators(Connection* in)
 void
 ProtocolServer::DataReady(Connection* conn)
 {
-	TCPPeer peer(proto_, conn);
+	TCPPeer* peer = GetPeer(conn);
 	if (!conn->TryReadLock())
+	{
+		// Someone is reading from the connection, e.g. the body of
+		// the request being served. The new data is looked at once
+		// they are done.
+		peer->Wake();
 		return;
+	}
 	try
 	{
 		proto_->DecodeConnection(parent_->GetExecutor(),
-				multiplexer_, &peer);
+				multiplexer_, peer);
 	}
 	catch (toolbox::siot::ClientConnectionException ex)
 	{
@@ -215,12 +376,24 @@ ProtocolServer::ConnectionEstablished(Connection* conn)
 {
 	numConnections.Add(1);
 	numOpenConnections.Add(1);
+	GetPeer(conn);
 }
 
 void
 ProtocolServer::ConnectionTerminated(Connection* conn)
 {
 	numOpenConnections.Add(-1);
+
+	MutexLock lk(peers_lock_.Get());
+	map<Connection*, TCPPeer*>::iterator it = peers_.find(conn);
+	if (it != peers_.end())
+	{
+		// Requests still being served on the executor hold on to
+		// the peer until they're done.
+		if (it->second->Terminate())
+			delete it->second;
+		peers_.erase(it);
+	}
 }
 
 void
@@ -235,6 +408,116 @@ ProtocolServer::ConnectionFailed(string msg)
 	clientConnectionErrors.Add(msg, 1);
 }
 
+PeerConnection::PeerConnection(AcknowledgementDecorator* conn)
+: lock_(Mutex::Create()), conn_(conn)
+{
+}
+
+PeerConnection::~PeerConnection()
+{
+}
+
+int
+PeerConnection::Send(string data)
+{
+	MutexLock lk(lock_.Get());
+	if (!conn_)
+		return -1;
+	return conn_->Send(std::move(data));
+}
+
+string
+PeerConnection::Receive()
+{
+	MutexLock lk(lock_.Get());
+	if (!conn_)
+		return string();
+	return conn_->Receive();
+}
+
+bool
+PeerConnection::TryReadLock()
+{
+	MutexLock lk(lock_.Get());
+	return conn_ && conn_->TryReadLock();
+}
+
+void
+PeerConnection::Unlock()
+{
+	MutexLock lk(lock_.Get());
+	if (conn_)
+		conn_->Unlock();
+}
+
+void
+PeerConnection::SetBlocking(bool b)
+{
+	MutexLock lk(lock_.Get());
+	if (conn_)
+		conn_->SetBlocking(b);
+}
+
+void
+PeerConnection::DeferredShutdown()
+{
+	MutexLock lk(lock_.Get());
+	if (conn_)
+		conn_->DeferredShutdown();
+}
+
+string
+PeerConnection::PeerAsText()
+{
+	MutexLock lk(lock_.Get());
+	if (!conn_)
+		return string();
+	return conn_->PeerAsText();
+}
+
+Server*
+PeerConnection::GetServer()
+{
+	MutexLock lk(lock_.Get());
+	if (!conn_)
+		return 0;
+	return conn_->GetServer();
+}
+
+void
+PeerConnection::Acknowledge(size_t length)
+{
+	MutexLock lk(lock_.Get());
+	if (conn_)
+		conn_->Acknowledge(length);
+}
+
+bool
+PeerConnection::ReadLock()
+{
+	for (;;)
+	{
+		{
+			MutexLock lk(lock_.Get());
+			if (!conn_)
+				return false;
+			if (conn_->TryReadLock())
+				return true;
+		}
+
+		// Only held briefly by the I/O thread looking for new
+		// requests.
+		std::this_thread::yield();
+	}
+}
+
+void
+PeerConnection::Detach()
+{
+	MutexLock lk(lock_.Get());
+	conn_ = 0;
+}
+
 Protocol::~Protocol()
 {
 }
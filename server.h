@@ -30,10 +30,14 @@
  */
 
 #include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <list>
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
+#include <sys/types.h>
 
 #include <siot/connection.h>
 #include <siot/ssl.h>
@@ -58,16 +62,110 @@ using toolbox::siot::ConnectionCallback;
 using toolbox::siot::Server;
 using toolbox::siot::ssl::ServerSSLContext;
 
+class Arena;
 class Headers;
 class Peer;
 class Protocol;
 class ProtocolServer;
 class Request;
+class ResponseDefaults;
 class ServeMux;
 
 // Convert a string to a URL encoded string.
 string URLEncode(string input, bool skip_spaces = false);
 
+// Non-owning reference to a range of characters, e.g. a part of a receive
+// buffer. The referenced memory must outlive the piece.
+class StringPiece
+{
+public:
+	static const size_t npos = string::npos;
+
+	StringPiece()
+	: data_(0), length_(0)
+	{
+	}
+
+	StringPiece(const char* data, size_t length)
+	: data_(data), length_(length)
+	{
+	}
+
+	StringPiece(const string& str)
+	: data_(str.data()), length_(str.length())
+	{
+	}
+
+	StringPiece(const char* str)
+	: data_(str), length_(str ? strlen(str) : 0)
+	{
+	}
+
+	const char* data() const { return data_; }
+	size_t length() const { return length_; }
+	size_t size() const { return length_; }
+	bool empty() const { return length_ == 0; }
+	const char* begin() const { return data_; }
+	const char* end() const { return data_ + length_; }
+	char operator[](size_t pos) const { return data_[pos]; }
+
+	// Returns the part of the piece starting at pos, at most n bytes long.
+	StringPiece substr(size_t pos, size_t n = npos) const
+	{
+		if (pos > length_)
+			pos = length_;
+		if (n > length_ - pos)
+			n = length_ - pos;
+		return StringPiece(data_ + pos, n);
+	}
+
+	// Finds the first occurrence of c at or after pos.
+	size_t find(char c, size_t pos = 0) const
+	{
+		if (pos >= length_)
+			return npos;
+		const void* p = memchr(data_ + pos, c, length_ - pos);
+		return p ? static_cast<const char*>(p) - data_ : npos;
+	}
+
+	// Copies the referenced data into a new string.
+	string ToString() const { return string(data_, length_); }
+
+	bool operator==(const StringPiece& other) const
+	{
+		return length_ == other.length_ &&
+			(length_ == 0 ||
+			 memcmp(data_, other.data_, length_) == 0);
+	}
+
+	bool operator!=(const StringPiece& other) const
+	{
+		return !(*this == other);
+	}
+
+private:
+	const char* data_;
+	size_t length_;
+};
+
+// Convert a URL encoded string back to its original form; "+" is decoded
+// as a space unless plus_as_space is false (e.g. for paths). Malformed
+// escapes are kept as they are.
+string URLDecode(const StringPiece& input, bool plus_as_space = true);
+
+// Base class for objects which can be allocated from the Arena of a
+// request as well as from the heap, e.g. "new (arena) Headers". Deleting
+// an object which lives in an arena only runs its destructor; the memory
+// is reclaimed when the arena is reset.
+class ArenaObject
+{
+public:
+	static void* operator new(size_t size);
+	static void* operator new(size_t size, Arena* arena);
+	static void operator delete(void* ptr);
+	static void operator delete(void* ptr, Arena* arena);
+};
+
 // Wire protocol decoder class.
 class Protocol
 {
@@ -93,6 +191,69 @@ public:
 			const ServeMux* mux, const Peer* peer) = 0;
 };
 
+// Header fields common enough to get a slot of their own in Headers, so
+// they can be accessed without looking up their name.
+enum KnownHeader
+{
+	kAccept,
+	kAcceptCharset,
+	kAcceptEncoding,
+	kAcceptLanguage,
+	kAuthorization,
+	kCacheControl,
+	kConnection,
+	kContentEncoding,
+	kContentLength,
+	kContentType,
+	kCookie,
+	kDate,
+	kExpect,
+	kHost,
+	kIfMatch,
+	kIfModifiedSince,
+	kIfNoneMatch,
+	kIfRange,
+	kIfUnmodifiedSince,
+	kOrigin,
+	kPragma,
+	kRange,
+	kReferer,
+	kTransferEncoding,
+	kUpgrade,
+	kUserAgent,
+	kXForwardedFor,
+	kXRequestedWith,
+	kNumKnownHeaders,
+	kUnknownHeader = kNumKnownHeaders,
+};
+
+// Finds the known header called name, ignoring case. Returns
+// kUnknownHeader if there is no such known header.
+KnownHeader LookupKnownHeader(StringPiece name);
+
+// Returns the canonical name of the known header h.
+const char* KnownHeaderName(KnownHeader h);
+
+// Request methods defined by HTTP/1.1 and RFC 5789 (PATCH). Any other
+// method is an extension method, whose name is kept as a string.
+enum RequestMethod
+{
+	kMethodGet,
+	kMethodHead,
+	kMethodPost,
+	kMethodPut,
+	kMethodDelete,
+	kMethodConnect,
+	kMethodOptions,
+	kMethodTrace,
+	kMethodPatch,
+	kMethodExtension,
+};
+
+// Finds the standard method called name (case sensitive). Returns
+// kMethodExtension for anything else.
+RequestMethod LookupMethod(StringPiece name);
+
 // A regular HTTP/SPDY/? header. Can contain multiple values.
 class Header
 {
@@ -100,13 +261,16 @@ public:
 	// Construct a new header object with the given key and list of values.
 	Header(string key, list<string> values);
 
+	// Construct a new header object with the given key and no values.
+	explicit Header(string key);
+
 	virtual ~Header();
 
 	// Set the name of the header to something else.
 	void SetName(string newkey);
 
 	// Get the name the header is currently known under.
-	string GetName() const;
+	const string& GetName() const;
 
 	// Add a new value to the header object. It will be appended to the end
 	// of the value list.
@@ -120,11 +284,17 @@ public:
 	void ClearValues();
 
 	// Retrieve the first value of the header, as an easy accessor.
-	string GetFirstValue() const;
+	const string& GetFirstValue() const;
 
 	// Retrieve all values which are found in the header.
 	list<string> GetValues() const;
 
+	// Number of values of the header.
+	size_t NumValues() const;
+
+	// Retrieve the i-th value of the header without copying it.
+	const string& GetValue(size_t i) const;
+
 	// Merge the two header objects by adding all values from other to
 	// this vector. If the keys of the two objects differ (and the key of
 	// other is not empty), this will return false and do nothing.
@@ -136,31 +306,43 @@ public:
 
 private:
 	string key_;
-	list<string> values_;
+	// Most headers only have one value, which is kept inline.
+	string first_value_;
+	std::vector<string> more_values_;
+	size_t num_values_;
 };
 
-// Collection of header lines.
-class Headers
+// Collection of header lines. The headers are kept in the order they were
+// added, in one contiguous array. Names are compared case insensitively.
+class Headers : public ArenaObject
 {
 public:
+	typedef std::vector<Header>::const_iterator const_iterator;
+
 	// Create a new empty header list.
 	Headers();
 	virtual ~Headers();
 
-	// Add value as a new header value for key.
+	// Add value as a new header value for key. Known headers are stored
+	// under their canonical name.
 	void Add(string key, string value);
+	void Add(KnownHeader key, string value);
 
 	// Replace all values recorded for key with value.
 	void Set(string key, string value);
+	void Set(KnownHeader key, string value);
 
 	// Remove all values recorded for key, if any.
-	void Delete(string key);
+	void Delete(StringPiece key);
+	void Delete(KnownHeader key);
 
 	// Gets the first value of the header.
-	const string GetFirst(const string& key) const;
+	const string& GetFirst(StringPiece key) const;
+	const string& GetFirst(KnownHeader key) const;
 
 	// Get all values associated with key.
-	const Header* Get(const string& key) const;
+	const Header* Get(StringPiece key) const;
+	const Header* Get(KnownHeader key) const;
 
 	// Merge in the values of the new header lines.
 	void Merge(const Headers& headers);
@@ -168,8 +350,30 @@ public:
 	// Retrieves a list of all header names.
 	list<string> HeaderNames() const;
 
+	// Iterate over all headers without copying them.
+	const_iterator begin() const;
+	const_iterator end() const;
+	size_t size() const;
+
 private:
-	map<string, Header> headers_;
+	// Finds the position of key in headers_, or -1.
+	int Find(StringPiece key, uint32_t hash) const;
+
+	// Finds or creates the entry for key.
+	Header* Slot(KnownHeader key);
+	Header* Slot(string key);
+
+	// Appends a new header without values and returns its position.
+	int Append(string key, uint32_t hash);
+
+	// Recomputes the positions of the known headers.
+	void IndexKnownHeaders();
+
+	std::vector<Header> headers_;
+	// Case folded hashes of the names in headers_.
+	std::vector<uint32_t> hashes_;
+	// Position of the known headers in headers_, or -1.
+	int known_[kNumKnownHeaders];
 };
 
 // Backchannel for responses back to the client.
@@ -186,11 +390,35 @@ public:
 
 	// Write the given data to the HTTP/SPDY/? connection. Unlike
 	// WriteHeader, this can be called repeatedly. If WriteHeader hasn't
-	// been called, it is invoked with a status 200 (OK).
-	virtual int Write(string data) = 0;
+	// been called, it is invoked with a status 200 (OK). Returns the
+	// number of bytes of data written, or a negative value on error.
+	virtual int Write(const char* data, size_t length) = 0;
+
+	// Write a buffer the caller doesn't need anymore. Implementations
+	// may take it over instead of copying it.
+	virtual int Write(string&& data);
+
+	// Write the count pieces of data as though they were one buffer.
+	virtual int Write(const StringPiece* pieces, size_t count);
+
+	int Write(const StringPiece& data);
+	int Write(const char* data);
+
+	// Write length bytes of the file fd, starting at offset, as the
+	// body. The file position is not changed. Returns the number of
+	// bytes written, or a negative value on error.
+	virtual int SendFile(int fd, off_t offset, size_t length);
+
+	// Send a complete response whose status line and headers have been
+	// serialized ahead of time into head, which must end with the empty
+	// line. Headers added before are sent along with those in head.
+	// Must be the only thing written. Returns the number of bytes of
+	// body written, or a negative value on error.
+	virtual int WriteResponse(const StringPiece& head,
+			const StringPiece& body);
 };
 
-struct Cookie
+struct Cookie : public ArenaObject
 {
 	Cookie();
 	virtual ~Cookie();
@@ -218,8 +446,17 @@ struct Cookie
 	string ToString() const;
 };
 
+// Parameter taken from the path by a route template, e.g. "id" for
+// "/users/{id}". The value is located by its position in the path.
+struct RouteParam
+{
+	StringPiece name;
+	size_t offset;
+	size_t length;
+};
+
 // HTTP/SPDY/? request object.
-class Request
+class Request : public ArenaObject
 {
 public:
 	Request();
@@ -231,45 +468,84 @@ public:
 	// Returns the list of all cookies currently set.
 	virtual list<Cookie*> GetCookies() const;
 
+	// Returns the value of the cookie "name" sent by the client, or an
+	// empty piece if there is none. The Cookie header is only parsed the
+	// first time a cookie is looked up, and no Cookie objects are
+	// created. The piece is valid until the headers are replaced.
+	virtual StringPiece GetCookie(const StringPiece& name) const;
+
 	// Sets the headers to the given set. Takes ownership of the headers.
 	virtual void SetHeaders(Headers* headers);
 
+	// Allocates the objects the request creates for itself, such as the
+	// cookies sent by the client, from arena, which must outlive it.
+	virtual void SetArena(Arena* arena);
+
 	// Retrieves the headers for this request object.
 	virtual Headers* GetHeaders() const;
 
 	// Finds the first value for "key" in the submitted form and returns
-	// it.
+	// it. The form is taken from the query string of the path and, for
+	// application/x-www-form-urlencoded requests, from the request body,
+	// whose values come first. The form is only parsed on first access;
+	// this consumes the request body.
 	virtual string FirstFormValue(const string& key) const;
 
 	// Verifies that the requested protocol version is >= major.minor.
 	virtual bool ProtoAtLeast(int major, int minor) const;
 
 	// Gets the referer, if specified (extracted from headers).
-	virtual string Referer() const;
+	virtual const string& Referer() const;
 
 	// Gets the user agent, if specified (extracted from headers).
-	virtual string UserAgent() const;
+	virtual const string& UserAgent() const;
 
 	// Gets the host header, if specified (extracted from headers).
-	virtual string Host() const;
+	virtual const string& Host() const;
 
 	// Set the path of the request to the given value.
 	virtual void SetPath(const string& path);
 
 	// Retrieves the path specified in the request object.
-	virtual string Path() const;
+	virtual const string& Path() const;
+
+	// Most parameters a route template can have.
+	static const size_t kMaxRouteParams = 8;
+
+	// Sets the parameters found in the path by the route it matched.
+	// At most kMaxRouteParams are kept. The names must outlive the
+	// request.
+	virtual void SetRouteParams(const RouteParam* params, size_t count);
+
+	// Gets the value of the route parameter name, or an empty piece if
+	// there is none. The piece is valid until the path is changed.
+	virtual StringPiece Param(const StringPiece& name) const;
 
 	// Sets the protocol string used in the request.
 	virtual void SetProtocol(const string& proto);
 
+	// Sets the protocol to HTTP/major.minor.
+	virtual void SetProtoVersion(int major, int minor);
+
 	// Retrieves the protocol name used in the request (including version).
-	virtual string Protocol() const;
+	virtual const string& Protocol() const;
+
+	// The protocol version used in the request, or 0 if it isn't HTTP.
+	virtual int ProtoMajor() const;
+	virtual int ProtoMinor() const;
 
 	// Sets the action string used for the request.
 	virtual void SetAction(const string& action);
 
+	// Sets a standard action for the request.
+	virtual void SetMethod(RequestMethod method);
+
+	// Retrieves the action as a method constant, kMethodExtension if
+	// it's not a standard one.
+	virtual RequestMethod Method() const;
+
 	// Retrieves the action specified in the request (GET, POST, etc.).
-	virtual string Action() const;
+	virtual const string& Action() const;
 
 	// Sets the schema of the request; only used for URL formulation.
 	virtual void SetSchema(const string& schema);
@@ -293,14 +569,119 @@ public:
 	virtual string AsURL() const;
 
 private:
-	map<string, Cookie*> cookies_;
-	map<string, list<string> > form_values_;
+	// Splits the Cookie headers into cookie_views_, if not done yet.
+	void ParseCookies() const;
+
+	// Creates Cookie objects for all parsed cookies.
+	void MaterializeCookies() const;
+
+	// Deletes the Cookie objects created from the headers.
+	void ClearHeaderCookies() const;
+
+	// Cookies set with AddCookie(), and those created from the headers.
+	mutable map<string, Cookie*> cookies_;
+	mutable map<string, Cookie*> header_cookies_;
+	mutable bool cookies_parsed_;
+	mutable bool cookies_materialized_;
+	mutable string cookie_header_;
+	mutable std::vector<pair<StringPiece, StringPiece> > cookie_views_;
+	// Splits the query string and form body into form_views_, if not
+	// done yet.
+	void ParseForm() const;
+
+	mutable bool form_parsed_;
+	mutable bool form_body_read_;
+	mutable string form_body_;
+	mutable std::vector<pair<StringPiece, StringPiece> > form_views_;
 	Connection* request_body_reader_;
+	Arena* arena_;
 	ScopedPtr<Headers> headers_;
 	string schema_;
 	string path_;
+	RouteParam params_[kMaxRouteParams];
+	size_t num_params_;
+	// Only set for extension methods and protocols other than HTTP/1.x.
 	string protocol_;
 	string action_;
+	RequestMethod method_;
+	int proto_major_;
+	int proto_minor_;
+};
+
+// Reads the body of a request, decoding any gzip or deflate content
+// coding on the fly. The amount of decoded data is limited, so small
+// compressed bodies can't expand into huge amounts of memory.
+class BodyReader
+{
+public:
+	enum Status
+	{
+		kData,		// Some data was read; there may be more.
+		kEnd,		// The whole body has been read.
+		kTooLarge,	// The decoded body exceeds the size limit.
+		kInvalid,	// The body is corrupt or truncated, or uses an
+				// unsupported content coding.
+	};
+
+	// Read the body of req, which must stay around, decoding at most
+	// max_size bytes.
+	BodyReader(const Request* req, size_t max_size);
+	virtual ~BodyReader();
+
+	// Reads the next part of the decoded body, appending it to data.
+	Status Read(string* data);
+
+	// Reads the rest of the decoded body, appending it to data.
+	Status ReadAll(string* data);
+
+	// Number of decoded bytes read so far.
+	size_t BytesRead() const;
+
+private:
+	Connection* body_;
+	size_t remaining_;
+	size_t max_size_;
+	size_t decoded_;
+	struct z_stream_s* zs_;
+	bool own_zs_;
+	Status status_;
+};
+
+// Settings for compressing responses.
+struct CompressionOptions
+{
+	CompressionOptions();
+
+	// zlib compression level, from 1 (fastest) to 9 (smallest).
+	int level;
+
+	// Responses with smaller bodies are sent uncompressed.
+	size_t min_size;
+
+	// Prefixes of the content types which are compressed.
+	std::vector<string> types;
+};
+
+// Settings for caching complete responses.
+struct ResponseCacheOptions
+{
+	ResponseCacheOptions();
+
+	// How long responses are served from the cache.
+	std::chrono::milliseconds ttl;
+
+	// Memory all cached responses may take up together.
+	size_t max_memory;
+
+	// Responses with larger bodies aren't cached.
+	size_t max_response_size;
+
+	// Request headers the responses depend on besides the host and path.
+	// Responses varying on other headers aren't cached.
+	std::vector<string> vary;
+
+	// Number of independently locked parts of the cache.
+	size_t num_shards;
 };
 
 // Prototype for a handler for requests.
@@ -313,8 +694,47 @@ public:
 	// The details are left to the implementor.
 	virtual void ServeHTTP(ResponseWriter* w, const Request* req) = 0;
 
-	// Error message with the given error code and string.
+	// Error message with the given error code and string. The handler
+	// is shared and must not be deleted; the common errors are
+	// serialized ahead of time and sent with a single write. Only a
+	// limited number of distinct errors are kept; beyond that, the
+	// handler is only valid until the next call from the same thread.
 	static Handler* ErrorHandler(int errcode, const string& message);
+
+	// Serves the files below the directory root, the request path being
+	// taken relative to it. Supports conditional and range requests;
+	// directories are served by their index.html.
+	static Handler* FileServer(const string& root);
+
+	// Like FileServer, but keeps files of up to max_file_size bytes in
+	// memory, along with gzip compressed copies and their complete
+	// response heads. Cached files are checked for changes at most once
+	// a second. Once they take up more than max_memory bytes, the files
+	// cached first are dropped.
+	static Handler* CachedFileServer(const string& root,
+			size_t max_file_size = 65536,
+			size_t max_memory = 64 << 20);
+
+	// Serves requests using handler, compressing the responses with gzip
+	// or deflate if the client accepts it. Each write of the handler is
+	// passed on compressed as soon as it is made. Responses of types
+	// which can be compressed carry "Vary: Accept-Encoding" either way.
+	// The handler must outlive the returned one.
+	static Handler* CompressingHandler(Handler* handler,
+			const CompressionOptions& options =
+				CompressionOptions());
+
+	// Serves GET and HEAD requests using handler, keeping complete
+	// responses in memory and serving them from there until they
+	// expire. Responses which set cookies or which Cache-Control marks
+	// as private aren't cached, and neither are requests with
+	// credentials. Requests with cookies only share responses marked
+	// public. Conditional requests are answered with 304 from the cache
+	// if the copy of the client is still valid. The handler must outlive
+	// the returned one.
+	static Handler* CachingHandler(Handler* handler,
+			const ResponseCacheOptions& options =
+				ResponseCacheOptions());
 };
 
 // The actual HTTP server. By default, it runs on a threadpool with 10
@@ -328,8 +748,22 @@ public:
 
 	virtual ~WebServer();
 
-	// Handle all requests to a regexp matching pattern using handler.
-	void Handle(const string& pattern, Handler* handler);
+	// Handle all requests to a prefix pattern using handler. Patterns
+	// may be qualified with a host name, e.g. "example.com/api/", or a
+	// wildcard for its subdomains, e.g. "*.example.com/". Route
+	// templates like "/users/{id:int}/posts/{post}" match whole paths;
+	// their parameters are available through Request::Param(). Returns
+	// false if the pattern is malformed. See ServeMux.
+	bool Handle(const string& pattern, Handler* handler);
+
+	// Like Handle(), but replaces the handler if the pattern is already
+	// registered. Can be used while the server is running.
+	bool Replace(const string& pattern, Handler* handler);
+
+	// Stops handling the pattern, spelled exactly as it was registered.
+	// Can be used while the server is running, but requests which were
+	// already routed may still use the handler.
+	bool Remove(const string& pattern);
 
 	// Listen and serve using the protocol decoder proto on the address
 	// addr.
@@ -345,7 +779,9 @@ public:
 	// before Serve() or ListenAndServe(), but not necessarily before
 	// Handle(). Passing a zero argument will revert to the default
 	// behavior of creating a built-in threadpool. Takes ownership of
-	// the threadpool.
+	// the threadpool. Requests are parsed on the I/O threads of the
+	// server, then their handlers are run on the executor, so slow
+	// handlers don't hold up other connections.
 	void SetExecutor(threadpp::ThreadPool* executor);
 
 	// Sets the desired number of threads for the pool. After running
@@ -360,6 +796,26 @@ public:
 	// Serve you can specify your own parameters as you see fit.
 	void SetIdleTimeout(int timeout);
 
+	// Enables buffering of responses whose handlers don't set a
+	// Content-Length. Such responses are held back until they exceed
+	// max_size bytes; if the handler finishes before that, the response
+	// is sent in one go with a Content-Length header instead of chunked.
+	// 0 (the default) disables buffering. Only applies to connections
+	// accepted afterwards.
+	void SetResponseBufferSize(size_t max_size);
+
+	// Gets the size up to which responses are buffered.
+	size_t GetResponseBufferSize() const;
+
+	// Sets headers to send with every response, e.g. Server or security
+	// policies, unless the handler sets them itself. They're serialized
+	// once here rather than for every response. A Date header is always
+	// sent. Must be called before Serve() or ListenAndServe().
+	void SetDefaultHeaders(const Headers& headers);
+
+	// Gets the serialized default headers.
+	const ResponseDefaults* GetDefaults() const;
+
 	// Gets the associated threadpool in case something else wants to
 	// run in it.
 	threadpp::ThreadPool* GetExecutor();
@@ -379,6 +835,8 @@ private:
 	list<Server*> servers_;
 	uint32_t num_threads_;
 	int idle_timeout_;
+	size_t response_buffer_size_;
+	ScopedPtr<ResponseDefaults> defaults_;
 	bool shutdown_;
 };
 
@@ -29,14 +29,21 @@
  * HTTP/HTTPS/SPDY server implementation as a library.
  */
 
+#include <atomic>
 #include <chrono>
+#include <ctime>
 #include <list>
 #include <map>
-#include <regex>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include <thread++/mutex.h>
 #include <thread++/threadpool.h>
 #include <toolbox/scopedptr.h>
+#include <siot/acknowledgementdecorator.h>
 #include <siot/connection.h>
 #include <siot/server.h>
 
@@ -46,10 +53,10 @@ namespace server
 {
 using std::list;
 using std::map;
-using std::regex;
 using std::string;
 
 using toolbox::ScopedPtr;
+using toolbox::siot::AcknowledgementDecorator;
 using toolbox::siot::Connection;
 using toolbox::siot::ConnectionCallback;
 using toolbox::siot::Server;
@@ -57,7 +64,91 @@ using toolbox::siot::Server;
 class Headers;
 class Protocol;
 class Request;
+struct RouteParam;
+class RequestParser;
+class ResponseDefaults;
 class ServeMux;
+class TCPPeer;
+
+// Bump allocator for the objects belonging to a single request. Memory is
+// handed out from a small inline block, then from additional heap blocks;
+// very large allocations go straight to the heap. Everything is released at
+// once by Reset(), after all objects in the arena have been destroyed. One
+// heap block is kept across resets, so connections whose requests don't
+// fit the inline block don't allocate a new one for every request.
+class Arena
+{
+public:
+	Arena();
+	virtual ~Arena();
+
+	// Allocates size bytes, suitably aligned for any object.
+	void* Allocate(size_t size);
+
+	// Releases all memory handed out since the last reset.
+	void Reset();
+
+	// Number of bytes handed out since the last reset.
+	size_t BytesUsed() const;
+
+	// All allocations are aligned to this many bytes.
+	static const size_t kAlignment = 16;
+
+private:
+	// Size of the block within the arena, which is enough for the
+	// headers and the request of most requests.
+	static const size_t kInitialSize = 2048;
+
+	static const size_t kBlockSize = 8192;
+
+	// Allocations larger than this go to the heap.
+	static const size_t kMaxArenaAllocation = kBlockSize / 4;
+
+	alignas(kAlignment) char initial_[kInitialSize];
+	char* pos_;
+	char* limit_;
+	size_t used_;
+	std::vector<char*> blocks_;
+	std::vector<void*> large_;
+	// Block kept from before the last reset, if any.
+	char* spare_;
+};
+
+// The connection of a peer, as used while serving its requests. It stays
+// around as long as the peer, while the underlying connection is freed
+// once it has been terminated, possibly while a handler is still running.
+// From then on, sending fails and nothing is received anymore.
+class PeerConnection : public Connection
+{
+public:
+	explicit PeerConnection(AcknowledgementDecorator* conn);
+	virtual ~PeerConnection();
+
+	// Implements Connection.
+	virtual int Send(string data);
+	virtual string Receive();
+	virtual bool TryReadLock();
+	virtual void Unlock();
+	virtual void SetBlocking(bool b = true);
+	virtual void DeferredShutdown();
+	virtual string PeerAsText();
+	virtual Server* GetServer();
+
+	// Marks the first length bytes received as consumed.
+	void Acknowledge(size_t length);
+
+	// Waits until the read lock is available and takes it. Returns
+	// false if the connection has been terminated.
+	bool ReadLock();
+
+	// Lets go of the underlying connection, which is about to be freed.
+	// Waits for operations on it still in progress.
+	void Detach();
+
+private:
+	ScopedPtr<threadpp::Mutex> lock_;
+	AcknowledgementDecorator* conn_;
+};
 
 // Representation of the connections peer.
 class Peer
@@ -67,8 +158,42 @@ public:
 
 	virtual Protocol* PeerProtocol() const = 0;
 	virtual string PeerAddress() const = 0;
-	virtual Connection* PeerSocket() const = 0;
+	virtual PeerConnection* PeerSocket() const = 0;
 	virtual Server* Parent() const = 0;
+
+	// State of the request currently being received from the peer. It
+	// is kept across calls to the protocol decoder so partially received
+	// requests don't have to be parsed again.
+	virtual RequestParser* Parser() const = 0;
+
+	// Data received from the peer which hasn't been consumed yet. It is
+	// acknowledged to the connection as soon as it has been received, so
+	// only new data is copied out of the connection.
+	virtual string* ReceiveBuffer() const = 0;
+
+	// Arena for the objects of the request currently being processed.
+	// It is reset once the request has been served.
+	virtual Arena* RequestArena() const = 0;
+
+	// Size up to which responses without a Content-Length are buffered,
+	// or 0 if they aren't.
+	virtual size_t ResponseBufferSize() const = 0;
+
+	// Headers to send with every response.
+	virtual const ResponseDefaults* Defaults() const = 0;
+
+	// Claims the peer for decoding its requests. Only one thread at a
+	// time decodes a connection, and not while its current request is
+	// still being served on the executor. Returns false if the peer is
+	// busy; whoever holds it will then decode it again before letting go.
+	virtual bool BeginDecoding() const = 0;
+
+	// Lets go of the peer claimed by BeginDecoding(). Returns true if
+	// the peer was woken up in the meantime, in which case it is still
+	// claimed and has to be decoded again. Once it returns false, the
+	// peer must not be used anymore by the caller, as it may have been
+	// deleted if the connection was terminated while it was busy.
+	virtual bool EndDecoding() const = 0;
 };
 
 // Callback class to receive information from a Protocol implementation.
@@ -97,20 +222,113 @@ public:
 	virtual void ProcessRequest(Peer* p, Request* req) = 0;
 };
 
+// Lowercases the value of a Host header and strips the port and any
+// trailing dot from it.
+string NormalizeHost(const string& host);
+
 // Helper class for distributing the requests efficiently to their handlers.
+// The patterns are kept in compressed radix trees, so finding the handler
+// for a path takes time proportional to the length of the path rather than
+// the number of patterns, and doesn't allocate any memory. Patterns for
+// specific hosts go to a tree for each host, found through a hash table.
+//
+// The trees form an immutable routing table. Changes build a new table
+// and publish it through an atomic pointer, so handlers can be added and
+// removed while requests are being served. Lookups don't take any locks;
+// old tables are freed once no thread is looking at them anymore.
 class ServeMux
 {
 public:
+	ServeMux();
 	virtual ~ServeMux();
 
-	// Handle all requests to a prefix pattern using handler.
-	void Handle(const string& pattern, Handler* handler);
+	// Handle all requests to a prefix pattern using handler. Patterns
+	// starting with a slash apply to all hosts. Others start with a
+	// host name, like "example.com/static/", or a wildcard for all its
+	// subdomains, like "*.example.com/"; a host on its own covers all
+	// its paths. If the pattern is already registered, the handler
+	// registered first is kept.
+	//
+	// Patterns containing braces are route templates, which have to
+	// match the whole path (without the query string) rather than a
+	// prefix. Every segment between slashes is either literal or a
+	// parameter: "{name}" matches any nonempty segment, "{name:int}"
+	// only digits, and "{name...}" as the last segment the rest of the
+	// path. Routes take precedence over prefix patterns for the same
+	// host; literal segments over parameters, and integer parameters
+	// over others. Returns false if the template is malformed or has
+	// more than Request::kMaxRouteParams parameters.
+	bool Handle(const string& pattern, Handler* handler);
+
+	// Like Handle(), but replaces the handler if the pattern is already
+	// registered.
+	bool Replace(const string& pattern, Handler* handler);
+
+	// Unregisters the pattern, spelled exactly as it was registered.
+	// Returns false if it isn't registered. Requests already being
+	// served may still use the handler.
+	bool Remove(const string& pattern);
 
-	// Find the handler for the given path (closest matching prefix).
+	// Find the handler for the given path (longest matching prefix)
+	// among the patterns for all hosts.
 	Handler* GetHandler(const string& path) const;
 
+	// Find the handler for the path on host, which must have been
+	// normalized with NormalizeHost(). The patterns for the host itself
+	// come first, then those for the closest wildcard domain, then those
+	// for all hosts. If a route matches and req is given, the route
+	// parameters are stored in it; path must be its path then.
+	Handler* GetHandler(const string& host, const string& path,
+			Request* req = 0) const;
+
 private:
-	map<string, Handler*> candidates_;
+	struct Node;
+	struct RouteNode;
+	struct Tree;
+	struct Table;
+
+	// Adds pattern to the radix tree below root.
+	static void InsertPrefix(Node* root, const string& pattern,
+			Handler* handler);
+
+	// Finds the handler for the longest prefix of path below root.
+	static Handler* LookupPrefix(const Node* root, const string& path);
+
+	// Finds the handler for path among the patterns in tree.
+	static Handler* Lookup(const Tree* tree, const string& path,
+			Request* req);
+
+	// Matches the segments of the first len bytes of path, starting at
+	// pos, against the routes below n. Parameters are recorded from
+	// params[*num_params] on.
+	static Handler* MatchRoute(const RouteNode* n, const char* path,
+			size_t len, size_t pos, RouteParam* params,
+			size_t* num_params);
+
+	// Registers the pattern, replacing an existing registration if
+	// replace is set. Returns false if the pattern is malformed.
+	bool Register(const string& pattern, Handler* handler, bool replace);
+
+	// Builds a routing table from patterns_ and publishes it, freeing
+	// the old tables no longer in use. lock_ must be held.
+	void Publish();
+
+	// Guards all changes.
+	ScopedPtr<threadpp::Mutex> lock_;
+
+	// All registered patterns, in the order of registration.
+	std::vector<std::pair<string, Handler*> > patterns_;
+
+	// Names of the route parameters; they are referenced by requests,
+	// which may outlive the table they were routed with.
+	std::set<string> param_names_;
+
+	// The current routing table.
+	std::atomic<Table*> table_;
+
+	// Replaced tables which may still be in use, along with the epoch
+	// they were replaced in.
+	std::vector<std::pair<Table*, uint64_t> > retired_;
 };
 
 // An instance of the server taking care of a specific protocol.
@@ -129,27 +347,250 @@ public:
 	virtual void Error(Connection* conn);
 
 private:
+	// Finds the peer object for conn, creating it if necessary.
+	TCPPeer* GetPeer(Connection* conn);
+
 	WebServer* parent_;
 	Protocol* proto_;
 	ServeMux* multiplexer_;
+	ScopedPtr<threadpp::Mutex> peers_lock_;
+	map<Connection*, TCPPeer*> peers_;
+};
+
+// Vectorized search for delimiters in request data. The fastest
+// implementation supported by the CPU (AVX2, SSE4.2 or plain C++) is
+// selected by a static initializer when the library is loaded.
+class Scanner
+{
+public:
+	enum Implementation
+	{
+		kScalar,
+		kSSE42,
+		kAVX2,
+	};
+
+	// Finds the end of the line at the beginning of data, i.e. the first
+	// line feed. Any byte which may not appear in a request head
+	// (control characters other than horizontal tab and carriage return,
+	// and DEL) ends the scan too, so the caller has to check which byte
+	// was found. Returns len if there is neither.
+	static size_t FindLineEnd(const char* data, size_t len);
+
+	// Finds the first byte in data which is any of the setlen (at most
+	// 16) bytes in set. Returns len if there is none.
+	static size_t FindFirstOf(const char* data, size_t len,
+			const char* set, size_t setlen);
+
+	// Returns the fastest implementation supported by this CPU.
+	static Implementation Best();
+
+	// Switches to the given implementation, which must be supported.
+	// Only meant for tests and benchmarks.
+	static void Use(Implementation impl);
+};
+
+// Whether the Accept-Encoding header accept allows the content coding.
+bool AcceptsEncoding(const string& accept, const char* coding);
+
+// Formats t as an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+string FormatHTTPDate(time_t t);
+
+// Parses an HTTP date in the preferred format. Returns false if it's not
+// one.
+bool ParseHTTPDate(const string& date, time_t* t);
+
+// Whether the value of an If-None-Match header matches the entity tag,
+// using the weak comparison.
+bool MatchesETag(const string& if_none_match, const string& etag);
+
+// Parses an HTTP version of the form "HTTP/1.1" into its components.
+// Returns false if version is not of that form.
+bool ParseHTTPVersion(StringPiece version, int* major, int* minor);
+
+// Incremental parser for the head (request line and header fields) of an
+// HTTP/1.x request. The parser doesn't copy any data; it only records the
+// offsets of the tokens it found in the buffer. Since the receive buffer
+// only grows until the request has been consumed, Parse() can be invoked
+// again with a longer version of the same buffer and will resume where it
+// stopped, looking at every byte only once.
+class RequestParser
+{
+public:
+	enum State
+	{
+		kIncomplete,
+		kComplete,
+		kInvalid,
+	};
+
+	RequestParser();
+	virtual ~RequestParser();
+
+	// Forget everything about the current request and start over.
+	void Reset();
+
+	// Continue parsing the request head contained in data, which must
+	// start with the same bytes as the data passed to all previous calls
+	// since the last Reset().
+	State Parse(const char* data, size_t len);
+
+	// Gets the state reached by the last call to Parse().
+	State GetState() const;
+
+	// Number of bytes taken up by the request head, including the empty
+	// line terminating it. Only valid once the head is complete.
+	size_t Consumed() const;
+
+	// Accessors for the parsed tokens. The pieces point into the buffer
+	// passed to the last call to Parse().
+	StringPiece Method() const;
+	StringPiece Target() const;
+	StringPiece Version() const;
+	size_t NumHeaders() const;
+	StringPiece HeaderName(size_t i) const;
+	StringPiece HeaderValue(size_t i) const;
+
+	// Copies the parsed request head into req. Every token is copied
+	// exactly once. The headers, and the objects req creates later on,
+	// are allocated from arena, if given.
+	void Fill(Request* req, Arena* arena = 0) const;
+
+private:
+	struct Span
+	{
+		size_t offset;
+		size_t length;
+	};
+
+	bool ParseRequestLine(size_t start, size_t end);
+	bool ParseHeaderLine(size_t start, size_t end);
+	StringPiece Piece(const Span& span) const;
+
+	const char* data_;
+	size_t pos_;
+	size_t line_start_;
+	State state_;
+	bool have_request_line_;
+	Span method_;
+	Span target_;
+	Span version_;
+	std::vector<std::pair<Span, Span> > headers_;
+};
+
+// Headers sent with every response of a server, along with the Date. The
+// headers are serialized once, so they can be copied into the responses as
+// they are.
+class ResponseDefaults
+{
+public:
+	explicit ResponseDefaults(const Headers& headers);
+	virtual ~ResponseDefaults();
+
+	// Appends the Date header and all default headers which are neither
+	// in set nor in the serialized head to out, one line each.
+	void AppendTo(const Headers& set, const StringPiece& head,
+			string* out) const;
+
+private:
+	Headers headers_;
+	string serialized_;
 };
 
 class HTTPResponseWriter : public ResponseWriter
 {
 public:
-	// Create a new HTTP response writer for the connection "conn".
-	HTTPResponseWriter(Connection* conn);
+	// Create a new HTTP response writer for the connection "conn". If
+	// "output" is given, the response is appended to it once complete
+	// rather than sent right away, so the responses to pipelined
+	// requests can be sent together. Parts of a response which isn't
+	// complete yet are sent right away, preceded by output, so streamed
+	// responses reach the client as they are written. Should output grow
+	// too large, it is flushed to conn.
+	HTTPResponseWriter(Connection* conn, string* output = 0);
 	virtual ~HTTPResponseWriter();
 
 	// Implements ResponseWriter.
+	using ResponseWriter::Write;
 	virtual void AddHeaders(const Headers& to_add);
 	virtual void WriteHeader(int status_code, string message = "OK");
-	virtual int Write(string data);
+	virtual int Write(const char* data, size_t length);
+	virtual int Write(string&& data);
+	virtual int Write(const StringPiece* pieces, size_t count);
+	virtual int SendFile(int fd, off_t offset, size_t length);
+	virtual int WriteResponse(const StringPiece& head,
+			const StringPiece& body);
+
+	// Only send the status line and headers, but discard the body, as
+	// required for responses to HEAD requests.
+	void OmitBody();
+
+	// Hold back responses without a Content-Length until they exceed
+	// max_size bytes. Responses completed within that are sent with a
+	// Content-Length rather than chunked. Must be called before anything
+	// is written.
+	void SetBufferSize(size_t max_size);
+
+	// Send the Date header and the given default headers with the
+	// response. Must be called before anything is written.
+	void SetDefaults(const ResponseDefaults* defaults);
+
+	// Collect all of the response in output, complete or not, since more
+	// requests are waiting behind this one and the client reads the
+	// responses in order anyway. Applies to what is written afterwards.
+	void HoldOutput();
+
+	// Whether the response was cut short after its head went out, e.g.
+	// because the file being sent shrank. The client can then only tell
+	// where it ends by the connection being closed.
+	bool Broken() const;
 
 private:
+	// Chooses the framing of the response and serializes the head into
+	// pending_.
+	void WriteHead(int status_code, const string& message);
+
+	// Send data to the client, or queue it up in output_.
+	int Send(const string& data);
+
+	// Gets the buffer body data is to be appended to.
+	string* OutputBuffer();
+
+	// Sends out what has been appended to the output buffer, unless it
+	// is collected for pipelined responses. complete tells whether the
+	// response is complete now.
+	int FlushOutput(bool complete);
+
+	// Counts length bytes of the body as written. Returns true if that
+	// completes a response with a Content-Length.
+	bool Consume(size_t length);
+
 	Connection* conn_;
+	string* output_;
 	Headers headers_;
+	const ResponseDefaults* defaults_;
+
+	// Output which hasn't been sent yet: the serialized status line and
+	// headers until the first part of the body comes along, and chunks
+	// being assembled.
+	string pending_;
+
+	// Body held back while buffering, along with the status.
+	string body_;
+	string message_;
+	int status_code_;
+	size_t buffer_size_;
+
+	// Body bytes still to be written if the length is known.
+	size_t remaining_;
+
 	bool written_;
+	bool chunked_;
+	bool omit_body_;
+	bool buffering_;
+	bool sized_;
+	bool hold_;
+	bool broken_;
 };
 
 }  // namespace server
@@ -0,0 +1,64 @@
+/*
+ * Fake connections shared by the unit tests. Include after server.h.
+ */
+
+#ifndef HTTP_SERVER_TEST_CONNECTION_H
+#define HTTP_SERVER_TEST_CONNECTION_H
+
+#include <siot/connection.h>
+
+#include <string>
+#include <vector>
+
+namespace http
+{
+namespace server
+{
+namespace testing
+{
+// Connection recording everything sent through it, and whether it was shut
+// down. Receive() hands out what has been put into input.
+class RecordingConnection : public Connection
+{
+public:
+	RecordingConnection()
+	: shut_down(false)
+	{
+	}
+
+	virtual int Send(string data)
+	{
+		sent.push_back(data);
+		return data.length();
+	}
+
+	virtual string Receive()
+	{
+		string ret;
+		ret.swap(input);
+		return ret;
+	}
+
+	virtual void DeferredShutdown()
+	{
+		shut_down = true;
+	}
+
+	string All() const
+	{
+		string ret;
+		for (const string& s : sent)
+			ret += s;
+		return ret;
+	}
+
+	std::vector<string> sent;
+	string input;
+	bool shut_down;
+};
+
+}  // namespace testing
+}  // namespace server
+}  // namespace http
+
+#endif  /* HTTP_SERVER_TEST_CONNECTION_H */